@@ -0,0 +1,217 @@
+# bench.rb -> times the force, tree and I/O paths of Tara on generated
+# initial conditions (see bench/initial_conditions.rb)
+# usage (from the Tara directory):
+#   ruby bench/bench.rb [options] > results.jsonl
+# Every phase is run -r times on the same bodies and the fastest run
+# counts. One JSON object per model, N and phase goes to stdout (or -out),
+# a readable table to stderr. The phases:
+#   tree_build      TreeNode#build (Morton-sorted with -m)
+#   center_of_mass  the moments pass, TreeNode#center_of_mass
+#   tree_walk       TreeNode#accelerations
+#   fmm             TreeNode#fmm_accelerations, tree build included
+#   direct          SpeedUp.all_accelerations, up to -dm bodies
+#   thd_load        THDHandler#load_stream of a .thd file of the bodies
+#   snapshot_load   THDHandler#load_snapshot of their binary snapshot
+#   trajectory_text, trajectory_binary
+#                   one frame written by a TrajectoryWriter, closing
+#                   the file included
+$LOAD_PATH.unshift(File.dirname(File.dirname(File.expand_path(__FILE__))))
+require 'json'
+require 'tmpdir'
+require 'c_tree/tree'
+require 'vector/vector'
+require 'pairwise/pairwise'
+require 'particles/particles'
+require 'body.rb'
+require 'thd/thd_handler.rb'
+require 'parser.rb'
+require 'bench/initial_conditions.rb'
+
+# PARSER ----------------------------------------------------
+help_header = <<ENDSTR
+ruby bench/bench.rb > results.jsonl
+ruby bench/bench.rb -n 1000000 -mo plummer -ph tree_build,tree_walk
+Times tree build, moments, force walk, direct summation, loading and
+trajectory output on Plummer, uniform and cold collapse initial conditions.
+
+ENDSTR
+
+PHASES = ['tree_build', 'center_of_mass', 'tree_walk', 'fmm', 'direct',
+          'thd_load', 'snapshot_load', 'trajectory_text', 'trajectory_binary']
+
+parser = Parser.new
+parser.load ['-h', '--help', 'prints out help',
+  Proc.new{ parser.print_help(help_header) }, false, 0]
+
+@sizes = [100, 1000, 10000, 100000]
+parser.load ['-n', '--particles', 
+  'comma separated numbers of bodies, up to 10^6: <int,int,...>',
+  Proc.new{ |arg| @sizes = arg.split(',').collect {|n| n.to_i } }, false, 1]
+
+@models = InitialConditions::MODELS
+parser.load ['-mo', '--models', 
+  'comma separated initial conditions <plummer,uniform,cold>',
+  Proc.new{ |arg| @models = arg.split(',') }, false, 1]
+
+@phases = PHASES
+parser.load ['-ph', '--phases', 
+  "comma separated phases to time <#{PHASES.join(',')}>",
+  Proc.new{ |arg| @phases = arg.split(',') }, false, 1]
+
+@repeats = 3
+parser.load ['-r', '--repeats', 'runs of every phase: <int>',
+  Proc.new{ |arg| @repeats = arg.to_i }, false, 1]
+
+@direct_max = 20000
+parser.load ['-dm', '--direct_max', 
+  'largest N timed by direct summation: <int>',
+  Proc.new{ |arg| @direct_max = arg.to_i }, false, 1]
+
+@frames = 10
+parser.load ['-fr', '--frames', 'trajectory frames per run: <int>',
+  Proc.new{ |arg| @frames = arg.to_i }, false, 1]
+
+@tol = 0.5
+parser.load ['-tol', '--opening_tolerance', 'opening tolerance: <float>',
+  Proc.new{ |arg| @tol = arg.to_f }, false, 1]
+
+@eps = 0.01
+parser.load ['-e', '--epsilon', 'softening parameter: <float>',
+  Proc.new{ |arg| @eps = arg.to_f }, false, 1]
+
+@softening = 'plummer'
+parser.load ['-sk', '--softening', 'plummer, spline or none: <string>',
+  Proc.new{ |arg| @softening = arg }, false, 1]
+
+@threads = 1
+parser.load ['-th', '--threads', 'threads of the force passes: <int>',
+  Proc.new{ |arg| @threads = arg.to_i }, false, 1]
+
+@morton = false
+parser.load ['-m', '--morton', 'builds the tree from Morton-sorted bodies',
+  Proc.new{ @morton = true }, false, 0]
+
+@seed = 42
+parser.load ['-sd', '--seed', 'seed of the initial conditions: <int>',
+  Proc.new{ |arg| @seed = arg.to_i }, false, 1]
+
+@out = $stdout
+parser.load ['-out', '--output', 
+  'appends the JSON lines to a file instead of stdout: <filename>',
+  Proc.new{ |arg| @out = File.new(arg, 'a') }, false, 1]
+
+parser.parse_argv()
+(@phases - PHASES).each {|phase| raise "\nUnknown phase #{phase}!\n" }
+# ______________________________________ END PARSER
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+# the fastest of the repeats; setup runs before every repeat, untimed
+def best(setup=nil)
+  (1..@repeats).collect do
+    setup.call if setup
+    start = now
+    yield
+    now - start
+  end.min
+end
+
+# runs the block with $stderr muted: the loaders announce themselves
+# there, where the table goes
+def quietly
+  stderr, $stderr = $stderr, File.new(File::NULL, 'w')
+  yield
+ensure
+  $stderr.close
+  $stderr = stderr
+end
+
+def report(model, n, phase, seconds, interactions=nil)
+  result = { 'model' => model, 'n' => n, 'phase' => phase,
+             'seconds' => seconds, 'ns_per_particle' => seconds*1e9/n,
+             'interactions' => interactions,
+             'interactions_per_second' =>
+               interactions && seconds > 0 ? interactions/seconds : nil,
+             'threads' => @threads, 'tol' => @tol, 'eps' => @eps,
+             'softening' => @softening,
+             'morton' => @morton, 'repeats' => @repeats, 'seed' => @seed,
+             'ruby' => RUBY_VERSION, 'date' => Time.now.utc.to_s }
+  @out.puts result.to_json
+  @out.flush
+  $stderr.printf("%-8s %8d %-18s %12.6f s %10.1f ns/particle%s\n",
+                 model, n, phase, seconds, seconds*1e9/n,
+                 interactions ? sprintf(" %10.3e interactions/s",
+                                        interactions/seconds) : '')
+end
+
+# times the phases of one store; file phases write into dir
+def run(model, n, store, dir)
+  time = lambda {|phase| @phases.include?(phase) }
+  store.threads = @threads
+  store.softening = @softening
+  
+  if time['tree_build'] || time['center_of_mass'] || time['tree_walk'] then
+    tree = TreeNode.new
+    tree.morton = @morton
+    seconds = best { tree.build(store) }
+    report(model, n, 'tree_build', seconds) if time['tree_build']
+    seconds = best { tree.center_of_mass }
+    report(model, n, 'center_of_mass', seconds) if time['center_of_mass']
+    if time['tree_walk'] then
+      seconds = best { tree.accelerations(@tol, @eps) }
+      report(model, n, 'tree_walk', seconds, tree.interactions)
+    end
+  end
+  
+  if time['fmm'] then
+    # as NBody#make_tree sets the FMM up
+    tree = TreeNode.new
+    tree.morton = true
+    tree.leaf_size = 32
+    seconds = best { tree.build(store); tree.fmm_accelerations(@tol, @eps) }
+    report(model, n, 'fmm', seconds)
+  end
+  
+  if time['direct'] && n <= @direct_max then
+    seconds = best { SpeedUp.all_accelerations(store, @eps) }
+    report(model, n, 'direct', seconds, n*(n - 1))
+  end
+  
+  if time['thd_load'] || time['snapshot_load'] then
+    thd_file = File.join(dir, "#{model}_#{n}.thd")
+    File.open(thd_file, 'w') {|out| InitialConditions.write_thd(out, store) }
+    thd = THDHandler.new
+    seconds = quietly { best { thd.load_stream(thd_file) } }
+    report(model, n, 'thd_load', seconds) if time['thd_load']
+    if time['snapshot_load'] then
+      snapshot_file = File.join(dir, "#{model}_#{n}.thb")
+      thd.write_snapshot(snapshot_file, thd.create_bodies)
+      seconds = quietly { best { THDHandler.new.load_snapshot(snapshot_file) } }
+      report(model, n, 'snapshot_load', seconds)
+    end
+  end
+  
+  ['text', 'binary'].each do |format|
+    next unless time["trajectory_#{format}"]
+    trajectory = File.join(dir, "#{model}_#{n}.#{format}")
+    seconds = best do
+      File.open(trajectory, 'wb') do |io|
+        writer = TrajectoryWriter.new(io, format)
+        @frames.times {|k| writer.write(store, k.to_f) }
+        writer.close
+      end
+    end
+    report(model, n, "trajectory_#{format}", seconds/@frames)
+  end
+end
+
+Dir.mktmpdir('tara_bench') do |dir|
+  @models.each do |model|
+    @sizes.each do |n|
+      store = InitialConditions.generate(model, n, @seed)
+      run(model, n, store, dir)
+    end
+  end
+end
@@ -0,0 +1,90 @@
+# initial_conditions.rb -> reproducible initial conditions for the
+# benchmarks (see bench/bench.rb)
+#
+# Every model is in N-body units, G = M = 1, with n bodies of mass 1/n,
+# and is shifted into its centre of mass frame:
+#   plummer  a Plummer sphere in virial equilibrium (E = -1/4), drawn
+#            as in Aarseth, Henon & Wielen (1974)
+#   uniform  a homogeneous sphere of radius 1 with Gaussian velocities,
+#            virial ratio 1/2
+#   cold     the same sphere at rest, the cold collapse
+# The same model, n and seed always give the same bodies.
+
+module InitialConditions
+  MODELS = ['plummer', 'uniform', 'cold']
+  
+  # a Particles store of n bodies of the given model
+  def self.generate(model, n, seed=42)
+    unless MODELS.include?(model)
+      raise "\nUnknown model #{model}!\n" end
+    rng = Random.new(seed)
+    store = Particles.new(n)
+    n.times do
+      pos, vel = send(model, rng)
+      store.push(1.0/n, pos.to_v, vel.to_v)
+    end
+    to_center_of_mass(store)
+  end
+  
+  # writes the bodies of a store as a .thd document
+  def self.write_thd(out, store)
+    out.puts '<space>'
+    out.puts '  <cluster>'
+    store.size.times do |i|
+      out.puts "    <body id=\"#{i + 1}\" mass=\"#{store.mass(i)}\" " +
+               "pos=\"#{store.pos(i).to_a.join(' ')}\" " +
+               "vel=\"#{store.vel(i).to_a.join(' ')}\"/>"
+    end
+    out.puts '  </cluster>'
+    out.puts '</space>'
+  end
+  
+  def self.plummer(rng)
+    # radius from the cumulative mass profile, cut off at 10 scale radii
+    begin
+      r = 1.0/Math.sqrt(rng.rand**(-2.0/3.0) - 1.0)
+    end while r > 10.0
+    # speed in units of the escape speed by rejection from q^2 (1-q^2)^3.5
+    begin
+      q, g = rng.rand, 0.1*rng.rand
+    end while g > q*q*(1.0 - q*q)**3.5
+    v = q*Math.sqrt(2.0)*(1.0 + r*r)**-0.25
+    # the Plummer scale radius is 3 pi/16 in N-body units
+    a = 3.0*Math::PI/16.0
+    [isotropic(rng, r*a), isotropic(rng, v/Math.sqrt(a))]
+  end
+  
+  def self.uniform(rng)
+    # W = -3/5, so K = 3/10 for virial ratio 1/2: <v^2> = 3/5
+    sigma = Math.sqrt(0.2)
+    [isotropic(rng, rng.rand**(1.0/3.0)),
+     [gaussian(rng)*sigma, gaussian(rng)*sigma, gaussian(rng)*sigma]]
+  end
+  
+  def self.cold(rng)
+    [isotropic(rng, rng.rand**(1.0/3.0)), [0.0, 0.0, 0.0]]
+  end
+  
+  # a vector of length r in a random direction
+  def self.isotropic(rng, r)
+    z = 2.0*rng.rand - 1.0
+    phi = 2.0*Math::PI*rng.rand
+    s = Math.sqrt(1.0 - z*z)
+    [r*s*Math.cos(phi), r*s*Math.sin(phi), r*z]
+  end
+  
+  def self.gaussian(rng)
+    Math.sqrt(-2.0*Math.log(1.0 - rng.rand))*Math.cos(2.0*Math::PI*rng.rand)
+  end
+  
+  # removes the centre of mass position and velocity
+  def self.to_center_of_mass(store)
+    n, masses = store.size, store.masses
+    [[:positions, :positions=], [:velocities, :velocities=]].each do |get, set|
+      values = store.send(get)
+      values.sub!(VectorArray.new(Array.new(n, values.center_of_mass(masses))))
+      store.send(set, values)
+    end
+    store
+  end
+end
@@ -6,36 +6,72 @@ it 'belongs_to'. Things floating in free space belong to 'space'
 class Body
   require 'vector/vector'
   require 'pairwise/pairwise'
-  attr_accessor :id, :mass, :pos, :vel, :acc
+  require 'particles/particles'
+  attr_accessor :id, :belongs_to, :type
+  attr_reader :store, :index
   
+  # a freshly created Body lives in its own one-particle store until an
+  # NBody adopts it into the shared store (see Body#attach)
   def initialize(id, mass=1.0, pos=Vector.new,
                  vel=Vector.new, belongs_to='space', 
                  type='star')
-    @id, @mass = id, mass
+    @id = id
     @belongs_to = belongs_to
     @type = type
-    @pos, @vel = Vector.new(*pos), Vector.new(*vel)
-    @acc = Vector.new
+    @store = Particles.new(1)
+    @index = @store.push(mass.to_f, Vector.new(*pos), Vector.new(*vel))
   end
   
+  # a Body that is a view of a particle that already lives in store
+  def self.view(store, index, id, belongs_to='space', type='star')
+    body = allocate
+    body.instance_variable_set(:@id, id)
+    body.instance_variable_set(:@belongs_to, belongs_to)
+    body.instance_variable_set(:@type, type)
+    body.instance_variable_set(:@store, store)
+    body.instance_variable_set(:@index, index)
+    body
+  end
+  
+  # moves this body's data into another store and turns it into a view
+  # of that store
+  def attach(store)
+    index = store.push(mass, pos, vel)
+    store.set_acc(index, acc)
+    @store, @index = store, index
+    self
+  end
+  
+  def mass; @store.mass(@index) end
+  def pos;  @store.pos(@index)  end
+  def vel;  @store.vel(@index)  end
+  def acc;  @store.acc(@index)  end
+  
+  def mass=(m); @store.set_mass(@index, m.to_f) end
+  def pos=(v);  @store.set_pos(@index, v)       end
+  def vel=(v);  @store.set_vel(@index, v)       end
+  def acc=(v);  @store.set_acc(@index, v)       end
+  
+  # both update the store in place, without a Vector in between
   def kick(dt)
-    @vel += @acc*(0.5*dt)
+    @store.kick(dt, @index)
   end
   
   def drift(dt)
-    @pos += @vel*dt
+    @store.drift(dt, @index)
   end
   
   def e_kin
-    @vel*@vel*@mass*0.5
+    v = vel
+    v*v*mass*0.5
   end
   
   def e_pot(body_list, eps)
     epot = 0
     body_list.each do |other_body|
       unless other_body == self
-        epot += SpeedUp::get_potential_energy(@mass, other_body.mass,
-          @pos, other_body.pos, eps)
+        epot += SpeedUp::get_potential_energy(mass, other_body.mass,
+          pos, other_body.pos, eps)
       end
     end
     epot
@@ -46,15 +82,15 @@ class Body
   end
   
   def to_s
-    "mass = " + @mass.to_s + 
-    "   pos = " + "[#{@pos.to_a.join(", ")}]" + 
-    "   vel = " + "[#{@vel.to_a.join(", ")}]"
+    "mass = " + mass.to_s + 
+    "   pos = " + "[#{pos.to_a.join(", ")}]" + 
+    "   vel = " + "[#{vel.to_a.join(", ")}]"
   end
   
   def get_acc(other, tol, eps)
     acc = Vector.new
     if self != other then
-      acc = SpeedUp::pairwise_acc(@pos, other.pos, other.mass, eps) end
+      acc = SpeedUp::pairwise_acc(pos, other.pos, other.mass, eps) end
     acc
   end
   
@@ -69,98 +105,517 @@ be able to print out the stream
 class NBody
   require 'vector/vector'
   require 'rexml/document'
+  require 'json'
   require 'pairwise/pairwise'
+  require 'particles/particles'
+  
+  # the phases NBody#stats keeps the time of: kicks, drifts, tree builds
+  # and refits, the moments pass, force passes (tree walk, FMM, direct
+  # or Hermite step), the internal steps of subsystems, trajectory output
+  # and checkpoints
+  PHASES = ['kick', 'drift', 'tree_build', 'center_of_mass', 'force',
+            'subsystems', 'output', 'checkpoint']
   include REXML
   
-  attr_accessor :stream, :list
-  def initialize(stream=nil, list=[])
-    @stream = stream  # this is the open REXML document stream
-    @list = list      # the array of particles
+  attr_accessor :stream, :time, :checkpoint, :tol, :rebuild_threshold,
+                :mixed_precision
+  attr_reader :list, :particles
+  attr_reader :history, :evaluations, :tree_builds, :tree_refits
+  # if particles is given, the bodies in list already are views into it
+  # (see THDHandler#create_bodies) and are not copied
+  def initialize(stream=nil, list=[], particles=nil)
+    @stream = stream  # this is the open REXML document stream, if any
+    @history = []     # history entries, when there is no stream
+    @evaluations = 0  # force evaluations of single bodies so far
+    @tree_builds = @tree_refits = 0
+    reset_stats
+    if particles.nil? then
+      self.list = list  # the array of particles
+    else
+      @particles = particles
+      @list = list
+    end
+  end
+  
+  # adopts the bodies into a fresh contiguous particle store; from then
+  # on every Body is a view into @particles
+  def list=(list)
+    @particles = Particles.new(list.size)
+    @list = list.each {|b| b.attach(@particles) }
   end
   
-  def set_parameters(dt, t_start, t_end, out_dt, eps, step_out, use_tree)
+  def set_parameters(dt, t_start, t_end, out_dt, eps, step_out, use_tree,
+                     threads=1, morton=false, multipole_order=1,
+                     solver='tree')
     @dt = dt; @t_start = t_start; @t_end = t_end; @out_dt = out_dt;
     @eps = eps; @step_out = step_out; @use_tree = use_tree
+    @solver = use_tree ? solver : 'direct'
+    unless ['direct', 'tree', 'fmm'].include?(@solver)
+      raise "\nUnknown solver #{@solver}!\n" end
+    @morton = morton; @multipole_order = multipole_order
+    @particles.threads = threads
+  end
+  
+  # the softening of every force pass with eps: 'plummer' (the default),
+  # 'spline', the compact kernel that is Newtonian beyond 2.8 eps, or
+  # 'none' (see include/kernel.h)
+  def softening; @particles.softening end
+  def softening=(kind); @particles.softening = kind end
+  
+  # settings of the block integrator: steps go down to dt/2**max_level,
+  # and eta scales the step every body picks for itself
+  def set_block_steps(max_level, eta)
+    @max_level = max_level; @eta = eta
+  end
+  
+  # integrates the bodies below the named nodes of the THD hierarchy
+  # (see Body#belongs_to) as subsystems: the global integrator and
+  # solver see each one as a single particle at its centre of mass,
+  # while its internal motion takes steps direct Hermite steps of its
+  # own for every global step (see Subsystem)
+  def set_subsystems(names, steps=32)
+    @subsystem_names = names; @subsystem_steps = steps
   end
   
   # evolves the system over time
   def evolve(integrator, tol)
     @tol = tol if tol
-    time = @t_start
-    print_time = @out_dt
+    @integrator = integrator
+    # the internal stores of the subsystems and the global store are not
+    # part of a checkpoint, so a restart could not carry on exactly
+    if @subsystem_names && @checkpoint then
+      raise "\nA run with subsystems cannot be checkpointed!\n" end
+    # a restarted run carries on with the time, step count and
+    # accelerations of its checkpoint
+    unless @restarted
+      @time = @t_start
+      @step = 0
+    end
+    if @subsystem_names then
+      build_subsystems
+    elsif !@restarted
+      init_acc
+    end
+    @restarted = false
+    time = @time
+    # a frame is written every out_dt, i.e. every this many steps
+    every = (@out_dt && @out_dt > @dt) ? (@out_dt/@dt).round : 1
+    
+    if @diagnostics_every then
+      @energy0 ||= diagnostics['energy'] end
     
-    init_acc
     while time <= @t_end
       #warn '------------------'
-      send(integrator)
-      write_data()
-      time += @dt
+      # on a diagnostics step the potentials come out of the step's own
+      # force pass; the Hermite integrator's pass is not at the final
+      # positions, so it gets a pass of its own afterwards
+      diagnose = @diagnostics_every && (@step + 1) % @diagnostics_every == 0
+      @particles.potential = diagnose && integrator != 'hermite' &&
+                             !@subsystems
+      advance(integrator)
+      fresh = @particles.potential
+      @particles.potential = false
+      @time = time += @dt
+      @step += 1
+      log_diagnostics(fresh) if diagnose
+      timed('output') { write_data() } if @step % every == 0
+      if @checkpoint && @step % @checkpoint.every(@dt) == 0 then
+        timed('checkpoint') { @checkpoint.write(self) } end
+      if @stats_every && @step % @stats_every == 0 then
+        (@stats_io || $stderr).puts stats.to_json end
     end
+    # closing finishes a binary trajectory with its frame index
+    if @output then @output.close; @output = nil end
+  end
+  
+  # selects the trajectory output: format is 'text', 'binary' or
+  # 'binary32' (see particles/output.h), written to io
+  def set_output(format='text', velocities=false, io=$stdout)
+    @output_format = format; @output_velocities = velocities
+    @output_io = io
+  end
+  
+  # logs the diagnostics (see NBody#diagnostics) every this many steps
+  # to io
+  def set_diagnostics(every, io=$stderr)
+    @diagnostics_every = every; @diagnostics_io = io
+  end
+  
+  # dumps NBody#stats as one JSON line every this many steps to io
+  def set_stats(every, io=$stderr)
+    @stats_every = every; @stats_io = io
+  end
+  
+  # the seconds spent in every phase (see PHASES) and the counters of
+  # the tree walks (see c_tree/tree.c), summed since the last
+  # reset_stats, along with the depth and size of the current tree
+  def stats
+    @stats.merge('time' => @time, 'step' => @step,
+                 'force_evaluations' => @evaluations,
+                 'tree_builds' => @tree_builds, 'tree_refits' => @tree_refits,
+                 'tree_depth' => @tree && @tree.depth,
+                 'tree_nodes' => @tree && @tree.node_count)
+  end
+  
+  def reset_stats
+    @stats = {}
+    PHASES.each {|phase| @stats[phase] = 0.0 }
+    ['nodes_opened', 'particle_interactions',
+     'node_interactions'].each {|counter| @stats[counter] = 0 }
+  end
+  
+  # the run parameters, as they are recorded in binary snapshots
+  def parameters
+    { 'dt' => @dt, 't_start' => @t_start, 't_end' => @t_end,
+      'out_dt' => @out_dt, 'eps' => @eps, 'tol' => @tol,
+      'softening' => @particles.softening,
+      'solver' => @solver, 'multipole_order' => @multipole_order,
+      'threads' => @particles.threads, 'morton' => @morton,
+      'integrator' => @integrator, 'step' => @step,
+      'max_level' => @max_level, 'eta' => @eta, 'energy0' => @energy0,
+      'rebuild_threshold' => @rebuild_threshold,
+      'mixed_precision' => @mixed_precision || nil,
+      'subsystems' => @subsystem_names && @subsystem_names.join(','),
+      'subsystem_steps' => @subsystem_names && @subsystem_steps
+    }.reject {|name, value| value.nil? }
+  end
+  
+  # takes the parameters back from a checkpoint (as read by
+  # THDHandler#load_snapshot); the next evolve continues the run from
+  # there
+  def restart(params)
+    set_parameters(params['dt'].to_f, params['t_start'].to_f,
+                   params['t_end'].to_f, params['out_dt'].to_f,
+                   params['eps'].to_f, false, params['solver'] != 'direct',
+                   params['threads'].to_i, params['morton'] == 'true',
+                   params['multipole_order'].to_i, params['solver'])
+    @tol = params['tol'].to_f if params['tol']
+    self.softening = params['softening'] if params['softening']
+    @integrator = params['integrator']
+    if params['max_level'] then
+      set_block_steps(params['max_level'].to_i, params['eta'].to_f) end
+    @energy0 = params['energy0'].to_f if params['energy0']
+    if params['rebuild_threshold'] then
+      @rebuild_threshold = params['rebuild_threshold'].to_f end
+    @mixed_precision = (params['mixed_precision'] == 'true')
+    if params['subsystems'] then
+      raise "\nA run with subsystems cannot be restarted!\n" end
+    @step = params['step'].to_i
+    @restarted = true
+    rebuild_tree
   end
   
-  # write out data
+  # queues the positions of every body for the background writer
+  # (particles/output.c); the frame is formatted natively
   def write_data
-    @list.each do |b|
-      puts "#{b.pos[0]} #{b.pos[1]} #{b.pos[2]}"
-    end
+    output.write(@particles, @time)
+  end
+  
+  # the trajectory writer, opened with the first frame
+  def output
+    @output ||= TrajectoryWriter.new(@output_io || $stdout,
+                                     @output_format || 'text',
+                                     @output_velocities)
   end
   
-  # initializes the accelerations
+  # initializes the accelerations, and the jerks as well for the
+  # Hermite integrator
   def init_acc
-    @list.each {|b| b.acc = pairwise_acc(b) }
+    if @integrator == 'hermite' then
+      @evaluations += @particles.size
+      SpeedUp.all_jerks(@particles, @eps)
+    else
+      compute_acc
+    end
+  end
+  
+  # fills in the accelerations of every body with the selected solver,
+  # or, given the size of the store's active set, only of those bodies.
+  # The FMM always does every body; that only costs time, the bodies
+  # that are not active pick up their new accelerations when their step
+  # ends.
+  def compute_acc(active=nil)
+    @evaluations += active || @particles.size
+    solve(active)
+  end
+  
+  # one force pass of the selected solver
+  def solve(active=nil)
+    case @solver
+    when 'direct' then
+      timed('force') do
+        SpeedUp.all_accelerations(@particles, @eps, !!active) end
+      @stats['particle_interactions'] +=
+        (active || @particles.size)*(@particles.size - 1)
+    when 'fmm'    then get_fmm_acc(@tol)
+    else get_tree_acc(@tol, !!active)
+    end
+  end
+  
+  # relative acceleration error of the selected solver against direct
+  # summation: [median, 99th percentile, maximum]
+  def force_error(tol)
+    @tol = tol if tol
+    SpeedUp.all_accelerations(@particles, @eps)
+    exact = @list.collect {|b| b.acc }
+    compute_acc
+    errors = []
+    @list.each_with_index do |b, i|
+      norm = exact[i].mag
+      errors.push((b.acc - exact[i]).mag/(norm > 0 ? norm : 1.0))
+    end
+    errors.sort!
+    [errors[errors.size/2], errors[(errors.size*0.99).to_i], errors.last]
+  end
+  
+  # relative difference of the tree walk with mixed precision far
+  # fields (see c_tree/tree.c) from the all-double walk:
+  # [median, 99th percentile, maximum]
+  def mixed_precision_error(tol)
+    @tol = tol if tol
+    mixed = @mixed_precision
+    @mixed_precision = false
+    compute_acc
+    exact = @particles.accelerations
+    @mixed_precision = true
+    compute_acc
+    errors = @particles.accelerations.sub!(exact).norms
+    @mixed_precision = mixed
+    exact.norms.each_with_index do |norm, i|
+      errors[i] /= (norm > 0 ? norm : 1.0) end
+    errors.sort!
+    [errors[errors.size/2], errors[(errors.size*0.99).to_i], errors.last]
   end
   
   # computes the pairwise acceleration for a single body
   # uses the SpeedUp module's fast inner loop function (pairwise.c)
   def pairwise_acc(b)
     acc = Vector.new
+    pos = b.pos
     @list.each do |other_body|
       unless other_body == b
-        acc += SpeedUp::pairwise_acc(b.pos, other_body.pos,
-                                     other_body.mass, @eps)
+        acc.add!(SpeedUp::pairwise_acc(pos, other_body.pos,
+                                       other_body.mass, @eps))
       end
     end
     acc
   end
   
   def energy
-    tot_kin = tot_pot = 0
-    @list.inject {|tot_kin, body| body.e_kin}
-    @list.inject {|tot_pot, body| body.e_pot(@list, @eps)}
-    tot_kin + tot_pot
+    diagnostics['energy']
+  end
+  
+  # kinetic, potential and total energy, momentum and angular momentum
+  # of the current state, all reduced natively. With fresh the
+  # potentials left by the last force pass are used; they must have been
+  # computed at the current positions.
+  def diagnostics(fresh=false)
+    potentials unless fresh
+    kin, pot = @particles.kinetic_energy, @particles.potential_energy
+    { 'time' => @time, 'step' => @step, 'kinetic' => kin,
+      'potential' => pot, 'energy' => kin + pot,
+      'momentum' => @particles.momentum.to_a,
+      'angular_momentum' => @particles.angular_momentum.to_a,
+      'center_of_mass' => center_of_mass.to_a }
+  end
+  
+  # positions and velocities of every body as packed VectorArrays, in
+  # list order; assigning one writes it back into the store
+  def positions; @particles.positions end
+  def velocities; @particles.velocities end
+  def positions=(array); @particles.positions = array end
+  def velocities=(array); @particles.velocities = array end
+  
+  def center_of_mass
+    @particles.positions.center_of_mass(@particles.masses)
+  end
+  
+  # half the side of the smallest cube about the origin that holds
+  # every body
+  def bounding_radius
+    @particles.positions.max_abs
+  end
+  
+  # computes the potential of every body at the current positions: by
+  # direct summation for the direct solver, and for the Hermite
+  # integrator, whose accelerations must stay exact; otherwise with a
+  # force pass of the solver that leaves the accelerations alone, so
+  # that a diagnostic never changes the trajectory
+  def potentials
+    if @solver == 'direct' || @integrator == 'hermite' then
+      SpeedUp.all_potentials(@particles, @eps)
+    else
+      @particles.potential = 'only'
+      solve
+      @particles.potential = false
+    end
+  end
+  
+  # writes one line of diagnostics, with the relative energy error
+  # since the start of the run
+  def log_diagnostics(fresh=false)
+    d = diagnostics(fresh)
+    error = (d['energy'] - @energy0)/(@energy0 != 0 ? @energy0.abs : 1.0)
+    (@diagnostics_io || $stderr).puts "DIAGNOSTICS t= #{d['time']} " +
+      "step= #{d['step']} E= #{d['energy']} dE/E= #{error} " +
+      "K= #{d['kinetic']} U= #{d['potential']} " +
+      "P= #{d['momentum'].join(' ')} L= #{d['angular_momentum'].join(' ')}"
   end
     
   # the leapfrog integrator. kick, drift, acc, kick!
   def leapfrog
-    @list.each {|b| b.kick(@dt) }
-    @list.each {|b| b.drift(@dt) }
-    #warn 'kick+drift done'
-      if @use_tree == false then
-        @list.each {|b| b.acc = pairwise_acc(b) } 
-      else 
-        get_tree_acc(@tol)
-      end
-    @list.each {|b| b.kick(@dt) }
-    #warn 'final kick done'
+    timed('kick') { @particles.kick(@dt) }
+    timed('drift') { @particles.drift(@dt) }
+    compute_acc
+    timed('kick') { @particles.kick(@dt) }
   end
   
+  # the fourth-order Hermite predictor-corrector. Accelerations and
+  # jerks always come from direct summation, whatever the solver: it is
+  # meant for few-body systems (see pairwise/pairwise.c)
+  def hermite
+    @evaluations += @particles.size
+    timed('force') { SpeedUp.hermite_step(@particles, @dt, @eps) }
+    @stats['particle_interactions'] += @particles.size*(@particles.size - 1)
+  end
+  
+  # the block integrator: every body takes leapfrog steps of its own,
+  # dt/2**k for k up to max_level, picked from how fast its acceleration
+  # changes. Every substep drifts all bodies but only computes the forces
+  # of the bodies whose step ends there (see particles/particles.c).
+  def block
+    substeps = 2**(@max_level || 6)
+    h = @dt/substeps
+    substeps.times do |k|
+      timed('kick') { @particles.block_start(h, k) }
+      timed('drift') { @particles.drift(h) }
+      active = @particles.block_active(h, k + 1)
+      compute_acc(active) if active > 0
+      timed('kick') { @particles.block_finish(h, k + 1, @eta || 0.02, @dt) }
+    end
+  end
+  
+  # rebuilds the octree in place; the tree keeps its node arena from
+  # one step to the next. With a rebuild threshold the tree is only
+  # refitted to the moved bodies (see c_tree/tree.c) until more than
+  # that fraction of them have left their leaf cells.
   def make_tree
-    r = @list.inject(0){|max, b| [max, b.pos.abs.max].max}
-    root_size = 1
-    root_size *= 2 while r > root_size
-    @root_node = TreeNode.new(Vector.new, root_size);
-    @list.each { |b| @root_node.load_tree(b) }
+    timed('tree_build') { build_tree }
+  end
+  
+  # the next force pass builds the tree afresh instead of refitting it.
+  # A run restarted from a checkpoint starts without a tree, so the run
+  # that carries on past the checkpoint has to rebuild at the same step.
+  def rebuild_tree
+    @rebuild = true
+  end
+  
+  def build_tree
+    @tree ||= TreeNode.new
+    # a potential-only pass (the diagnostics) leaves a pending rebuild to
+    # the next force pass; refitting at the same positions changes nothing
+    integrating = @particles.potential != 'only'
+    if @rebuild_threshold && !(@rebuild && integrating) &&
+       @tree.refit(@particles, @rebuild_threshold)
+      @tree_refits += 1
+      return
+    end
+    @rebuild = false if integrating
+    @tree.morton = (@morton || @solver == 'fmm')
+    # the FMM's direct sums are vectorized and its M2L are not, so it
+    # prefers fatter leaves
+    @tree.leaf_size = (@solver == 'fmm') ? 32 : 8
+    @tree.multipole_order = @multipole_order
+    @tree.build(@particles)
+    @tree_builds += 1
+  end
+  
+  def get_tree_acc(tol, active=false)
+    make_tree
+    @tree.mixed_precision = @mixed_precision
+    timed('center_of_mass') { @tree.center_of_mass }
+    timed('force') { @tree.accelerations(tol, @eps, active) }
+    @stats['nodes_opened'] += @tree.nodes_opened
+    @stats['particle_interactions'] += @tree.particle_interactions
+    @stats['node_interactions'] += @tree.node_interactions
   end
   
-  def get_tree_acc(tol)
+  # the fast multipole solver works on the same (Morton-built) tree
+  def get_fmm_acc(tol)
     make_tree
-    #warn 'tree generated'
-    @root_node.center_of_mass
-    #warn 'center of mass computed'
-    @list.each do |b| 
-      b.acc = @root_node.get_acc(b, tol, @eps)
+    timed('force') { @tree.fmm_accelerations(tol, @eps) }
+    @stats['nodes_opened'] += @tree.nodes_opened
+    @stats['particle_interactions'] += @tree.particle_interactions
+    @stats['node_interactions'] += @tree.node_interactions
+  end
+  
+  # one global step of the integrator; with subsystems it moves the
+  # global particles, then the subsystems take their internal steps and
+  # the bodies are put back together
+  def advance(integrator)
+    return send(integrator) unless @subsystems
+    on_global { send(integrator) }
+    timed('subsystems') do
+      @subsystems.each do |s|
+        s.advance(@dt, @subsystem_steps)
+        @stats['particle_interactions'] +=
+          s.bodies.size*(s.bodies.size - 1)*@subsystem_steps
+      end
+    end
+    place_subsystems
+  end
+  
+  # splits the bodies into subsystems and the single bodies outside of
+  # them, and sets up the global store: a row for every single body
+  # followed by a row for the centre of mass of every subsystem. The
+  # global accelerations are computed afresh.
+  def build_subsystems
+    members, singles = {}, []
+    @list.each do |b|
+      path = b.belongs_to.is_a?(Array) ? b.belongs_to : [b.belongs_to]
+      name = @subsystem_names.find {|n| path.include?(n) }
+      if name then (members[name] ||= []).push(b)
+      else singles.push(b) end
     end
-    #warn 'accelerations computed'
+    (@subsystem_names - members.keys).each do |name|
+      raise "\nNo bodies belong to the subsystem #{name}!\n" end
+    @subsystems = members.collect {|name, bodies|
+      Subsystem.new(name, bodies, @eps, @particles.softening) }
+    @singles = singles.collect {|b| b.index }
+    @single_rows = (0...singles.size).to_a
+    @global = Particles.new(singles.size + @subsystems.size)
+    @global.threads = @particles.threads
+    @global.softening = @particles.softening
+    singles.each {|b| @global.push(b.mass, b.pos, b.vel) }
+    @subsystems.each {|s| @global.push(s.mass, *s.center_of_mass) }
+    on_global { init_acc }
+    place_subsystems
+  end
+  
+  # moves the bodies of the main store to where the global store and
+  # the subsystems have them
+  def place_subsystems
+    @particles.copy_from(@global, @single_rows, @singles)
+    @subsystems.each_with_index do |s, k|
+      row = @singles.size + k
+      s.place(@global.pos(row), @global.vel(row), @global.acc(row))
+    end
+  end
+  
+  # runs the block with the global store in place of the main one
+  def on_global
+    main, @particles = @particles, @global
+    yield
+  ensure
+    @particles = main
+  end
+  
+  # adds the monotonic time the block takes to a phase of NBody#stats
+  def timed(phase)
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    yield
+  ensure
+    @stats[phase] += Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
   end
 
   # adds an entry to the THD stream history
@@ -179,30 +634,56 @@ class NBody
         hist << hist_entry
       end
     else
-      raise "\nNo stream loaded!\n" 
+      # streamed input has no document to write into
+      @history.push(new_entry)
     end
   end
 end
 
-#class TreeNode
-#  def pp(indent=0)
-#    puts " "*indent+"node size=#{self.size}"
-#    self.each_child {|x| x.pp(2+indent) if x }
-#  end
-#  
-#  def get_acc(b, tol, eps)
-#    dist = b.pos - @pos
-#    if 2*@size > tol*dist.mag then
-#      acc = Vector.new
-#      self.each_child do |c|
-#        acc += c.get_acc(b, tol, eps) if c
-#      end
-#      acc
-#    else
-#      SpeedUp::pairwise_acc(c.pos, b.pos, b.mass, eps) if c.pos != b.pos
-#    end
-#  end
-#end
+=begin rdoc
+A tightly bound group of bodies, a binary in a cluster say, that the
+global solver sees as one particle at its centre of mass (see
+NBody#set_subsystems). Its internal motion lives in a store of its own,
+relative to the centre of mass, and is advanced by direct Hermite steps
+(see pairwise/pairwise.c) of a fraction of the global timestep. The
+tidal field of the rest of the system on the subsystem is neglected.
+=end
+class Subsystem
+  attr_reader :name, :bodies, :mass, :store
+  
+  # bodies are the views of the members in the main store
+  def initialize(name, bodies, eps, softening='plummer')
+    @name, @bodies, @eps = name, bodies, eps
+    @mass = bodies.inject(0.0) {|m, b| m + b.mass }
+    pos, vel = center_of_mass
+    @store = Particles.new(bodies.size)
+    @store.softening = softening
+    bodies.each {|b| @store.push(b.mass, b.pos - pos, b.vel - vel) }
+    SpeedUp.all_jerks(@store, @eps)
+  end
+  
+  # [position, velocity] of the centre of mass of the members
+  def center_of_mass
+    pos, vel = Vector.new, Vector.new
+    @bodies.each {|b| pos.axpy!(b.mass, b.pos); vel.axpy!(b.mass, b.vel) }
+    [pos*(1.0/@mass), vel*(1.0/@mass)]
+  end
+  
+  # advances the internal motion by dt in steps Hermite steps
+  def advance(dt, steps)
+    h = dt/steps
+    steps.times { SpeedUp.hermite_step(@store, h, @eps) }
+  end
+  
+  # puts the members back around the given centre of mass motion
+  def place(pos, vel, acc)
+    @bodies.each_with_index do |b, i|
+      b.pos = pos + @store.pos(i)
+      b.vel = vel + @store.vel(i)
+      b.acc = acc + @store.acc(i)
+    end
+  end
+end
 
 # modified Array to have a vector conversion class
 class Array
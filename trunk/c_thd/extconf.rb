@@ -0,0 +1,4 @@
+require 'mkmf'
+$CPPFLAGS << ' -I../include'
+$CFLAGS << ' -O3'
+create_makefile('thd')
@@ -0,0 +1,387 @@
+/* thd.c -> a streaming reader for .thd (Tara Hierarchical Dataset) files
+
+   The reader pulls the input through IO#read in fixed size chunks and
+   scans it tag by tag, so it never holds more than one chunk (plus a
+   tag that straddles two chunks) in memory. Every <body> goes straight
+   into a Particles store; all that is kept per body besides the store
+   is its THD id, its group and its type. A group is the path of element
+   names between <space> and the body, and the distinct paths and types
+   are kept once each in small tables.
+
+   A process of a distributed run reads only a range of the bodies, in
+   document order: the others are scanned for their group and type, so
+   that every process ends up with the same tables, but never stored. */
+
+#include "stdio.h"
+#include "math.h"
+#include "limits.h"
+#include "ruby.h"
+#include "particles.h"
+
+#define GET_READER(val, p) Data_Get_Struct(val, Reader, p)
+#define CHUNK_SIZE 65536
+#define NO_GROUP -1
+
+VALUE cTHDReader;
+static ID id_read;
+
+typedef struct {
+  long n, capacity;    /* bodies stored so far */
+  long count;          /* bodies in the stream so far */
+  long from, to;       /* stream indices of the bodies stored */
+  long first;          /* handle of the first body in the store */
+  long *ids;           /* THD id of every body */
+  int *group;          /* index into groups */
+  int *type;           /* index into types, -1 when there is none */
+  char *buf;           /* chunk buffer */
+  long len, size;      /* bytes in buf, allocated size of buf */
+  char *path;          /* open element names, each ending in '\0' */
+  long path_len, path_size;
+  int depth, space;    /* open elements, depth of <space> (-1 if none) */
+  int current;         /* cached group of the open path */
+  VALUE groups;        /* array of paths (arrays of names) */
+  VALUE group_index;   /* joined path -> group */
+  VALUE types;         /* array of type strings */
+  VALUE type_index;    /* type string -> index */
+} Reader;
+
+/* ALLOCATION METHODS ----------------------- */
+static void reader_mark(Reader *r) {
+  rb_gc_mark(r->groups);
+  rb_gc_mark(r->group_index);
+  rb_gc_mark(r->types);
+  rb_gc_mark(r->type_index);
+}
+
+static void reader_free(Reader *r) {
+  xfree(r->ids);
+  xfree(r->group);
+  xfree(r->type);
+  xfree(r->buf);
+  xfree(r->path);
+  xfree(r);
+}
+
+static void reader_reset(Reader *r) {
+  r->n = 0;
+  r->count = 0;
+  r->len = 0;
+  r->path_len = 0;
+  r->depth = 0;
+  r->space = -1;
+  r->current = NO_GROUP;
+  r->groups = rb_ary_new();
+  r->group_index = rb_hash_new();
+  r->types = rb_ary_new();
+  r->type_index = rb_hash_new();
+}
+
+static VALUE reader_alloc(VALUE klass) {
+  Reader *r = ALLOC(Reader);
+  memset(r, 0, sizeof(Reader));
+  r->groups = r->group_index = r->types = r->type_index = Qnil;
+  reader_reset(r);
+  return Data_Wrap_Struct(klass, reader_mark, reader_free, r);
+}
+
+/* ELEMENT STACK ---------------------------- */
+static void open_element(Reader *r, const char *name, long len) {
+  if (r->path_len + len + 1 > r->path_size) {
+    r->path_size = 2*(r->path_len + len + 1);
+    REALLOC_N(r->path, char, r->path_size);
+  }
+  memcpy(r->path + r->path_len, name, len);
+  r->path_len += len;
+  r->path[r->path_len++] = '\0';
+  if (r->space < 0 && len == 5 && strncmp(name, "space", 5) == 0)
+    r->space = r->depth;
+  r->depth++;
+  r->current = NO_GROUP;
+}
+
+static void close_element(Reader *r) {
+  if (r->depth == 0)
+    rb_raise(rb_eArgError, "ERROR: unbalanced closing tag in THD stream");
+  r->path_len--;
+  while (r->path_len > 0 && r->path[r->path_len - 1] != '\0')
+    r->path_len--;
+  r->depth--;
+  if (r->space == r->depth) r->space = -1;
+  r->current = NO_GROUP;
+}
+
+/* returns the group of the open path, registering it on first sight;
+   the lookup only happens when the path changed since the last body */
+static int current_group(Reader *r) {
+  VALUE key, found, names;
+  char *p = r->path, *end = r->path + r->path_len;
+  int level;
+  if (r->current != NO_GROUP) return r->current;
+  /* skip everything down to and including <space> */
+  for(level = 0; level <= r->space; level++) {
+    p += strlen(p) + 1;
+  }
+  key = rb_str_new(p, end - p);
+  found = rb_hash_aref(r->group_index, key);
+  if (NIL_P(found)) {
+    names = rb_ary_new();
+    while (p < end) {
+      rb_ary_push(names, rb_str_new2(p));
+      p += strlen(p) + 1;
+    }
+    found = INT2FIX(RARRAY_LEN(r->groups));
+    rb_ary_push(r->groups, names);
+    rb_hash_aset(r->group_index, key, found);
+  }
+  r->current = FIX2INT(found);
+  return r->current;
+}
+
+static int type_of(Reader *r, const char *value, long len) {
+  VALUE key = rb_str_new(value, len), found;
+  found = rb_hash_aref(r->type_index, key);
+  if (NIL_P(found)) {
+    found = INT2FIX(RARRAY_LEN(r->types));
+    rb_ary_push(r->types, key);
+    rb_hash_aset(r->type_index, key, found);
+  }
+  return FIX2INT(found);
+}
+
+/* BODY PARSING ----------------------------- */
+
+/* reads up to three numbers from an attribute value, missing ones
+   are zero */
+static void parse_triple(const char *p, const char *end, double *v) {
+  char number[64];
+  int k;
+  for(k = 0; k < 3; k++) {
+    long len = 0;
+    v[k] = 0.0;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+      p++;
+    while (p < end && !(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+      if (len < 63) number[len++] = *p;
+      p++;
+    }
+    number[len] = '\0';
+    if (len > 0) v[k] = strtod(number, NULL);
+  }
+}
+
+static double parse_number(const char *p, const char *end) {
+  char number[64];
+  long len = end - p;
+  if (len > 63) len = 63;
+  memcpy(number, p, len);
+  number[len] = '\0';
+  return strtod(number, NULL);
+}
+
+static void grow_bodies(Reader *r) {
+  if (r->n < r->capacity) return;
+  r->capacity = r->capacity ? 2*r->capacity : 1024;
+  REALLOC_N(r->ids, long, r->capacity);
+  REALLOC_N(r->group, int, r->capacity);
+  REALLOC_N(r->type, int, r->capacity);
+}
+
+/* p points just past "<body", end at the closing '>'. A body outside
+   the range being read only has its group and type registered. */
+static void read_body(Reader *r, Particles *s, const char *p,
+                      const char *end) {
+  double mass = 0.0, pos[3] = {0.0, 0.0, 0.0}, vel[3] = {0.0, 0.0, 0.0};
+  long id = 0;
+  int type = -1, group = current_group(r);
+  int keep = (r->count >= r->from && r->count < r->to);
+  r->count++;
+  while (p < end) {
+    const char *name, *value;
+    long name_len;
+    char quote;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' ||
+                       *p == '\r' || *p == '/'))
+      p++;
+    if (p >= end) break;
+    name = p;
+    while (p < end && *p != '=' && *p != ' ' && *p != '\t' &&
+           *p != '\n' && *p != '\r')
+      p++;
+    name_len = p - name;
+    while (p < end && *p != '=') p++;
+    p++;
+    while (p < end && *p != '"' && *p != '\'') p++;
+    if (p >= end) break;
+    quote = *p++;
+    value = p;
+    while (p < end && *p != quote) p++;
+    if (name_len == 4 && strncmp(name, "type", 4) == 0)
+      type = type_of(r, value, p - value);
+    else if (keep) {
+      if (name_len == 2 && strncmp(name, "id", 2) == 0)
+        id = (long)parse_number(value, p);
+      else if (name_len == 4 && strncmp(name, "mass", 4) == 0)
+        mass = parse_number(value, p);
+      else if (name_len == 3 && strncmp(name, "pos", 3) == 0)
+        parse_triple(value, p, pos);
+      else if (name_len == 3 && strncmp(name, "vel", 3) == 0)
+        parse_triple(value, p, vel);
+    }
+    p++;
+  }
+  if (!keep) return;
+  grow_bodies(r);
+  r->ids[r->n] = id;
+  r->group[r->n] = group;
+  r->type[r->n] = type;
+  r->n++;
+  particles_push(s, mass, pos[0], pos[1], pos[2], vel[0], vel[1], vel[2]);
+}
+
+/* TAG SCANNER ------------------------------ */
+
+/* finds the end of the tag starting at p (which points at '<'); returns
+   NULL if the tag is not complete yet */
+static char *tag_end(char *p, char *end) {
+  char quote = 0;
+  if (end - p >= 4 && strncmp(p, "<!--", 4) == 0) {
+    for(p += 4; p + 2 < end; p++) {
+      if (p[0] == '-' && p[1] == '-' && p[2] == '>') return p + 2;
+    }
+    return NULL;
+  }
+  if (end - p >= 9 && strncmp(p, "<![CDATA[", 9) == 0) {
+    for(p += 9; p + 2 < end; p++) {
+      if (p[0] == ']' && p[1] == ']' && p[2] == '>') return p + 2;
+    }
+    return NULL;
+  }
+  /* a partial "<!--" or "<![CDATA[" must wait for more input */
+  if (end - p < 4 && strncmp(p, "<!--", end - p) == 0) return NULL;
+  if (end - p < 9 && strncmp(p, "<![CDATA[", end - p) == 0) return NULL;
+  for(p++; p < end; p++) {
+    if (quote) {
+      if (*p == quote) quote = 0;
+    }
+    else if (*p == '"' || *p == '\'') quote = *p;
+    else if (*p == '>') return p;
+  }
+  return NULL;
+}
+
+static void handle_tag(Reader *r, Particles *s, char *p, char *close) {
+  char *name;
+  long len;
+  int empty = (close[-1] == '/');
+  if (p[1] == '?' || p[1] == '!') return;
+  if (p[1] == '/') {
+    close_element(r);
+    return;
+  }
+  name = p + 1;
+  for(len = 0; name + len < close && name[len] != ' ' && name[len] != '\t' &&
+        name[len] != '\n' && name[len] != '\r' && name[len] != '/'; len++);
+  if (len == 4 && strncmp(name, "body", 4) == 0)
+    read_body(r, s, name + 4, close);
+  if (!empty) open_element(r, name, len);
+}
+
+/* scans every complete tag in the buffer and keeps the unfinished
+   remainder at its start */
+static void scan_buffer(Reader *r, Particles *s) {
+  char *p = r->buf, *end = r->buf + r->len, *close;
+  while (1) {
+    while (p < end && *p != '<') p++;
+    if (p >= end) break;
+    close = tag_end(p, end);
+    if (close == NULL) break;
+    handle_tag(r, s, p, close);
+    p = close + 1;
+  }
+  r->len = end - p;
+  memmove(r->buf, p, r->len);
+}
+
+/* READER METHODS --------------------------- */
+
+/* read(io, store, from=0, to=nil) reads the whole io (anything
+   answering #read(length)) and stores the bodies [from, to) of it, in
+   document order, in store; returns the number of bodies in io */
+static VALUE reader_read(int argc, VALUE *argv, VALUE self) {
+  Reader *r; GET_READER(self, r);
+  VALUE io, store, from, to, chunk;
+  Particles *s;
+  long i;
+  rb_scan_args(argc, argv, "22", &io, &store, &from, &to);
+  GET_STORE(store, s);
+  reader_reset(r);
+  r->from = NIL_P(from) ? 0 : NUM2LONG(from);
+  r->to = NIL_P(to) ? LONG_MAX : NUM2LONG(to);
+  r->first = s->n;
+  if (r->buf == NULL) {
+    r->size = 2*CHUNK_SIZE;
+    r->buf = ALLOC_N(char, r->size);
+  }
+  while (!NIL_P(chunk = rb_funcall(io, id_read, 1, INT2FIX(CHUNK_SIZE)))) {
+    long len;
+    StringValue(chunk);
+    len = RSTRING_LEN(chunk);
+    if (len == 0) break;
+    /* only a single tag longer than a chunk can make the buffer grow */
+    if (r->len + len > r->size) {
+      r->size = 2*(r->len + len);
+      REALLOC_N(r->buf, char, r->size);
+    }
+    memcpy(r->buf + r->len, RSTRING_PTR(chunk), len);
+    r->len += len;
+    scan_buffer(r, s);
+  }
+  for(i = 0; i < r->len; i++) {
+    if (r->buf[i] == '<')
+      rb_raise(rb_eArgError, "ERROR: unterminated tag at the end of the "
+               "THD stream");
+  }
+  if (r->depth != 0)
+    rb_raise(rb_eArgError, "ERROR: THD stream ended inside <%s>",
+             r->path_len ? r->path : "");
+  return LONG2NUM(r->count);
+}
+
+static VALUE reader_size(VALUE self) {
+  Reader *r; GET_READER(self, r);
+  return LONG2NUM(r->n);
+}
+
+static VALUE reader_groups(VALUE self) {
+  Reader *r; GET_READER(self, r);
+  return r->groups;
+}
+
+static VALUE reader_types(VALUE self) {
+  Reader *r; GET_READER(self, r);
+  return r->types;
+}
+
+/* yields the handle, id, group index and type index (nil if there is
+   none) of every body stored, in document order */
+static VALUE reader_each_body(VALUE self) {
+  Reader *r; GET_READER(self, r);
+  long i;
+  for(i = 0; i < r->n; i++) {
+    VALUE type = (r->type[i] < 0) ? Qnil : INT2FIX(r->type[i]);
+    rb_yield_values(4, LONG2NUM(r->first + i), LONG2NUM(r->ids[i]),
+                    INT2FIX(r->group[i]), type);
+  }
+  return self;
+}
+
+void Init_thd() {
+  id_read = rb_intern("read");
+  cTHDReader = rb_define_class("THDReader", rb_cObject);
+  rb_define_alloc_func(cTHDReader, reader_alloc);
+  rb_define_method(cTHDReader, "read", reader_read, -1);
+  rb_define_method(cTHDReader, "size", reader_size, 0);
+  rb_define_method(cTHDReader, "groups", reader_groups, 0);
+  rb_define_method(cTHDReader, "types", reader_types, 0);
+  rb_define_method(cTHDReader, "each_body", reader_each_body, 0);
+}
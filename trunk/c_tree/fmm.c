@@ -0,0 +1,414 @@
+/* fmm.c -> a fast multipole solver on the c_tree octree
+
+   The solver reuses the Morton-built arena of tree.c. Cells carry their
+   monopole and quadrupole (from tree_moments) about the centre of mass,
+   and every cell also gets a third-order Cartesian local expansion of
+   the potential about the same point (d = x - c):
+
+     phi(x) = phi + g.d + 1/2 d.H.d + 1/6 T:ddd
+     a(x)   = -(g + H.d + 1/2 T:dd)
+
+   The quadrupole of a source cell enters phi and g, its monopole every
+   term, which keeps all truncation errors at third order in the
+   opening tolerance.
+
+   A dual tree traversal starting from (root, root) pairs up cells. Well
+   separated pairs exchange multipole-to-local (M2L) contributions in
+   both directions; close pairs of leaves are summed directly with
+   Newton's third law. A single downward sweep then shifts every local
+   expansion onto the children (L2L) and finally onto the particles of
+   the leaves (L2P). The cost is O(N) for a fixed opening tolerance.
+
+   With more than one thread the tree is first cut, level by level, into
+   a frontier of at least eight cells per thread that hold every
+   particle between them. Every cell of the frontier then interacts with
+   itself and with every other one, in the rounds of pool_run_rounds:
+   no two pairs of a round share a cell, so no two workers ever write
+   the same expansion or particle. With one thread the frontier is the
+   root alone, which is the plain traversal. */
+
+#include "stdio.h"
+#include "math.h"
+#include "ruby.h"
+#include "particles.h"
+#include "kernel.h"
+#include "pool.h"
+#include "tree.h"
+
+#define P2P_CHEAP 32    /* separated pairs this small are summed directly */
+
+/* layout of a local expansion: phi, g (3), H (6), T (10) */
+static int H_IDX[3][3];
+static int T_IDX[3][3][3];
+
+typedef struct {
+  Tree *t;
+  Particles *s;
+  double tol;
+  Kernel k;
+  int *cells;             /* the frontier of the traversal */
+  long ncells, nslots;    /* nslots: ncells made even for the rounds */
+  long opened[POOL_MAX_THREADS];
+  long particle_interactions[POOL_MAX_THREADS];
+  long node_interactions[POOL_MAX_THREADS];
+} FMMJob;
+
+/* INTERACTION METHODS ----------------------------- */
+
+/* adds the field of cell b (monopole and quadrupole) at the centre of
+   cell a to a's local expansion L */
+static void m2l(double *L, const Node *a, const Node *b) {
+  const double *q = b->quad;
+  double r[3];
+  double r2, inv1, inv2, inv3, inv5, inv7, m = b->mass;
+  double qrx, qry, qrz, rqr, f, h;
+  register int i, j, k;
+  r[0] = a->pos[0] - b->pos[0];
+  r[1] = a->pos[1] - b->pos[1];
+  r[2] = a->pos[2] - b->pos[2];
+  r2 = r[0]*r[0] + r[1]*r[1] + r[2]*r[2];
+  inv1 = 1.0/sqrt(r2); inv2 = 1.0/r2;
+  inv3 = inv1*inv2; inv5 = inv3*inv2; inv7 = inv5*inv2;
+  qrx = q[0]*r[0] + q[3]*r[1] + q[4]*r[2];
+  qry = q[3]*r[0] + q[1]*r[1] + q[5]*r[2];
+  qrz = q[4]*r[0] + q[5]*r[1] + q[2]*r[2];
+  rqr = r[0]*qrx + r[1]*qry + r[2]*qrz;
+  f = m*inv3 + 2.5*rqr*inv7;
+  
+  L[0] += -m*inv1 - 0.5*rqr*inv5;
+  L[1] += r[0]*f - qrx*inv5;
+  L[2] += r[1]*f - qry*inv5;
+  L[3] += r[2]*f - qrz*inv5;
+  /* H_ij = m (d_ij/r^3 - 3 r_i r_j/r^5) */
+  h = 3*m*inv5;
+  for(i = 0; i < 3; i++) {
+    for(j = i; j < 3; j++) {
+      L[H_IDX[i][j]] += (i == j ? m*inv3 : 0.0) - h*r[i]*r[j];
+    }
+  }
+  /* T_ijk = m (15 r_i r_j r_k/r^7 - 3 (d_ij r_k + d_ik r_j + d_jk r_i)/r^5) */
+  for(i = 0; i < 3; i++) {
+    for(j = i; j < 3; j++) {
+      for(k = j; k < 3; k++) {
+        L[T_IDX[i][j][k]] += 15*m*inv7*r[i]*r[j]*r[k] -
+          h*((i == j)*r[k] + (i == k)*r[j] + (j == k)*r[i]);
+      }
+    }
+  }
+}
+
+/* the gradient of the expansion L at offset d: g + H.d + 1/2 T:dd */
+static void local_gradient(const double *L, const double *d, double *grad) {
+  register int i, j, k;
+  for(i = 0; i < 3; i++) {
+    double gi = L[1 + i];
+    for(j = 0; j < 3; j++) {
+      double tdj = 0.0;
+      for(k = 0; k < 3; k++) {
+        tdj += L[T_IDX[i][j][k]]*d[k];
+      }
+      gi += (L[H_IDX[i][j]] + 0.5*tdj)*d[j];
+    }
+    grad[i] = gi;
+  }
+}
+
+/* the expansion L at offset d: phi + g.d + 1/2 d.H.d + 1/6 T:ddd */
+static double local_potential(const double *L, const double *d) {
+  double phi = L[0];
+  register int i, j, k;
+  for(i = 0; i < 3; i++) {
+    phi += L[1 + i]*d[i];
+    for(j = 0; j < 3; j++) {
+      phi += 0.5*L[H_IDX[i][j]]*d[i]*d[j];
+      for(k = 0; k < 3; k++) {
+        phi += L[T_IDX[i][j][k]]*d[i]*d[j]*d[k]/6.0;
+      }
+    }
+  }
+  return phi;
+}
+
+/* shifts the expansion L about c onto the point c + d and adds it to to */
+static void l2l(double *to, const double *L, const double *d) {
+  double grad[3], hd[3], tddd = 0.0;
+  register int i, j, k;
+  local_gradient(L, d, grad);
+  for(i = 0; i < 3; i++) {
+    hd[i] = 0.0;
+    for(j = 0; j < 3; j++) {
+      hd[i] += L[H_IDX[i][j]]*d[j];
+      for(k = 0; k < 3; k++) {
+        tddd += L[T_IDX[i][j][k]]*d[i]*d[j]*d[k];
+      }
+    }
+  }
+  to[0] += L[0] + L[1]*d[0] + L[2]*d[1] + L[3]*d[2] +
+           0.5*(d[0]*hd[0] + d[1]*hd[1] + d[2]*hd[2]) + tddd/6.0;
+  for(i = 0; i < 3; i++) {
+    to[1 + i] += grad[i];
+    for(j = i; j < 3; j++) {
+      double td = 0.0;
+      for(k = 0; k < 3; k++) {
+        td += L[T_IDX[i][j][k]]*d[k];
+      }
+      to[H_IDX[i][j]] += L[H_IDX[i][j]] + td;
+    }
+  }
+  for(k = 10; k < LOCAL_TERMS; k++) {
+    to[k] += L[k];
+  }
+}
+
+/* direct sum between the particles of two different cells */
+static void p2p(FMMJob *job, const Node *a, const Node *b, int worker) {
+  long i;
+  for(i = a->first; i < a->first + a->count; i++) {
+    job->k.mutual(&job->k, job->s, i, b->first, b->first + b->count);
+  }
+  job->particle_interactions[worker] += 2*a->count*b->count;
+}
+
+/* direct sum among the particles of one cell */
+static void p2p_self(FMMJob *job, const Node *a, int worker) {
+  long i;
+  for(i = a->first; i < a->first + a->count; i++) {
+    kernel_symmetric(&job->k, job->s, i, a->first, a->first + a->count);
+  }
+  job->particle_interactions[worker] += a->count*(a->count - 1);
+}
+
+static int well_separated(const Node *a, const Node *b, double tol) {
+  double dx = a->pos[0] - b->pos[0];
+  double dy = a->pos[1] - b->pos[1];
+  double dz = a->pos[2] - b->pos[2];
+  double r = a->rmax + b->rmax;
+  return r*r < tol*tol*(dx*dx + dy*dy + dz*dz);
+}
+
+/* TRAVERSAL METHODS ------------------------------- */
+
+/* the mutual interaction of two disjoint cells */
+static void interact(FMMJob *job, int ia, int ib, int worker) {
+  Tree *t = job->t;
+  const Node *a = &t->nodes[ia], *b = &t->nodes[ib];
+  register int c;
+  
+  if (well_separated(a, b, job->tol)) {
+    if (a->count*b->count <= P2P_CHEAP) {
+      p2p(job, a, b, worker);
+    } else {
+      m2l(&t->locals[ia*LOCAL_TERMS], a, b);
+      m2l(&t->locals[ib*LOCAL_TERMS], b, a);
+      job->node_interactions[worker] += 2;
+    }
+    return;
+  }
+  if (a->leaf && b->leaf) {
+    p2p(job, a, b, worker);
+    return;
+  }
+  /* split the bigger cell, unless it cannot be split */
+  job->opened[worker]++;
+  if (b->leaf || (!a->leaf && a->rmax >= b->rmax)) {
+    for(c = 0; c < 8; c++) {
+      if (a->child[c] != NO_NODE)
+        interact(job, a->child[c], ib, worker);
+    }
+  } else {
+    for(c = 0; c < 8; c++) {
+      if (b->child[c] != NO_NODE)
+        interact(job, ia, b->child[c], worker);
+    }
+  }
+}
+
+/* the interaction of a cell with itself */
+static void interact_self(FMMJob *job, int ia, int worker) {
+  const Node *a = &job->t->nodes[ia];
+  register int c, d;
+  if (a->leaf) {
+    p2p_self(job, a, worker);
+    return;
+  }
+  job->opened[worker]++;
+  for(c = 0; c < 8; c++) {
+    if (a->child[c] == NO_NODE) continue;
+    interact_self(job, a->child[c], worker);
+    for(d = c + 1; d < 8; d++) {
+      if (a->child[d] != NO_NODE)
+        interact(job, a->child[c], a->child[d], worker);
+    }
+  }
+}
+
+/* cuts the tree into at least want cells that hold every particle
+   between them, a whole level at a time; returns how many there are */
+static long frontier(Tree *t, int **cells, long want) {
+  long n = 1, m, k;
+  int *next;
+  register int c;
+  *cells = ALLOC_N(int, 1);
+  (*cells)[0] = 0;
+  while (n < want) {
+    for(m = 0, k = 0; k < n; k++) {
+      const Node *nd = &t->nodes[(*cells)[k]];
+      if (nd->leaf) { m++; continue; }
+      for(c = 0; c < 8; c++) {
+        if (nd->child[c] != NO_NODE) m++;
+      }
+    }
+    if (m == n) break;    /* nothing but leaves */
+    next = ALLOC_N(int, m);
+    for(m = 0, k = 0; k < n; k++) {
+      const Node *nd = &t->nodes[(*cells)[k]];
+      if (nd->leaf) { next[m++] = (*cells)[k]; continue; }
+      for(c = 0; c < 8; c++) {
+        if (nd->child[c] != NO_NODE) next[m++] = nd->child[c];
+      }
+    }
+    xfree(*cells);
+    *cells = next;
+    n = m;
+  }
+  return n;
+}
+
+/* L2L down the tree, then L2P onto the particles of every leaf.
+   Parents sit before their children in the arena. */
+static void downward(FMMJob *job) {
+  Tree *t = job->t;
+  Particles *s = job->s;
+  long k;
+  for(k = 0; k < t->n; k++) {
+    const Node *nd = &t->nodes[k];
+    const double *L = &t->locals[k*LOCAL_TERMS];
+    register int c;
+    if (!nd->leaf) {
+      for(c = 0; c < 8; c++) {
+        if (nd->child[c] != NO_NODE) {
+          const Node *ch = &t->nodes[nd->child[c]];
+          double d[3];
+          d[0] = ch->pos[0] - nd->pos[0];
+          d[1] = ch->pos[1] - nd->pos[1];
+          d[2] = ch->pos[2] - nd->pos[2];
+          l2l(&t->locals[nd->child[c]*LOCAL_TERMS], L, d);
+        }
+      }
+    } else {
+      long i;
+      for(i = nd->first; i < nd->first + nd->count; i++) {
+        double d[3], grad[3];
+        d[0] = s->x[i] - nd->pos[0];
+        d[1] = s->y[i] - nd->pos[1];
+        d[2] = s->z[i] - nd->pos[2];
+        local_gradient(L, d, grad);
+        s->ax[i] -= grad[0];
+        s->ay[i] -= grad[1];
+        s->az[i] -= grad[2];
+        if (kernel_potential(s))
+          s->pot[i] += local_potential(L, d);
+      }
+    }
+  }
+}
+
+static void fmm_upward_task(void *arg, long block, int worker) {
+  FMMJob *job = (FMMJob *)arg;
+  Particles *s = job->s;
+  tree_moments(job->t, s, TRUE);
+  memset(s->ax, 0, s->n*sizeof(double));
+  memset(s->ay, 0, s->n*sizeof(double));
+  memset(s->az, 0, s->n*sizeof(double));
+  if (kernel_potential(s)) memset(s->pot, 0, s->n*sizeof(double));
+  memset(job->t->locals, 0, job->t->n*LOCAL_TERMS*sizeof(double));
+}
+
+/* one pair of frontier cells, or one cell with itself */
+static void fmm_pair_task(void *arg, long round, long block, int worker) {
+  FMMJob *job = (FMMJob *)arg;
+  long a, b;
+  if (!pool_pairing(job->nslots, round, block, &a, &b)) return;
+  /* the slot that makes an odd count even is empty */
+  if (b >= job->ncells) return;
+  if (a == b) interact_self(job, job->cells[a], worker);
+  else interact(job, job->cells[a], job->cells[b], worker);
+}
+
+static void fmm_downward_task(void *arg, long block, int worker) {
+  downward((FMMJob *)arg);
+}
+
+/* computes the acceleration of every particle of the store the tree was
+   built from. The tree must have been built with morton = true, so that
+   every cell owns a contiguous range of the store. The cell moments are
+   computed here; center_of_mass need not be called. */
+static VALUE tree_fmm_accelerations(VALUE self, VALUE tolerance,
+                                    VALUE epsilon) {
+  Tree *t; GET_TREE(self, t);
+  FMMJob *job;
+  double *saved = NULL;
+  int threads, w;
+  if (NIL_P(t->store) || t->n == 0)
+    rb_raise(rb_eRuntimeError, "ERROR: the tree has not been built yet");
+  if (!t->morton)
+    rb_raise(rb_eRuntimeError,
+      "ERROR: the FMM solver needs a tree built with morton = true");
+  
+  if (t->locals_capacity < t->n) {
+    t->locals_capacity = t->n;
+    REALLOC_N(t->locals, double, t->locals_capacity*LOCAL_TERMS);
+  }
+  job = ALLOC(FMMJob);
+  memset(job, 0, sizeof(FMMJob));
+  job->t = t;
+  GET_STORE(t->store, job->s);
+  job->tol = NUM2DBL(tolerance);
+  kernel_select(&job->k, job->s, NUM2DBL(epsilon),
+                kernel_potential(job->s));
+  threads = job->s->threads;
+  job->ncells = frontier(t, &job->cells, threads > 1 ? 8*threads : 1);
+  job->nslots = job->ncells + job->ncells % 2;
+  /* the expansions sum into the store, so a potential-only pass puts
+     the accelerations back afterwards */
+  if (kernel_potential_only(job->s)) saved = particles_save_acc(job->s);
+  pool_run(1, 1, fmm_upward_task, job);
+  pool_run_rounds(threads, job->nslots, job->nslots, fmm_pair_task, job);
+  pool_run(1, 1, fmm_downward_task, job);
+  if (saved != NULL) particles_restore_acc(job->s, saved);
+  t->opened = t->particle_interactions = t->node_interactions = 0;
+  for(w = 0; w < POOL_MAX_THREADS; w++) {
+    t->opened += job->opened[w];
+    t->particle_interactions += job->particle_interactions[w];
+    t->node_interactions += job->node_interactions[w];
+  }
+  xfree(job->cells);
+  xfree(job);
+  return self;
+}
+
+void Init_fmm() {
+  /* canonical (i <= j <= k) order of the T components */
+  static const int tri[10][3] = {
+    {0,0,0}, {1,1,1}, {2,2,2}, {0,0,1}, {0,0,2},
+    {0,1,1}, {1,1,2}, {0,2,2}, {1,2,2}, {0,1,2}
+  };
+  static const int sym[3][3] = { {4,7,8}, {7,5,9}, {8,9,6} };
+  int i, j, k, c;
+  for(i = 0; i < 3; i++) {
+    for(j = 0; j < 3; j++) {
+      H_IDX[i][j] = sym[i][j];
+      for(k = 0; k < 3; k++) {
+        int a = i, b = j, e = k, tmp;
+        if (a > b) { tmp = a; a = b; b = tmp; }
+        if (b > e) { tmp = b; b = e; e = tmp; }
+        if (a > b) { tmp = a; a = b; b = tmp; }
+        for(c = 0; c < 10; c++) {
+          if (tri[c][0] == a && tri[c][1] == b && tri[c][2] == e)
+            T_IDX[i][j][k] = 10 + c;
+        }
+      }
+    }
+  }
+  rb_define_method(cTreeNode, "fmm_accelerations", tree_fmm_accelerations, 2);
+}
@@ -2,299 +2,1032 @@
              for Ruby work
    author: Pradeep Elankumaran, 2006
    based on Piet Hut & Jun Makino's Ruby treecode contained in the
-   Maya (http://www.artcompsci.org) distribution */
+   Maya (http://www.artcompsci.org) distribution
+
+   The octree lives in a single arena of plain C nodes that is reused
+   from one rebuild to the next. Children are linked by arena index and
+   every node covers a contiguous range of the tree's particle order, so
+   building the tree allocates no Ruby objects at all. Only the root is
+   visible from Ruby, as a TreeNode.
+
+   When the particles have barely moved since the last build, refit
+   keeps the tree as it is and only grows the bounds of the cells their
+   particles have left; the walk opens cells by their bounds, so a
+   refitted tree is as accurate as a rebuilt one, only slower to walk as
+   the bounds loosen. */
 
 #include "stdio.h"
 #include "math.h"
 #include "ruby.h"
 #include "assert.h"
+#include "particles.h"
+#include "morton.h"
+#include "kernel.h"
+#include "pool.h"
+#include "tree.h"
 
-#define TRUE 1
-#define FALSE 0
-#define GET_NODE(val, p) Data_Get_Struct(val, TreeNode, p)
 #define GET_VEC(val, p) Data_Get_Struct(val, Vector, p)
 
 VALUE cTreeNode;
-
-typedef struct {
-  VALUE center;
-  double size;
-  double mass;
-  VALUE pos;
-  VALUE children[8];
-} TreeNode;
+static VALUE cVector;
 
 typedef struct {
   double vec[3];
 } Vector;
 
 /* ALLOCATION METHODS ----------------------- */
-static void node_free(TreeNode *p) {
-  free(p);
+static void tree_mark(Tree *t) {
+  rb_gc_mark(t->store);
 }
 
-static VALUE node_alloc(VALUE klass) {
-  TreeNode *tn = ALLOC(TreeNode);
-  VALUE obj = Data_Wrap_Struct(klass, 0, node_free, tn);
-  return obj; 
+static void tree_free(Tree *t) {
+  free(t->nodes);
+  free(t->order);
+  free(t->next);
+  free(t->keys);
+  free(t->tmp_keys);
+  free(t->tmp_order);
+  free(t->groups);
+  free(t->locals);
+  free(t);
 }
 
-static VALUE node_initialize(VALUE self, VALUE rb_center, VALUE rb_size) {
-  TreeNode *t; GET_NODE(self, t);
-  Vector *p; GET_VEC(rb_center, p);
-  register int i;
-  
-  t->center = rb_center;
-  t->pos = rb_eval_string("Vector.new");
-  t->size = NUM2DBL(rb_size);
-  t->mass = 0.0;
-  for(i = 8; i--; ) {
-    t->children[i] = Qnil;
+static VALUE tree_alloc(VALUE klass) {
+  Tree *t = ALLOC(Tree);
+  memset(t, 0, sizeof(Tree));
+  t->store = Qnil;
+  t->auto_size = TRUE;
+  t->leaf_size = LEAF_SIZE;
+  t->group_size = GROUP_SIZE;
+  t->multipole = 1;
+  return Data_Wrap_Struct(klass, tree_mark, tree_free, t);
+}
+
+/* TreeNode.new sizes the root cell from the particles on every build;
+   TreeNode.new(center, size) keeps a fixed root cell */
+static VALUE tree_initialize(int argc, VALUE *argv, VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  if (argc == 2) {
+    Vector *c; GET_VEC(argv[0], c);
+    t->center[0] = c->vec[0];
+    t->center[1] = c->vec[1];
+    t->center[2] = c->vec[2];
+    t->size = NUM2DBL(argv[1]);
+    t->auto_size = FALSE;
+  } else if (argc != 0) {
+    rb_raise(rb_eArgError,
+      "ERROR: Either a center and a size or no arguments for TreeNode.new");
   }
   return self;
 }
 
 /* UTILITY METHODS ---------------------------------- */
 
-int get_octant(VALUE pos, VALUE center) {
-  Vector *p; GET_VEC(pos, p);
-  Vector *c; GET_VEC(center, c);
-  register int octant = 0, i = 0;
-  for(i = 0; i < 3; i++) {
-    octant *= 2;
-    if (p->vec[i] > c->vec[i])
-      octant += 1;
+static VALUE new_vector(const double *v) {
+  VALUE new_vec = rb_obj_alloc(cVector);
+  Vector *p; GET_VEC(new_vec, p);
+  p->vec[0] = v[0];
+  p->vec[1] = v[1];
+  p->vec[2] = v[2];
+  return new_vec;
+}
+
+static int get_octant(const Particles *s, long i, const double *center) {
+  return ((s->x[i] > center[0]) << 2) |
+         ((s->y[i] > center[1]) << 1) |
+          (s->z[i] > center[2]);
+}
+
+/* hands out a fresh leaf from the arena. The arena only ever grows, so
+   after the first few steps a rebuild never touches malloc. */
+static int new_node(Tree *t, const double *center, double size) {
+  Node *nd;
+  register int i;
+  if (t->n == t->capacity) {
+    t->capacity = t->capacity ? 2*t->capacity : 1024;
+    REALLOC_N(t->nodes, Node, t->capacity);
+  }
+  nd = &t->nodes[t->n];
+  nd->center[0] = center[0];
+  nd->center[1] = center[1];
+  nd->center[2] = center[2];
+  nd->size = size;
+  nd->bound = size;
+  nd->mass = 0.0;
+  nd->pos[0] = nd->pos[1] = nd->pos[2] = 0.0;
+  memset(nd->quad, 0, sizeof(nd->quad));
+  for(i = 8; i--; ) {
+    nd->child[i] = NO_NODE;
   }
-  return octant;
+  nd->leaf = TRUE;
+  nd->first = -1;
+  nd->count = 0;
+  return (int)t->n++;
 }
 
-VALUE get_offset(int corner) {
-  VALUE offset_vec = rb_eval_string("Vector.new");
-  Vector *p; GET_VEC(offset_vec, p);
-  
-  p->vec[2] = (corner & 1)*2 - 1;
-  corner >>=1;
-  p->vec[1] = (corner & 1)*2 - 1;
-  corner >>=1;
-  p->vec[0] = (corner & 1)*2 - 1;
-  return offset_vec;
+/* returns the child of a node covering the given octant, creating it */
+static int get_child(Tree *t, int node, int corner) {
+  Node *nd = &t->nodes[node];
+  double child_size, center[3];
+  int c;
+  if (nd->child[corner] != NO_NODE)
+    return nd->child[corner];
+  child_size = nd->size / 2.0;
+  center[0] = nd->center[0] + child_size*(((corner >> 2) & 1)*2 - 1);
+  center[1] = nd->center[1] + child_size*(((corner >> 1) & 1)*2 - 1);
+  center[2] = nd->center[2] + child_size*((corner & 1)*2 - 1);
+  c = new_node(t, center, child_size);
+  t->nodes[node].child[corner] = c;
+  return c;
+}
+
+/* TREE METHODS ------------------------------------ */
+
+/* loads particle i into the subtree below node. A leaf holds a single
+   particle unless it has reached MAX_DEPTH, where coincident particles
+   are simply chained together. */
+static void insert_particle(Tree *t, const Particles *s, int node,
+                            int depth, long i) {
+  for(;;) {
+    Node *nd = &t->nodes[node];
+    if (depth > t->depth) t->depth = depth;
+    if (nd->leaf) {
+      if (nd->count == 0 || depth >= MAX_DEPTH) {
+        t->next[i] = nd->first;
+        nd->first = i;
+        nd->count++;
+        return;
+      } else {
+        /* split: push the resident particle(s) one level down */
+        long q = nd->first;
+        nd->leaf = FALSE;
+        nd->first = -1;
+        nd->count = 0;
+        while (q >= 0) {
+          long next = t->next[q];
+          int c = get_child(t, node, get_octant(s, q, t->nodes[node].center));
+          insert_particle(t, s, c, depth + 1, q);
+          q = next;
+        }
+      }
+    }
+    node = get_child(t, node, get_octant(s, i, t->nodes[node].center));
+    depth++;
+  }
 }
 
-int check_classname(char *str1, char *str2) {
-  if (strcmp(str1, str2) == 0) {
-    return TRUE;
+/* lays the particles out in depth-first order and gives every node its
+   range of that order. While building, a leaf's first field is the head
+   of its particle chain. */
+static void assign_ranges(Tree *t, int node) {
+  Node *nd = &t->nodes[node];
+  long start = t->norder;
+  register int i;
+  if (nd->leaf) {
+    long q;
+    for(q = nd->first; q >= 0; q = t->next[q]) {
+      t->order[t->norder++] = q;
+    }
   } else {
-    return FALSE;
+    for(i = 0; i < 8; i++) {
+      if (nd->child[i] != NO_NODE)
+        assign_ranges(t, nd->child[i]);
+    }
   }
+  t->nodes[node].first = start;
+  t->nodes[node].count = t->norder - start;
 }
 
-static VALUE node_print(VALUE self) {
-  TreeNode *t; GET_NODE(self, t);
-  Vector *c; GET_VEC(t->center, c);
-  Vector *p; GET_VEC(t->pos, p);
-  rb_p(self);
-  printf("---------\n");
-  printf("size: %g\n", t->size);
-  printf("center: %g %g %g\n", c->vec[0], c->vec[1], c->vec[2]);
-  printf("pos: %g %g %g\n", p->vec[0], p->vec[1], p->vec[2]);
-  printf("mass: %g\n", t->mass);
-  printf("----------\n");
+/* builds the subtree of node from the Morton-sorted particles [lo, hi),
+   all of which share the top 3*level bits of their keys. The children
+   are found by binary search on the next three bits, so every node ends
+   up owning a contiguous range of the store. */
+static void build_range(Tree *t, int node, long lo, long hi, int level) {
+  const uint64_t *keys = t->keys;
+  int shift = 3*(MORTON_BITS - 1 - level), oct;
+  long a = lo;
+  t->nodes[node].first = lo;
+  t->nodes[node].count = hi - lo;
+  if (level > t->depth) t->depth = level;
+  if (hi - lo <= t->leaf_size || level >= MORTON_BITS ||
+      level >= MAX_DEPTH)
+    return;
+  t->nodes[node].leaf = FALSE;
+  for(oct = 0; oct < 8 && a < hi; oct++) {
+    long l = a, r = hi;
+    while (l < r) {
+      long mid = (l + r)/2;
+      if ((int)((keys[mid] >> shift) & 7) <= oct) l = mid + 1;
+      else r = mid;
+    }
+    if (l > a)
+      build_range(t, get_child(t, node, oct), a, l, level + 1);
+    a = l;
+  }
+}
+
+/* sorts the store along the Morton curve of the root cell and builds
+   the tree from the sorted keys. The tree order is then the identity. */
+static void build_morton(Tree *t, Particles *s, const double *center,
+                         double size) {
+  long i, n = s->n;
+  REALLOC_N(t->keys, uint64_t, t->order_capacity);
+  REALLOC_N(t->tmp_keys, uint64_t, t->order_capacity);
+  REALLOC_N(t->tmp_order, long, t->order_capacity);
+  for(i = 0; i < n; i++) {
+    t->keys[i] = morton_key(s->x[i], s->y[i], s->z[i], center, size);
+    t->order[i] = i;
+  }
+  morton_sort(t->keys, t->order, n, t->tmp_keys, t->tmp_order);
+  particles_permute(s, t->order);
+  for(i = 0; i < n; i++) {
+    t->order[i] = i;
+  }
+  new_node(t, center, size);
+  build_range(t, 0, 0, n, 0);
+}
+
+/* rebuilds the whole tree from the particle store */
+static VALUE tree_build(VALUE self, VALUE store) {
+  Tree *t; GET_TREE(self, t);
+  Particles *s; GET_STORE(store, s);
+  double center[3], size;
+  long i, n = s->n;
+  
+  if (t->auto_size) {
+    /* the smallest power-of-two cube around the origin that holds
+       every particle */
+    double r = 0.0;
+    for(i = 0; i < n; i++) {
+      if (s->x[i] > r) r = s->x[i];
+      if (-s->x[i] > r) r = -s->x[i];
+      if (s->y[i] > r) r = s->y[i];
+      if (-s->y[i] > r) r = -s->y[i];
+      if (s->z[i] > r) r = s->z[i];
+      if (-s->z[i] > r) r = -s->z[i];
+    }
+    size = 1.0;
+    while (r > size) size *= 2.0;
+    center[0] = center[1] = center[2] = 0.0;
+  } else {
+    memcpy(center, t->center, sizeof(center));
+    size = t->size;
+  }
+  t->escaped = 0.0;
+  
+  if (t->order_capacity < n || t->order == NULL) {
+    t->order_capacity = n ? n : 1;
+    REALLOC_N(t->order, long, t->order_capacity);
+    REALLOC_N(t->next, long, t->order_capacity);
+  }
+  t->store = store;
+  t->n = 0;
+  t->depth = 0;
+  if (t->morton) {
+    build_morton(t, s, center, size);
+    return self;
+  }
+  new_node(t, center, size);
+  for(i = 0; i < n; i++) {
+    insert_particle(t, s, 0, 0, i);
+  }
+  t->norder = 0;
+  assign_ranges(t, 0);
   return self;
 }
 
+/* the largest coordinate distance of a point from a cell centre */
+static double cube_distance(double x, double y, double z,
+                            const double *center) {
+  double d = fabs(x - center[0]);
+  if (fabs(y - center[1]) > d) d = fabs(y - center[1]);
+  if (fabs(z - center[2]) > d) d = fabs(z - center[2]);
+  return d;
+}
 
-/* TREE METHODS ------------------------------------ */
+/* refits the tree to the moved particles of the store it was last
+   built from. The cells and the particle order stay; every node's bound
+   grows to hold its particles again, in one backwards sweep like
+   tree_moments. Returns false if the tree has to be rebuilt instead:
+   it was built from another store or another number of particles, or
+   more than threshold of the particles have left their leaf cells.
+   center_of_mass has to be called afterwards either way. */
+static VALUE tree_refit(VALUE self, VALUE store, VALUE threshold) {
+  Tree *t; GET_TREE(self, t);
+  Particles *s; GET_STORE(store, s);
+  long k, escaped = 0;
+  if (t->n == 0 || store != t->store || t->nodes[0].count != s->n)
+    return Qfalse;
+  for(k = t->n - 1; k >= 0; k--) {
+    Node *nd = &t->nodes[k];
+    double bound = nd->size, d;
+    register int i;
+    if (nd->leaf) {
+      long q;
+      for(q = nd->first; q < nd->first + nd->count; q++) {
+        long j = t->order[q];
+        d = cube_distance(s->x[j], s->y[j], s->z[j], nd->center);
+        if (d > nd->size) escaped++;
+        if (d > bound) bound = d;
+      }
+    } else {
+      for(i = 0; i < 8; i++) {
+        if (nd->child[i] != NO_NODE) {
+          const Node *c = &t->nodes[nd->child[i]];
+          d = cube_distance(c->center[0], c->center[1], c->center[2],
+                            nd->center) + c->bound;
+          if (d > bound) bound = d;
+        }
+      }
+    }
+    nd->bound = bound;
+  }
+  t->escaped = s->n > 0 ? (double)escaped/s->n : 0.0;
+  return t->escaped <= NUM2DBL(threshold) ? Qtrue : Qfalse;
+}
 
-/* loads particles into the tree */
-static VALUE node_loadtree(VALUE self, VALUE body) {
-  TreeNode *t; GET_NODE(self, t);
-  int corner = get_octant(rb_iv_get(body, "@pos"), t->center);
-  if (NIL_P(t->children[corner])) {
-    t->children[corner] = body;
-    return self;
+/* adds m (3 d d - d^2 I) to a traceless quadrupole */
+static void add_quadrupole(double *q, double m, double dx, double dy,
+                           double dz) {
+  double d2 = dx*dx + dy*dy + dz*dz;
+  q[0] += m*(3*dx*dx - d2);
+  q[1] += m*(3*dy*dy - d2);
+  q[2] += m*(3*dz*dz - d2);
+  q[3] += m*3*dx*dy;
+  q[4] += m*3*dx*dz;
+  q[5] += m*3*dy*dz;
+}
+
+/* the quadrupole of a node about its own centre of mass: summed over
+   the particles of a leaf, or shifted up from the children with the
+   parallel axis theorem */
+static void node_quadrupole(Tree *t, const Particles *s, Node *nd) {
+  register int i;
+  memset(nd->quad, 0, sizeof(nd->quad));
+  if (nd->leaf) {
+    long q;
+    for(q = nd->first; q < nd->first + nd->count; q++) {
+      long j = t->order[q];
+      add_quadrupole(nd->quad, s->mass[j], s->x[j] - nd->pos[0],
+                     s->y[j] - nd->pos[1], s->z[j] - nd->pos[2]);
+    }
+  } else {
+    for(i = 0; i < 8; i++) {
+      if (nd->child[i] != NO_NODE) {
+        const Node *c = &t->nodes[nd->child[i]];
+        register int k;
+        for(k = 0; k < 6; k++) nd->quad[k] += c->quad[k];
+        add_quadrupole(nd->quad, c->mass, c->pos[0] - nd->pos[0],
+                       c->pos[1] - nd->pos[1], c->pos[2] - nd->pos[2]);
+      }
+    }
   }
-  if (strcmp(rb_obj_classname(t->children[corner]), "Body") == 0) {   
-    /* back-up body at the location */
-    VALUE tmp_body = t->children[corner];
-    double child_size = t->size / 2.0;
-    
-    /* get the center offset for the new node */
-    Vector *c; GET_VEC(t->center, c);
-    VALUE offset_vec = get_offset(corner);
-    Vector *o; GET_VEC(offset_vec, o);
-    
-    /* create the center vector for the new node */
-    VALUE new_vec = rb_eval_string("Vector.new");
-    Vector *p; GET_VEC(new_vec, p);
-    p->vec[0] = c->vec[0] + child_size*o->vec[0];
-    p->vec[1] = c->vec[1] + child_size*o->vec[1];
-    p->vec[2] = c->vec[2] + child_size*o->vec[2];
+}
+
+/* computes the mass, centre of mass and bounding radius of every node.
+   Children always sit later in the arena than their parents, so one
+   backwards sweep visits every child before its parent. With quad set
+   the quadrupole moments are propagated in the same sweep. */
+void tree_moments(Tree *t, const Particles *s, int quad) {
+  long k;
+  for(k = t->n - 1; k >= 0; k--) {
+    Node *nd = &t->nodes[k];
+    double m = 0.0, px = 0.0, py = 0.0, pz = 0.0, r = 0.0, dx, dy, dz;
+    register int i;
+    if (nd->leaf) {
+      long q;
+      for(q = nd->first; q < nd->first + nd->count; q++) {
+        long j = t->order[q];
+        m += s->mass[j];
+        px += s->mass[j]*s->x[j];
+        py += s->mass[j]*s->y[j];
+        pz += s->mass[j]*s->z[j];
+      }
+    } else {
+      for(i = 0; i < 8; i++) {
+        if (nd->child[i] != NO_NODE) {
+          Node *c = &t->nodes[nd->child[i]];
+          m += c->mass;
+          px += c->mass*c->pos[0];
+          py += c->mass*c->pos[1];
+          pz += c->mass*c->pos[2];
+        }
+      }
+    }
+    nd->mass = m;
+    if (m > 0.0) {
+      nd->pos[0] = px/m;
+      nd->pos[1] = py/m;
+      nd->pos[2] = pz/m;
+    } else {
+      memcpy(nd->pos, nd->center, sizeof(nd->pos));
+    }
     
-    /* create a new node and replace the old body with it */
-    t->children[corner] = 
-      rb_funcall(cTreeNode, rb_intern("new"), 2, 
-                 new_vec, rb_float_new(child_size));
+    /* the radius around the centre of mass holding every particle */
+    if (nd->leaf) {
+      long q;
+      for(q = nd->first; q < nd->first + nd->count; q++) {
+        long j = t->order[q];
+        dx = s->x[j] - nd->pos[0];
+        dy = s->y[j] - nd->pos[1];
+        dz = s->z[j] - nd->pos[2];
+        if (dx*dx + dy*dy + dz*dz > r) r = dx*dx + dy*dy + dz*dz;
+      }
+      r = sqrt(r);
+    } else {
+      for(i = 0; i < 8; i++) {
+        if (nd->child[i] != NO_NODE) {
+          Node *c = &t->nodes[nd->child[i]];
+          dx = c->pos[0] - nd->pos[0];
+          dy = c->pos[1] - nd->pos[1];
+          dz = c->pos[2] - nd->pos[2];
+          if (sqrt(dx*dx + dy*dy + dz*dz) + c->rmax > r)
+            r = sqrt(dx*dx + dy*dy + dz*dz) + c->rmax;
+        }
+      }
+    }
+    nd->rmax = r;
     
-    /* load the two bodies into the new node */
-    rb_funcall(t->children[corner], rb_intern("load_tree"), 1, tmp_body);
-    rb_funcall(t->children[corner], rb_intern("load_tree"), 1, body);
-    return self;
+    if (quad)
+      node_quadrupole(t, s, nd);
   }
+}
+
+/* computes the mass and centre of mass of every node. With
+   multipole_order 2 the quadrupole moments are propagated as well. */
+static VALUE tree_center_of_mass(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  Particles *s;
+  if (NIL_P(t->store))
+    rb_raise(rb_eRuntimeError, "ERROR: the tree has not been built yet");
+  GET_STORE(t->store, s);
+  tree_moments(t, s, t->multipole >= 2);
   return self;
 }
 
-/* computes the center of mass of the node */
-static VALUE node_center_of_mass(VALUE self) {
-  TreeNode *t; GET_NODE(self, t);
-  TreeNode *o;
-  Vector *p; GET_VEC(t->pos, p);
-  Vector *op;
+/* FORCE METHODS ------------------------------------ */
+
+/* a growable structure-of-arrays list of sources, owned by one worker
+   thread. It is grown with plain realloc because the workers run
+   without the GVL. The quadrupole columns are only used for cells. */
+typedef struct {
+  double *x, *y, *z, *m;
+  double *q[6];
+  long n, capacity;
+} Interactions;
+
+/* the far-field monopoles of a mixed precision walk, relative to the
+   centre of the group's bounding box */
+typedef struct {
+  float *x, *y, *z, *m;
+  long n, capacity;
+} FarList;
+
+typedef struct {
+  Tree *t;
+  Particles *s;
+  double tol;
+  Kernel k;
+  const char *active;     /* per row: does it need a force, or NULL for
+                             every particle */
+  Interactions parts[POOL_MAX_THREADS];   /* particles and monopoles */
+  Interactions cells[POOL_MAX_THREADS];   /* cells with quadrupoles */
+  FarList far[POOL_MAX_THREADS];          /* float monopoles, when mixed */
+  int *stacks[POOL_MAX_THREADS];
+  long opened[POOL_MAX_THREADS];
+  long particle_interactions[POOL_MAX_THREADS];
+  long node_interactions[POOL_MAX_THREADS];
+} WalkJob;
+
+static void list_reserve(Interactions *l, int quad) {
+  register int k;
+  if (l->n < l->capacity) return;
+  l->capacity = l->capacity ? 2*l->capacity : 1024;
+  l->x = (double *)realloc(l->x, l->capacity*sizeof(double));
+  l->y = (double *)realloc(l->y, l->capacity*sizeof(double));
+  l->z = (double *)realloc(l->z, l->capacity*sizeof(double));
+  l->m = (double *)realloc(l->m, l->capacity*sizeof(double));
+  for(k = 0; quad && k < 6; k++) {
+    l->q[k] = (double *)realloc(l->q[k], l->capacity*sizeof(double));
+  }
+}
+
+static void list_push(Interactions *l, double x, double y, double z,
+                      double m) {
+  list_reserve(l, FALSE);
+  l->x[l->n] = x;
+  l->y[l->n] = y;
+  l->z[l->n] = z;
+  l->m[l->n] = m;
+  l->n++;
+}
+
+static void list_push_cell(Interactions *l, const Node *nd) {
+  register int k;
+  list_reserve(l, TRUE);
+  l->x[l->n] = nd->pos[0];
+  l->y[l->n] = nd->pos[1];
+  l->z[l->n] = nd->pos[2];
+  l->m[l->n] = nd->mass;
+  for(k = 0; k < 6; k++) {
+    l->q[k][l->n] = nd->quad[k];
+  }
+  l->n++;
+}
+
+static void list_free(Interactions *l) {
+  register int k;
+  free(l->x); free(l->y); free(l->z); free(l->m);
+  for(k = 0; k < 6; k++) free(l->q[k]);
+}
+
+static void far_push(FarList *l, double x, double y, double z, double m) {
+  if (l->n == l->capacity) {
+    l->capacity = l->capacity ? 2*l->capacity : 1024;
+    l->x = (float *)realloc(l->x, l->capacity*sizeof(float));
+    l->y = (float *)realloc(l->y, l->capacity*sizeof(float));
+    l->z = (float *)realloc(l->z, l->capacity*sizeof(float));
+    l->m = (float *)realloc(l->m, l->capacity*sizeof(float));
+  }
+  l->x[l->n] = (float)x;
+  l->y[l->n] = (float)y;
+  l->z[l->n] = (float)z;
+  l->m[l->n] = (float)m;
+  l->n++;
+}
+
+static void far_free(FarList *l) {
+  free(l->x); free(l->y); free(l->z); free(l->m);
+}
+
+/* collects the nodes whose particles share one walk: the largest nodes
+   holding no more than group_size particles */
+static void find_groups(Tree *t, int node) {
+  Node *nd = &t->nodes[node];
   register int i;
-  double omass;
-  t->mass = 0.0;
-  
-  for(i = 0; i < 8; i++) {
-    if (check_classname(rb_obj_classname(t->children[i]), "TreeNode")) {
-      rb_funcall(t->children[i], rb_intern("center_of_mass"), 0);
-      omass = NUM2DBL(rb_funcall(t->children[i], rb_intern("mass"), 0));
-      GET_NODE(t->children[i], o);
-      GET_VEC(o->pos, op);
-      t->mass += omass;
-      p->vec[0] += omass * op->vec[0];
-      p->vec[1] += omass * op->vec[1];
-      p->vec[2] += omass * op->vec[2];
-    } else if
-      (check_classname(rb_obj_classname(t->children[i]), "Body")) {
-      omass = NUM2DBL(rb_funcall(t->children[i], rb_intern("mass"),0));
-      VALUE new_pos = rb_funcall(t->children[i], rb_intern("pos"), 0);
-      GET_VEC(new_pos, op);
-      t->mass += omass;
-      p->vec[0] += omass * op->vec[0];
-      p->vec[1] += omass * op->vec[1];
-      p->vec[2] += omass * op->vec[2];
+  if (nd->count <= t->group_size || nd->leaf) {
+    if (nd->count == 0) return;
+    if (t->ngroups == t->groups_capacity) {
+      t->groups_capacity = t->groups_capacity ? 2*t->groups_capacity : 256;
+      REALLOC_N(t->groups, int, t->groups_capacity);
     }
+    t->groups[t->ngroups++] = node;
+    return;
   }
-  p->vec[0] /= t->mass;
-  p->vec[1] /= t->mass;
-  p->vec[2] /= t->mass;
-  rb_iv_set(self, "@pos", t->pos);
-  rb_iv_set(self, "@mass", rb_float_new(t->mass));
-  rb_iv_set(self, "@size", rb_float_new(t->size));
-  return self;
+  for(i = 0; i < 8; i++) {
+    if (nd->child[i] != NO_NODE)
+      find_groups(t, nd->child[i]);
+  }
+}
+
+/* squared distance from a point to the box [lo, hi] */
+static double box_distance2(const double *lo, const double *hi,
+                            const double *p) {
+  double d2 = 0.0, d;
+  register int k;
+  for(k = 0; k < 3; k++) {
+    if (p[k] < lo[k]) { d = lo[k] - p[k]; d2 += d*d; }
+    else if (p[k] > hi[k]) { d = p[k] - hi[k]; d2 += d*d; }
+  }
+  return d2;
 }
 
-static VALUE self_get_other_acc(VALUE self, VALUE other, VALUE epsilon) {
-  TreeNode *t; GET_NODE(self, t);
-  Vector *p; GET_VEC(t->pos, p);
-  Vector *op;
-  VALUE rji = rb_eval_string("Vector.new");
-  Vector *rjip; GET_VEC(rji, rjip);
-  double eps = NUM2DBL(epsilon);
-  int nil_flag = TRUE;
+/* whether a cube of half-side h about c overlaps the box [lo, hi] */
+static int box_overlaps(const double *lo, const double *hi,
+                        const double *c, double h) {
+  register int k;
+  for(k = 0; k < 3; k++) {
+    if (c[k] + h < lo[k] || c[k] - h > hi[k]) return FALSE;
+  }
+  return TRUE;
+}
+
+/* the opening criterion: a node is taken as a whole when its side is
+   at most tol times its distance from the box [lo, hi]. With tol above
+   1/sqrt(3) that alone would take a cell holding some of the box's own
+   particles, so neither the cube holding its particles nor the cube of
+   the same size about its centre of mass may overlap the box. */
+static int node_accepted(const Node *nd, const double *lo, const double *hi,
+                         double tol2) {
+  double side = 2*nd->bound;
+  return side*side <= tol2*box_distance2(lo, hi, nd->pos) &&
+         !box_overlaps(lo, hi, nd->center, nd->bound) &&
+         !box_overlaps(lo, hi, nd->pos, nd->bound);
+}
+
+/* walks the tree once for a whole group: every node that is far enough
+   from the group's bounding box goes into the interaction list as a
+   single pseudo-particle (or a quadrupole cell), every opened leaf
+   contributes its particles. The lists are then summed for each
+   particle of the group, together with its potential if the store asks
+   for it. Only active particles span the bounding box and get summed;
+   a group without any is skipped. In a mixed precision walk the far
+   monopoles go into a float list relative to the centre of the box and
+   are summed by kernel_gather_far32; quadrupole cells and passes that
+   want potentials stay in double. A store with walk costs (see
+   domain/domain.c) gets the length of the lists of every particle. */
+static void group_walk_task(void *arg, long block, int worker) {
+  WalkJob *job = (WalkJob *)arg;
+  Tree *t = job->t;
+  const Particles *s = job->s;
+  Interactions *parts = &job->parts[worker];
+  Interactions *cells = &job->cells[worker];
+  FarList *far = &job->far[worker];
+  const Node *g = &t->nodes[t->groups[block]];
+  double lo[3], hi[3], gc[3], tol2 = job->tol*job->tol;
+  int mixed = t->mixed && t->multipole < 2 && !kernel_potential(s);
+  const char *active = job->active;
+  long q, sp = 0, found = 0, opened = 0, particles = 0;
+  int *stack = job->stacks[worker];
   
-  if(check_classname(rb_obj_classname(other), "Body")) {
-    GET_VEC(rb_iv_get(other, "@pos"), op);
-    nil_flag = FALSE;
-  } else if (check_classname(rb_obj_classname(other), "TreeNode")) {
-    TreeNode *o; GET_NODE(other, o);
-    GET_VEC(o->pos, op);
-    nil_flag = FALSE;
+  for(q = g->first; q < g->first + g->count; q++) {
+    long i = t->order[q];
+    if (active != NULL && !active[i]) continue;
+    if (found++ == 0) {
+      lo[0] = hi[0] = s->x[i];
+      lo[1] = hi[1] = s->y[i];
+      lo[2] = hi[2] = s->z[i];
+    }
+    if (s->x[i] < lo[0]) lo[0] = s->x[i];
+    if (s->x[i] > hi[0]) hi[0] = s->x[i];
+    if (s->y[i] < lo[1]) lo[1] = s->y[i];
+    if (s->y[i] > hi[1]) hi[1] = s->y[i];
+    if (s->z[i] < lo[2]) lo[2] = s->z[i];
+    if (s->z[i] > hi[2]) hi[2] = s->z[i];
   }
- 
-  if (self == other) {  
-    return rb_eval_string("Vector.new");
-  } else {
-    if (nil_flag == FALSE) {
-      rjip->vec[0] = p->vec[0] - op->vec[0];
-      rjip->vec[1] = p->vec[1] - op->vec[1];
-      rjip->vec[2] = p->vec[2] - op->vec[2];
-      double r2 = eps*eps + rjip->vec[0]*rjip->vec[0] + 
-                  rjip->vec[1]*rjip->vec[1] + rjip->vec[2]*rjip->vec[2];
-      rjip->vec[0] *= t->mass/(r2*sqrt(r2));
-      rjip->vec[1] *= t->mass/(r2*sqrt(r2));
-      rjip->vec[2] *= t->mass/(r2*sqrt(r2));
-      return rji;
+  if (found == 0) return;
+  if (stack == NULL)
+    stack = job->stacks[worker] =
+      (int *)malloc((8*MAX_DEPTH + 8)*sizeof(int));
+  parts->n = cells->n = far->n = 0;
+  gc[0] = 0.5*(lo[0] + hi[0]);
+  gc[1] = 0.5*(lo[1] + hi[1]);
+  gc[2] = 0.5*(lo[2] + hi[2]);
+  
+  stack[sp++] = 0;
+  while (sp > 0) {
+    const Node *nd = &t->nodes[stack[--sp]];
+    if (node_accepted(nd, lo, hi, tol2)) {
+      if (t->multipole >= 2)
+        list_push_cell(cells, nd);
+      else if (mixed)
+        far_push(far, nd->pos[0] - gc[0], nd->pos[1] - gc[1],
+                 nd->pos[2] - gc[2], nd->mass);
+      else
+        list_push(parts, nd->pos[0], nd->pos[1], nd->pos[2], nd->mass);
+    } else if (nd->leaf) {
+      opened++;
+      particles += nd->count;
+      for(q = nd->first; q < nd->first + nd->count; q++) {
+        long j = t->order[q];
+        list_push(parts, s->x[j], s->y[j], s->z[j], s->mass[j]);
+      }
+    } else {
+      register int c;
+      opened++;
+      for(c = 0; c < 8; c++) {
+        if (nd->child[c] != NO_NODE)
+          stack[sp++] = nd->child[c];
+      }
     }
   }
+  job->opened[worker] += opened;
+  job->particle_interactions[worker] += found*particles;
+  job->node_interactions[worker] +=
+    found*(parts->n - particles + cells->n + far->n);
+  
+  for(q = g->first; q < g->first + g->count; q++) {
+    long i = t->order[q];
+    if (active != NULL && !active[i]) continue;
+    if (s->work != NULL) s->work[i] = parts->n + cells->n + far->n;
+    if (kernel_potential(s)) {
+      /* summed aside, so that a potential-only pass keeps the forces */
+      double ax = 0.0, ay = 0.0, az = 0.0;
+      s->pot[i] = 0.0;
+      job->k.gather(&job->k, s->x[i], s->y[i], s->z[i],
+                    parts->x, parts->y, parts->z, parts->m, parts->n,
+                    &ax, &ay, &az, &s->pot[i]);
+      if (cells->n > 0)
+        kernel_gather_quad_pot(s->x[i], s->y[i], s->z[i],
+                               cells->x, cells->y, cells->z, cells->m,
+                               cells->q, cells->n, job->k.eps2,
+                               &ax, &ay, &az, &s->pot[i]);
+      if (!kernel_potential_only(s)) {
+        s->ax[i] = ax; s->ay[i] = ay; s->az[i] = az;
+      }
+      continue;
+    }
+    s->ax[i] = s->ay[i] = s->az[i] = 0.0;
+    job->k.gather(&job->k, s->x[i], s->y[i], s->z[i],
+                  parts->x, parts->y, parts->z, parts->m, parts->n,
+                  &s->ax[i], &s->ay[i], &s->az[i], NULL);
+    if (cells->n > 0)
+      kernel_gather_quad(s->x[i], s->y[i], s->z[i],
+                         cells->x, cells->y, cells->z, cells->m, cells->q,
+                         cells->n, job->k.eps2,
+                         &s->ax[i], &s->ay[i], &s->az[i]);
+    if (far->n > 0)
+      kernel_gather_far32((float)(s->x[i] - gc[0]), (float)(s->y[i] - gc[1]),
+                          (float)(s->z[i] - gc[2]),
+                          far->x, far->y, far->z, far->m, far->n,
+                          (float)job->k.eps2, &s->ax[i], &s->ay[i], &s->az[i]);
+  }
 }
 
-static VALUE node_get_acc(VALUE self, VALUE body, 
-                          VALUE tolerance, VALUE epsilon) {
-  TreeNode *t; GET_NODE(self, t);
-  Vector *p; GET_VEC(t->pos, p);
-  VALUE body_pos = rb_iv_get(body, "@pos");
-  Vector *bp; GET_VEC(body_pos, bp);
-  double tol = NUM2DBL(tolerance);
-  VALUE acc = rb_eval_string("Vector.new");
-  Vector *a; GET_VEC(acc, a);
-  
-  Vector dist;
-  dist.vec[0] = bp->vec[0] - p->vec[0];
-  dist.vec[1] = bp->vec[1] - p->vec[1];
-  dist.vec[2] = bp->vec[2] - p->vec[2];
-  double dist_mag = sqrt(dist.vec[0]*dist.vec[0] + 
-                         dist.vec[1]*dist.vec[1] + 
-                         dist.vec[2]*dist.vec[2]);
+/* computes the acceleration of every particle of the store the tree
+   was built from, or with active only of the store's active set.
+   center_of_mass must have been called first. */
+static VALUE tree_accelerations(int argc, VALUE *argv, VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  VALUE tolerance, epsilon, active;
+  char *flags = NULL;
+  WalkJob *job;
+  int w;
+  rb_scan_args(argc, argv, "21", &tolerance, &epsilon, &active);
+  if (NIL_P(t->store) || t->n == 0)
+    rb_raise(rb_eRuntimeError, "ERROR: the tree has not been built yet");
   
-  if ( (2*t->size) > (tol*dist_mag) ) {
-    register int i;
-    for(i = 0; i < 8; i++ ) {
-      if (NIL_P(t->children[i]) == FALSE) {
-        VALUE c_acc = rb_funcall(t->children[i], rb_intern("get_acc"), 3,
-          body, tolerance, epsilon);
-        Vector *cap; GET_VEC(c_acc, cap);
-        a->vec[0] += cap->vec[0];
-        a->vec[1] += cap->vec[1];
-        a->vec[2] += cap->vec[2];
-        return acc;
+  job = ALLOC(WalkJob);
+  memset(job, 0, sizeof(WalkJob));
+  job->t = t;
+  GET_STORE(t->store, job->s);
+  job->tol = NUM2DBL(tolerance);
+  kernel_select(&job->k, job->s, NUM2DBL(epsilon),
+                kernel_potential(job->s));
+  if (RTEST(active)) {
+    long q;
+    flags = ALLOC_N(char, job->s->n > 0 ? job->s->n : 1);
+    memset(flags, 0, job->s->n);
+    for(q = 0; q < job->s->nactive; q++) {
+      flags[job->s->where[job->s->active[q]]] = 1;
+    }
+    job->active = flags;
+  }
+  t->ngroups = 0;
+  find_groups(t, 0);
+  pool_run(job->s->threads, t->ngroups, group_walk_task, job);
+  if (flags != NULL) xfree(flags);
+  t->opened = t->particle_interactions = t->node_interactions = 0;
+  for(w = 0; w < POOL_MAX_THREADS; w++) {
+    t->opened += job->opened[w];
+    t->particle_interactions += job->particle_interactions[w];
+    t->node_interactions += job->node_interactions[w];
+    list_free(&job->parts[w]);
+    list_free(&job->cells[w]);
+    far_free(&job->far[w]);
+    free(job->stacks[w]);
+  }
+  xfree(job);
+  return self;
+}
+
+/* the part of the tree another process needs for the forces on its
+   particles, all of them inside the box [lo, hi]: the walk of
+   group_walk_task from that box, where every node far enough from it is
+   exported as its monopole and every opened leaf as its particles.
+   Returns x y z m of every one as packed doubles. center_of_mass must
+   have been called first. */
+static VALUE tree_essential(VALUE self, VALUE rb_lo, VALUE rb_hi,
+                            VALUE tolerance) {
+  Tree *t; GET_TREE(self, t);
+  Particles *s;
+  double lo[3], hi[3], tol = NUM2DBL(tolerance), *out = NULL;
+  long q, n = 0, capacity = 0;
+  int k, sp = 0, stack[8*MAX_DEPTH + 8];
+  VALUE str;
+  if (NIL_P(t->store))
+    rb_raise(rb_eRuntimeError, "ERROR: the tree has not been built yet");
+  GET_STORE(t->store, s);
+  for(k = 0; k < 3; k++) {
+    lo[k] = NUM2DBL(rb_ary_entry(rb_lo, k));
+    hi[k] = NUM2DBL(rb_ary_entry(rb_hi, k));
+  }
+  if (t->n > 0) stack[sp++] = 0;
+  while (sp > 0) {
+    const Node *nd = &t->nodes[stack[--sp]];
+    if (nd->count == 0) continue;
+    if (n + nd->count > capacity) {
+      capacity = 2*capacity > n + nd->count ? 2*capacity : n + nd->count;
+      REALLOC_N(out, double, 4*capacity);
+    }
+    if (node_accepted(nd, lo, hi, tol*tol)) {
+      out[4*n] = nd->pos[0];
+      out[4*n + 1] = nd->pos[1];
+      out[4*n + 2] = nd->pos[2];
+      out[4*n + 3] = nd->mass;
+      n++;
+    } else if (nd->leaf) {
+      for(q = nd->first; q < nd->first + nd->count; q++) {
+        long j = t->order[q];
+        out[4*n] = s->x[j];
+        out[4*n + 1] = s->y[j];
+        out[4*n + 2] = s->z[j];
+        out[4*n + 3] = s->mass[j];
+        n++;
+      }
+    } else {
+      register int c;
+      for(c = 0; c < 8; c++) {
+        if (nd->child[c] != NO_NODE)
+          stack[sp++] = nd->child[c];
       }
     }
-  } else {
-    printf("other!\n");
-    self_get_other_acc(self, body, epsilon);
   }
+  str = rb_str_new((const char *)out, 4*n*sizeof(double));
+  xfree(out);
+  return str;
+}
+
+static VALUE tree_print(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  Node *r;
+  if (t->n == 0) {
+    printf("empty tree\n");
+    return self;
+  }
+  r = &t->nodes[0];
+  printf("---------\n");
+  printf("nodes: %ld depth: %d\n", t->n, t->depth);
+  printf("size: %g\n", r->size);
+  printf("center: %g %g %g\n", r->center[0], r->center[1], r->center[2]);
+  printf("pos: %g %g %g\n", r->pos[0], r->pos[1], r->pos[2]);
+  printf("mass: %g\n", r->mass);
+  printf("----------\n");
+  return self;
 }
 
 
 /* ACCESSOR METHODS -------------------------------------------*/
-static VALUE node_mass (VALUE self) {
-  TreeNode *t; GET_NODE(self, t);
-  return rb_float_new(t->mass);
+static Node *get_root(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  if (t->n == 0)
+    rb_raise(rb_eRuntimeError, "ERROR: the tree has not been built yet");
+  return &t->nodes[0];
 }
 
-static VALUE node_pos (VALUE self) {
-  TreeNode *t; GET_NODE(self, t);
-  return t->pos;
+static VALUE tree_mass(VALUE self) {
+  return rb_float_new(get_root(self)->mass);
 }
 
-static VALUE node_size (VALUE self) {
-  TreeNode *t; GET_NODE(self, t);
-  return rb_float_new(t->size);
+static VALUE tree_pos(VALUE self) {
+  return new_vector(get_root(self)->pos);
 }
 
-static VALUE node_child_each(VALUE self) {
-  TreeNode *t; GET_NODE(self, t);
-  register int i;
-  for(i = 0; i < 8; i++) {
-    rb_yield(t->children[i]);
-  }
-  return self;
+static VALUE tree_center(VALUE self) {
+  return new_vector(get_root(self)->center);
+}
+
+static VALUE tree_size(VALUE self) {
+  return rb_float_new(get_root(self)->size);
+}
+
+/* fraction of the particles that had left their leaf cells at the
+   last refit; 0 right after a build */
+static VALUE tree_escaped(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return rb_float_new(t->escaped);
+}
+
+/* particle-source pairs summed by the last accelerations call, cells
+   counting as one source */
+static VALUE tree_interactions(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return LONG2NUM(t->particle_interactions + t->node_interactions);
+}
+
+static VALUE tree_particle_interactions(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return LONG2NUM(t->particle_interactions);
+}
+
+static VALUE tree_node_interactions(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return LONG2NUM(t->node_interactions);
+}
+
+/* nodes the last accelerations call opened, once for every group whose
+   walk opened them */
+static VALUE tree_nodes_opened(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return LONG2NUM(t->opened);
+}
+
+static VALUE tree_node_count(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return LONG2NUM(t->n);
+}
+
+static VALUE tree_depth(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return INT2NUM(t->depth);
+}
+
+static VALUE tree_morton(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return t->morton ? Qtrue : Qfalse;
+}
+
+static VALUE tree_set_morton(VALUE self, VALUE morton) {
+  Tree *t; GET_TREE(self, t);
+  t->morton = RTEST(morton);
+  return morton;
+}
+
+static VALUE tree_multipole_order(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return INT2NUM(t->multipole);
+}
+
+static VALUE tree_set_multipole_order(VALUE self, VALUE order) {
+  Tree *t; GET_TREE(self, t);
+  int o = NUM2INT(order);
+  if (o < 1 || o > 2)
+    rb_raise(rb_eArgError,
+      "ERROR: the multipole order is 1 (monopole) or 2 (quadrupole)");
+  t->multipole = o;
+  return order;
+}
+
+static VALUE tree_mixed_precision(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return t->mixed ? Qtrue : Qfalse;
+}
+
+/* with mixed_precision set the walk sums its far-field monopoles in
+   single precision (see group_walk_task) */
+static VALUE tree_set_mixed_precision(VALUE self, VALUE mixed) {
+  Tree *t; GET_TREE(self, t);
+  t->mixed = RTEST(mixed);
+  return mixed;
+}
+
+static VALUE tree_group_size(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return INT2NUM(t->group_size);
+}
+
+static VALUE tree_set_group_size(VALUE self, VALUE group_size) {
+  Tree *t; GET_TREE(self, t);
+  int g = NUM2INT(group_size);
+  if (g < 1)
+    rb_raise(rb_eArgError, "ERROR: a group holds at least one particle");
+  t->group_size = g;
+  return group_size;
+}
+
+static VALUE tree_leaf_size(VALUE self) {
+  Tree *t; GET_TREE(self, t);
+  return INT2NUM(t->leaf_size);
+}
+
+static VALUE tree_set_leaf_size(VALUE self, VALUE leaf_size) {
+  Tree *t; GET_TREE(self, t);
+  int l = NUM2INT(leaf_size);
+  if (l < 1)
+    rb_raise(rb_eArgError, "ERROR: a leaf holds at least one particle");
+  t->leaf_size = l;
+  return leaf_size;
 }
 
 
 /* MAIN RUBY DECLARATION ------------------------------------- */
 void Init_tree() {
   rb_require("vector/vector");
-  rb_require("pairwise/pairwise");
+  rb_require("particles/particles");
+  cVector = rb_const_get(rb_cObject, rb_intern("Vector"));
   cTreeNode = rb_define_class("TreeNode", rb_cObject);
-  rb_define_alloc_func(cTreeNode, node_alloc);
-  rb_define_method(cTreeNode, "initialize", node_initialize, 2);
-  rb_define_method(cTreeNode, "load_tree", node_loadtree, 1);
-  rb_define_method(cTreeNode, "print", node_print, 0);
-  rb_define_method(cTreeNode, "center_of_mass", node_center_of_mass, 0);
-  //rb_define_method(cTreeNode, "get_acc", node_get_acc, 3);
-  rb_define_method(cTreeNode, "mass", node_mass, 0);
-  rb_define_method(cTreeNode, "pos", node_pos, 0);
-  rb_define_method(cTreeNode, "size", node_size, 0);
-  rb_define_method(cTreeNode, "each_child", node_child_each, 0);
-}
\ No newline at end of file
+  rb_define_alloc_func(cTreeNode, tree_alloc);
+  rb_define_method(cTreeNode, "initialize", tree_initialize, -1);
+  rb_define_method(cTreeNode, "build", tree_build, 1);
+  rb_define_method(cTreeNode, "refit", tree_refit, 2);
+  rb_define_method(cTreeNode, "print", tree_print, 0);
+  rb_define_method(cTreeNode, "center_of_mass", tree_center_of_mass, 0);
+  rb_define_method(cTreeNode, "accelerations", tree_accelerations, -1);
+  rb_define_method(cTreeNode, "essential", tree_essential, 3);
+  rb_define_method(cTreeNode, "mass", tree_mass, 0);
+  rb_define_method(cTreeNode, "pos", tree_pos, 0);
+  rb_define_method(cTreeNode, "center", tree_center, 0);
+  rb_define_method(cTreeNode, "size", tree_size, 0);
+  rb_define_method(cTreeNode, "escaped", tree_escaped, 0);
+  rb_define_method(cTreeNode, "interactions", tree_interactions, 0);
+  rb_define_method(cTreeNode, "particle_interactions",
+                   tree_particle_interactions, 0);
+  rb_define_method(cTreeNode, "node_interactions",
+                   tree_node_interactions, 0);
+  rb_define_method(cTreeNode, "nodes_opened", tree_nodes_opened, 0);
+  rb_define_method(cTreeNode, "node_count", tree_node_count, 0);
+  rb_define_method(cTreeNode, "depth", tree_depth, 0);
+  rb_define_method(cTreeNode, "morton?", tree_morton, 0);
+  rb_define_method(cTreeNode, "morton=", tree_set_morton, 1);
+  rb_define_method(cTreeNode, "multipole_order", tree_multipole_order, 0);
+  rb_define_method(cTreeNode, "multipole_order=",
+                   tree_set_multipole_order, 1);
+  rb_define_method(cTreeNode, "mixed_precision?", tree_mixed_precision, 0);
+  rb_define_method(cTreeNode, "mixed_precision=",
+                   tree_set_mixed_precision, 1);
+  rb_define_method(cTreeNode, "group_size", tree_group_size, 0);
+  rb_define_method(cTreeNode, "group_size=", tree_set_group_size, 1);
+  rb_define_method(cTreeNode, "leaf_size", tree_leaf_size, 0);
+  rb_define_method(cTreeNode, "leaf_size=", tree_set_leaf_size, 1);
+  Init_fmm();
+}
@@ -0,0 +1,74 @@
+/* tree.h -> the arena octree shared by the Barnes & Hut walk (tree.c)
+             and the fast multipole solver (fmm.c) */
+
+#ifndef TARA_TREE_H
+#define TARA_TREE_H
+
+#include "stdint.h"
+#include "ruby.h"
+#include "particles.h"
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+#define GET_TREE(val, p) Data_Get_Struct(val, Tree, p)
+#define MAX_DEPTH 48
+#define LEAF_SIZE 8
+#define GROUP_SIZE 32
+#define NO_NODE -1
+#define LOCAL_TERMS 20
+
+typedef struct {
+  double center[3];
+  double size;         /* half the side of the cell */
+  double bound;        /* half the side of the cube about center holding
+                          every particle: size, unless a refit found
+                          particles that have left the cell */
+  double mass;
+  double pos[3];       /* centre of mass */
+  double rmax;         /* radius around pos holding every particle */
+  double quad[6];      /* traceless quadrupole: xx yy zz xy xz yz */
+  int child[8];        /* arena indices of the children, or NO_NODE */
+  int leaf;
+  long first, count;   /* particles of the node: order[first, first+count) */
+} Node;
+
+typedef struct {
+  Node *nodes;         /* the arena; nodes[0] is the root */
+  long n, capacity;
+  long *order;         /* particle indices in depth-first tree order */
+  long *next;          /* links the particles of a leaf while building */
+  long norder, order_capacity;
+  double center[3];    /* fixed root cell, when auto_size is FALSE */
+  double size;
+  int auto_size;
+  int morton;          /* build from Morton-sorted particles */
+  int leaf_size;       /* bucket size of the Morton build */
+  int group_size;      /* most particles sharing one tree walk */
+  int multipole;       /* multipole order: 1 monopole, 2 quadrupole */
+  int mixed;           /* far-field monopoles in single precision */
+  int *groups;         /* nodes whose particles walk the tree together */
+  long ngroups, groups_capacity;
+  int depth;
+  long opened;         /* nodes opened by the last walk, summed over
+                          the groups (cells split, for the FMM) */
+  long particle_interactions, node_interactions;
+                       /* particle-particle and particle-cell pairs
+                          summed by the last walk (cell-cell M2L, for
+                          the FMM) */
+  double escaped;      /* fraction of the particles outside their leaf
+                          cells at the last refit */
+  uint64_t *keys, *tmp_keys;
+  long *tmp_order;
+  double *locals;      /* FMM local expansions, LOCAL_TERMS per node */
+  long locals_capacity;
+  VALUE store;         /* the Particles the tree was last built from */
+} Tree;
+
+extern VALUE cTreeNode;
+
+void tree_moments(Tree *t, const Particles *s, int quad);
+void Init_fmm();
+
+#endif
@@ -0,0 +1,277 @@
+=begin
+A distributed run splits the bodies of an NBody between several
+processes, each of them integrating the bodies of its own domain: a
+range of the Morton curve through the system that holds about the same
+share of the tree walk's work (see domain/domain.c). The processes talk
+through a communicator, either MPI (MPICommunicator, when the domain
+extension was built against an MPI library) or local processes forked
+from this one and connected by sockets (ForkCommunicator); both offer
+rank, size, alltoall, allgather, gather, allreduce and barrier on
+Strings, and every process must call them in the same order.
+=end
+require 'socket'
+require 'domain/domain'
+
+class ForkCommunicator
+  attr_reader :rank, :size
+
+  # forks size - 1 processes and runs the block in every one of them and
+  # in this one, with a communicator of its own; returns when all of
+  # them are done, and raises if any of them failed
+  def self.run(size)
+    sockets = Array.new(size) { Array.new(size) }
+    (0...size).each do |a|
+      (a + 1...size).each {|b| sockets[a][b], sockets[b][a] = UNIXSocket.pair }
+    end
+    pids = (1...size).collect do |rank|
+      fork do
+        status = 0
+        begin
+          yield new(rank, size, sockets)
+        rescue Exception => e
+          warn "ERROR: process #{rank}: #{e.message}"
+          status = 1
+        end
+        $stderr.flush
+        exit!(status)
+      end
+    end
+    comm = new(0, size, sockets)
+    begin
+      yield comm
+    ensure
+      # a process still waiting for this one sees it quit
+      comm.close
+      failed = pids.count {|pid| !Process.wait2(pid)[1].success? }
+      if failed > 0 && !$! then
+        raise "\n#{failed} of the processes failed!\n" end
+    end
+  end
+
+  # keeps the sockets to every other process and closes the rest
+  def initialize(rank, size, sockets)
+    @rank, @size = rank, size
+    @peers = sockets[rank]
+    # the other processes' ends as well: once a process quits, the ones
+    # waiting for it must see its sockets close
+    sockets.each_with_index do |row, a|
+      next if a == rank
+      row.each {|s| s.close if s && !s.closed? }
+    end
+  end
+
+  def close
+    @peers.each {|s| s.close if s && !s.closed? }
+  end
+
+  # sends strings[r] to every process r, returns what every process sent
+  # here. Every message is written by a thread of its own, so that large
+  # messages cannot block both ends of a socket.
+  def alltoall(strings)
+    writers = (0...@size).collect do |r|
+      next if r == @rank
+      Thread.new { send_to(r, strings[r]) }
+    end
+    received = (0...@size).collect do |r|
+      r == @rank ? strings[r].dup : receive_from(r)
+    end
+    writers.each {|w| w.join if w }
+    received
+  end
+
+  def allgather(str)
+    alltoall(Array.new(@size, str))
+  end
+
+  # the strings of every process on rank 0, nil elsewhere
+  def gather(str)
+    if @rank != 0 then
+      send_to(0, str)
+      return nil
+    end
+    (0...@size).collect {|r| r == 0 ? str.dup : receive_from(r) }
+  end
+
+  # the element-wise sum of packed doubles over every process
+  def allreduce(str)
+    Domain.sum(allgather(str))
+  end
+
+  def barrier
+    allgather('')
+    self
+  end
+
+  private
+
+  def send_to(r, str)
+    @peers[r].write([str.bytesize].pack('Q'), str)
+  end
+
+  def receive_from(r)
+    head = @peers[r].read(8)
+    raise "\nProcess #{r} has quit!\n" if head.nil? || head.size < 8
+    size = head.unpack('Q')[0]
+    str = size > 0 ? @peers[r].read(size) : ''
+    raise "\nProcess #{r} has quit!\n" if str.nil? || str.size < size
+    str
+  end
+end
+
+=begin
+The NBody of one process of a distributed run. Process r of p loads
+only the bodies [r*n/p, (r+1)*n/p) of the n in the input (see
+THDHandler#load), tags them with their indices there, and moves them to
+their domains before the first force pass; no process ever holds the
+whole system. Every force pass then
+
+- sends the bodies that have left the domain to their new owners, and
+  redraws the domains first when the work of the processes has drifted
+  apart by more than imbalance,
+- builds a tree of the local bodies only and exports to every other
+  process the part of it that process needs (TreeNode#essential),
+- walks a tree of the local bodies and the imported ghosts for the
+  forces on the local bodies, and drops the ghosts again.
+
+Only the leapfrog integrator with the tree solver is distributed, and
+only with monopole cells: the essential tree goes out as point masses,
+so the quadrupoles of the remote cells would be lost. The
+diagnostics are summed over every process. The positions of a
+trajectory frame are gathered on rank 0 and go straight into the
+trajectory writer in the order of their tags. For the final snapshot
+every body goes back to the process that loaded it, and each process
+writes the rows of its slice into the file (THDHandler#write_snapshot).
+Stats are those of each process.
+=end
+class DistributedNBody < NBody
+  # the time spent in migrating bodies, drawing domains and exchanging
+  # ghosts is kept in the phase 'domain'
+  PHASES = NBody::PHASES + ['domain']
+
+  attr_reader :comm, :rebalances, :first, :total
+  attr_accessor :imbalance
+
+  # integrates slice, the bodies [first, first + slice.size) of the
+  # total in the system at time, this process's share of them; the
+  # store is taken over, not copied
+  def initialize(comm, slice, time, first, total)
+    @comm = comm
+    n, p, r = total, comm.size, comm.rank
+    if first != r*n/p || slice.size != (r + 1)*n/p - first then
+      raise "\nProcess #{r} of #{p} loads the bodies #{r*n/p} to " +
+            "#{(r + 1)*n/p} of #{n}!\n" end
+    Domain.take(slice, first)
+    super(nil, [], slice)
+    @time = time
+    @first, @total = first, total
+    @imbalance = 1.2
+    @rebalances = 0
+  end
+
+  def evolve(integrator, tol)
+    unless integrator == 'leapfrog' && @solver == 'tree' &&
+           @multipole_order != 2 && !@subsystem_names && !@checkpoint &&
+           !@rebuild_threshold
+      raise "\nA distributed run only integrates with leapfrog and the " +
+            "monopole tree solver!\n" end
+    super
+  end
+
+  # the force errors need every body in one place
+  def force_error(tol)
+    raise "\nThe force error is not measured in a distributed run!\n"
+  end
+  alias mixed_precision_error force_error
+
+  def reset_stats
+    super
+    @stats['domain'] = 0.0
+  end
+
+  def stats
+    super.merge('rank' => @comm.rank, 'particles' => @particles.size,
+                'rebalances' => @rebalances)
+  end
+
+  # the diagnostics of NBody, summed over every process
+  def diagnostics(fresh=false)
+    potentials unless fresh
+    local = [@particles.kinetic_energy, @particles.potential_energy] +
+            @particles.momentum.to_a + @particles.angular_momentum.to_a +
+            Domain.moments(@particles).unpack('d6')[1, 4]
+    kin, pot, px, py, pz, lx, ly, lz, m, mx, my, mz =
+      @comm.allreduce(local.pack('d*')).unpack('d*')
+    { 'time' => @time, 'step' => @step, 'kinetic' => kin,
+      'potential' => pot, 'energy' => kin + pot,
+      'momentum' => [px, py, pz], 'angular_momentum' => [lx, ly, lz],
+      'center_of_mass' => [mx/m, my/m, mz/m] }
+  end
+
+  # a new store of the bodies this process loaded, wherever they are
+  # now, in the order they were loaded (for THDHandler#write_snapshot)
+  def home
+    count = (@comm.rank + 1)*@total/@comm.size - @first
+    records = @comm.alltoall(Domain.export_home(@particles, @total,
+                                                @comm.size))
+    Domain.import_home(Particles.new([count, 1].max), records, @first, count)
+  end
+
+  # rank 0 writes the frame of every process
+  def write_data
+    frames = @comm.gather(Domain.frame(@particles, @output_velocities))
+    output.write_tagged(frames, @total, @time) if frames
+  end
+
+  # (also outside of evolve, as in domain/tests/compare.rb)
+  def get_tree_acc(tol, active=false)
+    if @multipole_order == 2 then
+      raise "\nA distributed run only walks monopole cells!\n" end
+    timed('domain') { migrate }
+    local = @particles.size
+    if local > 0 then
+      timed('tree_build') do
+        (@let_tree ||= TreeNode.new).build(@particles) end
+      timed('center_of_mass') { @let_tree.center_of_mass }
+    end
+    timed('domain') do
+      boxes = @comm.allgather(Domain.bounds(@particles))
+      essential = boxes.each_with_index.collect do |box, r|
+        lo, hi = box.unpack('d6').each_slice(3).to_a
+        if r == @comm.rank || local == 0 || lo[0] > hi[0] then ''
+        else @let_tree.essential(lo, hi, tol) end
+      end
+      Domain.add_ghosts(@particles, @comm.alltoall(essential))
+    end
+    super(tol, true) if local > 0
+    timed('domain') { Domain.truncate(@particles, local) }
+  end
+
+  private
+
+  # moves every body to the process of its domain, after redrawing the
+  # domains if there are none yet or the work is out of balance
+  def migrate
+    work = @comm.allgather([Domain.moments(@particles).unpack('d6')[5]].
+                           pack('d')).collect {|w| w.unpack('d')[0] }
+    mean = work.inject(0.0) {|sum, w| sum + w }/work.size
+    decompose if @splitters.nil? || work.max > @imbalance*mean
+    out = Domain.export(@particles, @center, @size, Domain::LEVEL,
+                        @splitters, @comm.rank)
+    Domain.import(@particles, @comm.alltoall(out))
+  end
+
+  # cuts the Morton curve through the cube holding every body into a
+  # range of equal work for every process
+  def decompose
+    boxes = @comm.allgather(Domain.bounds(@particles)).collect do |box|
+      box.unpack('d6') end
+    lo = (0..2).collect {|k| boxes.collect {|b| b[k] }.min }
+    hi = (0..2).collect {|k| boxes.collect {|b| b[k + 3] }.max }
+    @center = (0..2).collect {|k| 0.5*(lo[k] + hi[k]) }
+    @size = (0..2).collect {|k| 0.5*(hi[k] - lo[k]) }.max*1.0001 + 1e-300
+    hist = @comm.allreduce(Domain.histogram(@particles, @center, @size,
+                                            Domain::LEVEL))
+    @splitters = Domain.splitters(hist, @comm.size)
+    @rebalances += 1
+  end
+end
@@ -0,0 +1,659 @@
+/* domain.c -> the domain decomposition behind DistributedNBody
+
+   Every process of a distributed run holds the particles of one range
+   of the Morton curve (see morton.h) through the cube of the whole
+   system. The curve is cut into 8^level buckets, and the splitters
+   give every process a run of buckets of about the same total work:
+   the interactions every particle had in the last tree walk (the work
+   column of the store, see c_tree/tree.c), or 1 for a particle that
+   has not been walked yet.
+
+   Particles move between processes as records of RECORD doubles:
+   tag m x y z vx vy vz ax ay az work. The tag is the global id of a
+   particle, its index in the input the run was loaded from. Process r
+   of p loads the tags [r*n/p, (r+1)*n/p) of the n there are, and is
+   their home: for the final snapshot they are sent back there, so that
+   every process writes the rows it loaded. Within a process, handles
+   are renumbered 0..n-1 whenever particles leave.
+
+   The ghosts of a step are the parts of the other processes' trees the
+   local particles need (TreeNode#essential); they are appended to the
+   store as pseudo-particles with tag -1, the active set is made the
+   local particles for the walk, and truncate drops them again.
+
+   Everything here works on packed Strings, so the same code serves the
+   forked processes of ForkCommunicator (distributed.rb) and, when the
+   extension is built against MPI, the MPICommunicator below. */
+
+#include "stdio.h"
+#include "math.h"
+#include "ruby.h"
+#include "particles.h"
+#include "morton.h"
+#ifdef HAVE_MPI_H
+#include "mpi.h"
+#endif
+
+#define RECORD 12
+#define GHOST 4
+#define DEFAULT_LEVEL 6
+
+VALUE mDomain;
+
+/* UTILITY METHODS -------------------------- */
+static void get_point(VALUE array, double *p) {
+  int k;
+  Check_Type(array, T_ARRAY);
+  for(k = 0; k < 3; k++) {
+    p[k] = NUM2DBL(rb_ary_entry(array, k));
+  }
+}
+
+/* the bucket of row i: the top 3*level bits of its Morton key */
+static long bucket_of(const Particles *s, long i, const double *center,
+                      double size, int level) {
+  return (long)(morton_key(s->x[i], s->y[i], s->z[i], center, size) >>
+                3*(MORTON_BITS - level));
+}
+
+static int get_level(VALUE level) {
+  int l = NUM2INT(level);
+  if (l < 1 || l > 8)
+    rb_raise(rb_eArgError, "ERROR: bucket level %d out of range", l);
+  return l;
+}
+
+/* appends a record to a store, returns its row */
+static long push_record(Particles *s, const double *r) {
+  long i = particles_push(s, r[1], r[2], r[3], r[4], r[5], r[6], r[7]);
+  s->ax[i] = r[8]; s->ay[i] = r[9]; s->az[i] = r[10];
+  s->tag[i] = (long)r[0];
+  s->work[i] = r[11];
+  return i;
+}
+
+static void pack_record(const Particles *s, long i, double *r) {
+  r[0] = (double)s->tag[i];
+  r[1] = s->mass[i];
+  r[2] = s->x[i]; r[3] = s->y[i]; r[4] = s->z[i];
+  r[5] = s->vx[i]; r[6] = s->vy[i]; r[7] = s->vz[i];
+  r[8] = s->ax[i]; r[9] = s->ay[i]; r[10] = s->az[i];
+  r[11] = s->work[i];
+}
+
+/* keeps the rows with keep[row] set, in their order, and renumbers the
+   handles of the store to follow the rows. The active set is emptied. */
+static void compact(Particles *s, const char *keep) {
+  long i, n = 0;
+  for(i = 0; i < s->n; i++) {
+    if (!keep[i]) continue;
+    if (n != i) {
+      s->x[n] = s->x[i]; s->y[n] = s->y[i]; s->z[n] = s->z[i];
+      s->vx[n] = s->vx[i]; s->vy[n] = s->vy[i]; s->vz[n] = s->vz[i];
+      s->ax[n] = s->ax[i]; s->ay[n] = s->ay[i]; s->az[n] = s->az[i];
+      s->mass[n] = s->mass[i];
+      s->tag[n] = s->tag[i];
+      s->work[n] = s->work[i];
+      if (s->dt != NULL) {
+        s->dt[n] = s->dt[i];
+        s->ox[n] = s->ox[i]; s->oy[n] = s->oy[i]; s->oz[n] = s->oz[i];
+      }
+      if (s->jx != NULL) {
+        s->jx[n] = s->jx[i]; s->jy[n] = s->jy[i]; s->jz[n] = s->jz[i];
+      }
+      if (s->pot != NULL) s->pot[n] = s->pot[i];
+    }
+    n++;
+  }
+  for(i = 0; i < n; i++) {
+    s->id[i] = s->where[i] = i;
+  }
+  s->n = n;
+  s->nactive = 0;
+}
+
+static Particles *domain_store(VALUE store) {
+  Particles *s; GET_STORE(store, s);
+  particles_own(s);
+  particles_domain(s);
+  return s;
+}
+
+/* DOMAIN METHODS --------------------------- */
+
+/* makes a store of the particles [first, first + n) of the input the
+   store of a process: its columns move out of a snapshot mapping, and
+   every particle is tagged with first plus its handle */
+static VALUE domain_take(VALUE self, VALUE store, VALUE rb_first) {
+  Particles *s = domain_store(store);
+  long h, first = NUM2LONG(rb_first);
+  if (first < 0)
+    rb_raise(rb_eIndexError, "ERROR: particles from %ld on", first);
+  for(h = 0; h < s->n; h++) {
+    s->tag[s->where[h]] = first + h;
+    s->work[s->where[h]] = 0.0;
+  }
+  return store;
+}
+
+/* n, mass, m x, m y, m z and the total work of the store, as packed
+   doubles ready to be summed over the processes */
+static VALUE domain_moments(VALUE self, VALUE store) {
+  Particles *s; GET_STORE(store, s);
+  double sums[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+  long i;
+  sums[0] = (double)s->n;
+  for(i = 0; i < s->n; i++) {
+    sums[1] += s->mass[i];
+    sums[2] += s->mass[i]*s->x[i];
+    sums[3] += s->mass[i]*s->y[i];
+    sums[4] += s->mass[i]*s->z[i];
+    if (s->work != NULL) sums[5] += s->work[i];
+  }
+  return rb_str_new((const char *)sums, sizeof(sums));
+}
+
+/* the smallest box [lo, hi] holding every particle of the store, as
+   packed doubles lo hi; an empty store gives an inverted box */
+static VALUE domain_bounds(VALUE self, VALUE store) {
+  Particles *s; GET_STORE(store, s);
+  double box[6] = {HUGE_VAL, HUGE_VAL, HUGE_VAL,
+                   -HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+  long i;
+  for(i = 0; i < s->n; i++) {
+    if (s->x[i] < box[0]) box[0] = s->x[i];
+    if (s->y[i] < box[1]) box[1] = s->y[i];
+    if (s->z[i] < box[2]) box[2] = s->z[i];
+    if (s->x[i] > box[3]) box[3] = s->x[i];
+    if (s->y[i] > box[4]) box[4] = s->y[i];
+    if (s->z[i] > box[5]) box[5] = s->z[i];
+  }
+  return rb_str_new((const char *)box, sizeof(box));
+}
+
+/* the work of the store's particles in each of the 8^level buckets of
+   the cube centred on center with half-side size, as packed doubles */
+static VALUE domain_histogram(VALUE self, VALUE store, VALUE rb_center,
+                              VALUE rb_size, VALUE rb_level) {
+  Particles *s; GET_STORE(store, s);
+  int level = get_level(rb_level);
+  long i, buckets = 1L << 3*level;
+  double center[3], size = NUM2DBL(rb_size), *hist;
+  VALUE str = rb_str_new(NULL, buckets*sizeof(double));
+  get_point(rb_center, center);
+  hist = (double *)RSTRING_PTR(str);
+  memset(hist, 0, buckets*sizeof(double));
+  for(i = 0; i < s->n; i++) {
+    double w = (s->work != NULL && s->work[i] > 0.0) ? s->work[i] : 1.0;
+    hist[bucket_of(s, i, center, size, level)] += w;
+  }
+  return str;
+}
+
+/* cuts the buckets of a histogram into nprocs runs of about the same
+   work: process r gets the buckets [splitters[r], splitters[r+1]) */
+static VALUE domain_splitters(VALUE self, VALUE rb_hist, VALUE rb_nprocs) {
+  const double *hist;
+  double total = 0.0, sum = 0.0;
+  long b, buckets;
+  int r = 1, nprocs = NUM2INT(rb_nprocs);
+  VALUE splitters;
+  StringValue(rb_hist);
+  hist = (const double *)RSTRING_PTR(rb_hist);
+  buckets = RSTRING_LEN(rb_hist)/sizeof(double);
+  if (nprocs < 1)
+    rb_raise(rb_eArgError, "ERROR: %d processes", nprocs);
+  for(b = 0; b < buckets; b++) {
+    total += hist[b];
+  }
+  splitters = rb_ary_new2(nprocs + 1);
+  rb_ary_push(splitters, LONG2NUM(0));
+  for(b = 0; b < buckets && r < nprocs; b++) {
+    /* a bucket goes to the process that holds its larger part */
+    while (r < nprocs && sum + 0.5*hist[b] >= r*total/nprocs) {
+      rb_ary_push(splitters, LONG2NUM(b));
+      r++;
+    }
+    sum += hist[b];
+  }
+  for(; r <= nprocs; r++) {
+    rb_ary_push(splitters, LONG2NUM(buckets));
+  }
+  return splitters;
+}
+
+/* takes the particles that belong to other processes out of the store:
+   returns the records for every process (an empty String for rank) */
+static VALUE domain_export(VALUE self, VALUE store, VALUE rb_center,
+                           VALUE rb_size, VALUE rb_level, VALUE splitters,
+                           VALUE rb_rank) {
+  Particles *s = domain_store(store);
+  int level = get_level(rb_level), rank = NUM2INT(rb_rank), nprocs, r;
+  double center[3], size = NUM2DBL(rb_size);
+  long i, *cut;
+  char *keep;
+  VALUE out;
+  get_point(rb_center, center);
+  Check_Type(splitters, T_ARRAY);
+  nprocs = (int)RARRAY_LEN(splitters) - 1;
+  if (rank < 0 || rank >= nprocs)
+    rb_raise(rb_eArgError, "ERROR: rank %d of %d processes", rank, nprocs);
+  cut = ALLOCA_N(long, nprocs + 1);
+  for(r = 0; r <= nprocs; r++) {
+    cut[r] = NUM2LONG(rb_ary_entry(splitters, r));
+  }
+  out = rb_ary_new2(nprocs);
+  for(r = 0; r < nprocs; r++) {
+    rb_ary_push(out, rb_str_new(NULL, 0));
+  }
+  keep = ALLOC_N(char, s->n > 0 ? s->n : 1);
+  for(i = 0; i < s->n; i++) {
+    long b = bucket_of(s, i, center, size, level);
+    double r_buf[RECORD];
+    int lo = 0, hi = nprocs;
+    /* the last process whose run starts at or before b */
+    while (hi - lo > 1) {
+      int mid = (lo + hi)/2;
+      if (cut[mid] <= b) lo = mid;
+      else hi = mid;
+    }
+    keep[i] = (lo == rank);
+    if (keep[i]) continue;
+    pack_record(s, i, r_buf);
+    rb_str_cat(rb_ary_entry(out, lo), (const char *)r_buf, sizeof(r_buf));
+  }
+  compact(s, keep);
+  xfree(keep);
+  return out;
+}
+
+/* appends the records of an array of Strings to the store */
+static VALUE domain_import(VALUE self, VALUE store, VALUE strings) {
+  Particles *s = domain_store(store);
+  long k, q;
+  Check_Type(strings, T_ARRAY);
+  for(k = 0; k < RARRAY_LEN(strings); k++) {
+    VALUE str = rb_ary_entry(strings, k);
+    const double *r;
+    long n;
+    StringValue(str);
+    r = (const double *)RSTRING_PTR(str);
+    n = RSTRING_LEN(str)/(RECORD*sizeof(double));
+    particles_reserve(s, s->n + n);
+    for(q = 0; q < n; q++) {
+      push_record(s, r + RECORD*q);
+    }
+  }
+  return store;
+}
+
+/* appends the x y z m of an array of Strings (TreeNode#essential) to the
+   store as ghosts, and makes the particles that were there before the
+   active set. Returns the number of ghosts. */
+static VALUE domain_add_ghosts(VALUE self, VALUE store, VALUE strings) {
+  Particles *s = domain_store(store);
+  long k, q, h, local = s->n;
+  Check_Type(strings, T_ARRAY);
+  for(k = 0; k < RARRAY_LEN(strings); k++) {
+    VALUE str = rb_ary_entry(strings, k);
+    const double *g;
+    long n;
+    StringValue(str);
+    g = (const double *)RSTRING_PTR(str);
+    n = RSTRING_LEN(str)/(GHOST*sizeof(double));
+    particles_reserve(s, s->n + n);
+    for(q = 0; q < n; q++) {
+      long i = particles_push(s, g[GHOST*q + 3], g[GHOST*q], g[GHOST*q + 1],
+                              g[GHOST*q + 2], 0.0, 0.0, 0.0);
+      s->tag[i] = -1;
+      s->work[i] = 0.0;
+    }
+  }
+  particles_steps(s);
+  for(h = 0; h < local; h++) {
+    s->active[h] = h;
+  }
+  s->nactive = local;
+  return LONG2NUM(s->n - local);
+}
+
+/* drops the ghosts again: every row whose handle is n or more */
+static VALUE domain_truncate(VALUE self, VALUE store, VALUE rb_n) {
+  Particles *s = domain_store(store);
+  long i, n = NUM2LONG(rb_n);
+  char *keep;
+  if (n >= s->n) return store;
+  keep = ALLOC_N(char, s->n);
+  for(i = 0; i < s->n; i++) {
+    keep[i] = (s->id[i] < n);
+  }
+  compact(s, keep);
+  xfree(keep);
+  return store;
+}
+
+/* tag x y z (vx vy vz) of every particle, packed for gather */
+static VALUE domain_frame(VALUE self, VALUE store, VALUE velocities) {
+  Particles *s = domain_store(store);
+  int columns = RTEST(velocities) ? 7 : 4;
+  long i;
+  VALUE str = rb_str_new(NULL, s->n*columns*sizeof(double));
+  double *f = (double *)RSTRING_PTR(str);
+  for(i = 0; i < s->n; i++, f += columns) {
+    f[0] = (double)s->tag[i];
+    f[1] = s->x[i]; f[2] = s->y[i]; f[3] = s->z[i];
+    if (columns == 7) {
+      f[4] = s->vx[i]; f[5] = s->vy[i]; f[6] = s->vz[i];
+    }
+  }
+  return str;
+}
+
+/* the process of nprocs that loaded tag, of total tags (see above) */
+static int home_of(long tag, long total, int nprocs) {
+  int r = (int)((double)tag*nprocs/total);
+  if (r >= nprocs) r = nprocs - 1;
+  while (r > 0 && r*total/nprocs > tag) r--;
+  while (r + 1 < nprocs && (r + 1)*total/nprocs <= tag) r++;
+  return r;
+}
+
+/* the records of every particle for the process that loaded it, one
+   String for every process; the store keeps its particles */
+static VALUE domain_export_home(VALUE self, VALUE store, VALUE rb_total,
+                                VALUE rb_nprocs) {
+  Particles *s = domain_store(store);
+  long i, total = NUM2LONG(rb_total);
+  int r, nprocs = NUM2INT(rb_nprocs);
+  VALUE out;
+  if (nprocs < 1)
+    rb_raise(rb_eArgError, "ERROR: %d processes", nprocs);
+  out = rb_ary_new2(nprocs);
+  for(r = 0; r < nprocs; r++) {
+    rb_ary_push(out, rb_str_new(NULL, 0));
+  }
+  for(i = 0; i < s->n; i++) {
+    double r_buf[RECORD];
+    if (s->tag[i] < 0) continue;
+    if (s->tag[i] >= total)
+      rb_raise(rb_eIndexError, "ERROR: particle %ld of %ld", s->tag[i],
+               total);
+    pack_record(s, i, r_buf);
+    rb_str_cat(rb_ary_entry(out, home_of(s->tag[i], total, nprocs)),
+               (const char *)r_buf, sizeof(r_buf));
+  }
+  return out;
+}
+
+/* appends the count particles with the tags [first, first + count) from
+   an array of Strings of records (export_home) to the store, in the
+   order of their tags; every one of them must be there once */
+static VALUE domain_import_home(VALUE self, VALUE store, VALUE strings,
+                                VALUE rb_first, VALUE rb_count) {
+  Particles *s = domain_store(store);
+  long k, q, h, first = NUM2LONG(rb_first), count = NUM2LONG(rb_count);
+  long base = s->n, found = 0;
+  char *seen;
+  Check_Type(strings, T_ARRAY);
+  particles_reserve(s, base + count);
+  for(h = 0; h < count; h++) {
+    long i = particles_push(s, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0);
+    s->tag[i] = first + h;
+    s->work[i] = 0.0;
+  }
+  seen = ALLOC_N(char, count > 0 ? count : 1);
+  memset(seen, 0, count);
+  for(k = 0; k < RARRAY_LEN(strings); k++) {
+    VALUE str = rb_ary_entry(strings, k);
+    const double *r;
+    long n;
+    StringValue(str);
+    r = (const double *)RSTRING_PTR(str);
+    n = RSTRING_LEN(str)/(RECORD*sizeof(double));
+    for(q = 0; q < n; q++, r += RECORD) {
+      long i, tag = (long)r[0] - first;
+      if (tag < 0 || tag >= count || seen[tag]) {
+        xfree(seen);
+        rb_raise(rb_eArgError, "ERROR: particle %ld is not at home once "
+                 "in %ld to %ld", (long)r[0], first, first + count);
+      }
+      seen[tag] = 1;
+      i = s->where[base + tag];
+      s->mass[i] = r[1];
+      s->x[i] = r[2]; s->y[i] = r[3]; s->z[i] = r[4];
+      s->vx[i] = r[5]; s->vy[i] = r[6]; s->vz[i] = r[7];
+      s->ax[i] = r[8]; s->ay[i] = r[9]; s->az[i] = r[10];
+      s->work[i] = r[11];
+    }
+    found += n;
+  }
+  xfree(seen);
+  if (found != count)
+    rb_raise(rb_eArgError, "ERROR: %ld of the %ld particles %ld to %ld came "
+             "home", found, count, first, first + count);
+  return store;
+}
+
+/* the element-wise sum of an array of packed doubles of equal length */
+static VALUE domain_sum(VALUE self, VALUE strings) {
+  long k, q, n;
+  double *sum;
+  VALUE str;
+  Check_Type(strings, T_ARRAY);
+  if (RARRAY_LEN(strings) == 0) return rb_str_new(NULL, 0);
+  str = rb_ary_entry(strings, 0);
+  str = rb_str_dup(StringValue(str));
+  n = RSTRING_LEN(str)/sizeof(double);
+  sum = (double *)RSTRING_PTR(str);
+  for(k = 1; k < RARRAY_LEN(strings); k++) {
+    VALUE other = rb_ary_entry(strings, k);
+    const double *o;
+    StringValue(other);
+    if (RSTRING_LEN(other) != RSTRING_LEN(str))
+      rb_raise(rb_eArgError, "ERROR: summing %ld bytes into %ld",
+               RSTRING_LEN(other), RSTRING_LEN(str));
+    o = (const double *)RSTRING_PTR(other);
+    for(q = 0; q < n; q++) {
+      sum[q] += o[q];
+    }
+  }
+  return str;
+}
+
+#ifdef HAVE_MPI_H
+/* MPI COMMUNICATOR ------------------------- */
+static VALUE cMPICommunicator;
+
+static void mpi_check(int err, const char *what) {
+  if (err != MPI_SUCCESS)
+    rb_raise(rb_eRuntimeError, "ERROR: %s failed", what);
+}
+
+static void mpi_finalize(VALUE unused) {
+  int done;
+  MPI_Finalized(&done);
+  if (!done) MPI_Finalize();
+}
+
+static VALUE mpi_initialize(VALUE self) {
+  int ready;
+  MPI_Initialized(&ready);
+  if (!ready) {
+    mpi_check(MPI_Init(NULL, NULL), "MPI_Init");
+    rb_set_end_proc(mpi_finalize, Qnil);
+  }
+  return self;
+}
+
+static VALUE mpi_rank(VALUE self) {
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  return INT2NUM(rank);
+}
+
+static VALUE mpi_size(VALUE self) {
+  int size;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  return INT2NUM(size);
+}
+
+static VALUE mpi_barrier(VALUE self) {
+  mpi_check(MPI_Barrier(MPI_COMM_WORLD), "MPI_Barrier");
+  return self;
+}
+
+/* sends strings[r] to every process r, returns what every process sent
+   here */
+static VALUE mpi_alltoall(VALUE self, VALUE strings) {
+  int size, r, *sendcounts, *sdispls, *recvcounts, *rdispls;
+  long stotal = 0, rtotal = 0;
+  char *sendbuf, *recvbuf;
+  VALUE out;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  Check_Type(strings, T_ARRAY);
+  if (RARRAY_LEN(strings) != size)
+    rb_raise(rb_eArgError, "ERROR: %ld strings for %d processes",
+             RARRAY_LEN(strings), size);
+  sendcounts = ALLOCA_N(int, size); sdispls = ALLOCA_N(int, size);
+  recvcounts = ALLOCA_N(int, size); rdispls = ALLOCA_N(int, size);
+  for(r = 0; r < size; r++) {
+    VALUE str = rb_ary_entry(strings, r);
+    StringValue(str);
+    sendcounts[r] = (int)RSTRING_LEN(str);
+    sdispls[r] = (int)stotal;
+    stotal += sendcounts[r];
+  }
+  mpi_check(MPI_Alltoall(sendcounts, 1, MPI_INT, recvcounts, 1, MPI_INT,
+                         MPI_COMM_WORLD), "MPI_Alltoall");
+  for(r = 0; r < size; r++) {
+    rdispls[r] = (int)rtotal;
+    rtotal += recvcounts[r];
+  }
+  sendbuf = ALLOC_N(char, stotal > 0 ? stotal : 1);
+  recvbuf = ALLOC_N(char, rtotal > 0 ? rtotal : 1);
+  for(r = 0; r < size; r++) {
+    memcpy(sendbuf + sdispls[r], RSTRING_PTR(rb_ary_entry(strings, r)),
+           sendcounts[r]);
+  }
+  if (MPI_Alltoallv(sendbuf, sendcounts, sdispls, MPI_BYTE, recvbuf,
+                    recvcounts, rdispls, MPI_BYTE,
+                    MPI_COMM_WORLD) != MPI_SUCCESS) {
+    xfree(sendbuf); xfree(recvbuf);
+    rb_raise(rb_eRuntimeError, "ERROR: MPI_Alltoallv failed");
+  }
+  out = rb_ary_new2(size);
+  for(r = 0; r < size; r++) {
+    rb_ary_push(out, rb_str_new(recvbuf + rdispls[r], recvcounts[r]));
+  }
+  xfree(sendbuf); xfree(recvbuf);
+  return out;
+}
+
+/* the string of every process, on every process */
+static VALUE mpi_allgather(VALUE self, VALUE str) {
+  int size, r, len, *counts, *displs;
+  long total = 0;
+  char *buf;
+  VALUE out;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  StringValue(str);
+  len = (int)RSTRING_LEN(str);
+  counts = ALLOCA_N(int, size); displs = ALLOCA_N(int, size);
+  mpi_check(MPI_Allgather(&len, 1, MPI_INT, counts, 1, MPI_INT,
+                          MPI_COMM_WORLD), "MPI_Allgather");
+  for(r = 0; r < size; r++) {
+    displs[r] = (int)total;
+    total += counts[r];
+  }
+  buf = ALLOC_N(char, total > 0 ? total : 1);
+  if (MPI_Allgatherv(RSTRING_PTR(str), len, MPI_BYTE, buf, counts, displs,
+                     MPI_BYTE, MPI_COMM_WORLD) != MPI_SUCCESS) {
+    xfree(buf);
+    rb_raise(rb_eRuntimeError, "ERROR: MPI_Allgatherv failed");
+  }
+  out = rb_ary_new2(size);
+  for(r = 0; r < size; r++) {
+    rb_ary_push(out, rb_str_new(buf + displs[r], counts[r]));
+  }
+  xfree(buf);
+  return out;
+}
+
+/* the string of every process on rank 0, nil elsewhere */
+static VALUE mpi_gather(VALUE self, VALUE str) {
+  int size, rank, r, len, *counts = NULL, *displs = NULL;
+  long total = 0;
+  char *buf = NULL;
+  VALUE out = Qnil;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  StringValue(str);
+  len = (int)RSTRING_LEN(str);
+  if (rank == 0) {
+    counts = ALLOCA_N(int, size);
+    displs = ALLOCA_N(int, size);
+  }
+  mpi_check(MPI_Gather(&len, 1, MPI_INT, counts, 1, MPI_INT, 0,
+                       MPI_COMM_WORLD), "MPI_Gather");
+  if (rank == 0) {
+    for(r = 0; r < size; r++) {
+      displs[r] = (int)total;
+      total += counts[r];
+    }
+    buf = ALLOC_N(char, total > 0 ? total : 1);
+  }
+  if (MPI_Gatherv(RSTRING_PTR(str), len, MPI_BYTE, buf, counts, displs,
+                  MPI_BYTE, 0, MPI_COMM_WORLD) != MPI_SUCCESS) {
+    if (buf != NULL) xfree(buf);
+    rb_raise(rb_eRuntimeError, "ERROR: MPI_Gatherv failed");
+  }
+  if (rank == 0) {
+    out = rb_ary_new2(size);
+    for(r = 0; r < size; r++) {
+      rb_ary_push(out, rb_str_new(buf + displs[r], counts[r]));
+    }
+    xfree(buf);
+  }
+  return out;
+}
+
+/* the element-wise sum of packed doubles over every process */
+static VALUE mpi_allreduce(VALUE self, VALUE str) {
+  VALUE out;
+  StringValue(str);
+  out = rb_str_new(NULL, RSTRING_LEN(str));
+  mpi_check(MPI_Allreduce(RSTRING_PTR(str), RSTRING_PTR(out),
+                          (int)(RSTRING_LEN(str)/sizeof(double)), MPI_DOUBLE,
+                          MPI_SUM, MPI_COMM_WORLD), "MPI_Allreduce");
+  return out;
+}
+#endif
+
+void Init_domain() {
+  mDomain = rb_define_module("Domain");
+  rb_define_const(mDomain, "LEVEL", INT2NUM(DEFAULT_LEVEL));
+  rb_define_module_function(mDomain, "take", domain_take, 2);
+  rb_define_module_function(mDomain, "moments", domain_moments, 1);
+  rb_define_module_function(mDomain, "bounds", domain_bounds, 1);
+  rb_define_module_function(mDomain, "histogram", domain_histogram, 4);
+  rb_define_module_function(mDomain, "splitters", domain_splitters, 2);
+  rb_define_module_function(mDomain, "export", domain_export, 6);
+  rb_define_module_function(mDomain, "import", domain_import, 2);
+  rb_define_module_function(mDomain, "add_ghosts", domain_add_ghosts, 2);
+  rb_define_module_function(mDomain, "truncate", domain_truncate, 2);
+  rb_define_module_function(mDomain, "frame", domain_frame, 2);
+  rb_define_module_function(mDomain, "export_home", domain_export_home, 3);
+  rb_define_module_function(mDomain, "import_home", domain_import_home, 4);
+  rb_define_module_function(mDomain, "sum", domain_sum, 1);
+#ifdef HAVE_MPI_H
+  cMPICommunicator = rb_define_class("MPICommunicator", rb_cObject);
+  rb_define_method(cMPICommunicator, "initialize", mpi_initialize, 0);
+  rb_define_method(cMPICommunicator, "rank", mpi_rank, 0);
+  rb_define_method(cMPICommunicator, "size", mpi_size, 0);
+  rb_define_method(cMPICommunicator, "barrier", mpi_barrier, 0);
+  rb_define_method(cMPICommunicator, "alltoall", mpi_alltoall, 1);
+  rb_define_method(cMPICommunicator, "allgather", mpi_allgather, 1);
+  rb_define_method(cMPICommunicator, "gather", mpi_gather, 1);
+  rb_define_method(cMPICommunicator, "allreduce", mpi_allreduce, 1);
+#endif
+}
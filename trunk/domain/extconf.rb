@@ -0,0 +1,8 @@
+require 'mkmf'
+$CPPFLAGS << ' -I../include'
+$CFLAGS << ' -O3'
+# MPICommunicator is only built when an MPI library is found; without
+# one, distributed runs use forked processes (see distributed.rb)
+pkg_config('ompi-c') || pkg_config('mpich') || pkg_config('mpi')
+have_header('mpi.h') && have_library('mpi', 'MPI_Init')
+create_makefile('domain')
@@ -0,0 +1,64 @@
+# the forces of a distributed tree walk against the walk of a single
+# process and against direct summation, and how the work ends up split:
+#   ruby -I. domain/tests/compare.rb system.thd processes [tol] [eps] [order]
+# order is the multipole order of the cells; a distributed walk refuses
+# quadrupoles, whose remote cells it could only export as point masses
+# with 0 processes it runs in every process of an MPI job instead:
+#   mpirun -np 3 ruby -I. domain/tests/compare.rb system.thd 0
+require 'c_tree/tree'
+require 'vector/vector'
+require 'pairwise/pairwise'
+require 'particles/particles'
+require 'body.rb'
+require 'thd/thd_handler.rb'
+require 'distributed.rb'
+
+file, processes = ARGV[0], ARGV[1].to_i
+tol, eps = (ARGV[2] || 0.5).to_f, (ARGV[3] || 0.01).to_f
+order = (ARGV[4] || 1).to_i
+thd = THDHandler.new
+thd.load(file)
+nbody = thd.create_bodies
+nbody.set_parameters(0.01, 0, 1, 1, eps, false, true, 1, false, order)
+nbody.tol = tol
+store = nbody.particles
+SpeedUp.all_accelerations(store, eps)
+exact = (0...store.size).collect {|h| store.acc(h) }
+nbody.compute_acc
+single = (0...store.size).collect {|h| store.acc(h) }
+store.clear_acc
+
+# [median, maximum] of the relative differences of a from b
+def errors(a, b)
+  e = (0...a.size).collect {|i| (a[i] - b[i]).mag/b[i].mag }.sort
+  [e[e.size/2], e.last]
+end
+
+run = Proc.new do |comm|
+  slice = THDHandler.new
+  slice.load(file, comm.rank, comm.size)
+  part = DistributedNBody.new(comm, slice.particles, slice.time, slice.first,
+                              slice.total)
+  part.set_parameters(0.01, 0, 1, 1, eps, false, true, 1, false, order)
+  part.tol = tol
+  part.compute_acc
+  local = part.particles
+  tags = Domain.frame(local, false).unpack('d*').each_slice(4).collect {|f|
+    f[0].to_i }
+  accs = (0...local.size).collect {|h| local.acc(h).to_a }
+  work = Domain.moments(local).unpack('d6')[5]
+  frames = comm.gather(Marshal.dump([tags, accs, work]))
+  if frames then
+    distributed = Array.new(store.size)
+    frames.each_with_index do |frame, rank|
+      tags, accs, work = Marshal.load(frame)
+      printf("rank %d: %d bodies, work %d\n", rank, tags.size, work)
+      tags.each_with_index {|tag, k| distributed[tag] = accs[k].to_v }
+    end
+    puts "single against direct:      #{errors(single, exact).join(' ')}"
+    puts "distributed against direct: #{errors(distributed, exact).join(' ')}"
+    puts "distributed against single: #{errors(distributed, single).join(' ')}"
+  end
+end
+if processes > 0 then ForkCommunicator.run(processes, &run)
+else run.call(MPICommunicator.new) end
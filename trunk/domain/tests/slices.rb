@@ -0,0 +1,49 @@
+# every process of a distributed run loads only its slice of the input,
+# and the snapshot the processes write together holds every body of it,
+# from a .thd file and from a binary snapshot:
+#   ruby -I. domain/tests/slices.rb [system.thd] [processes]
+require 'c_tree/tree'
+require 'vector/vector'
+require 'pairwise/pairwise'
+require 'particles/particles'
+require 'body.rb'
+require 'thd/thd_handler.rb'
+require 'distributed.rb'
+
+file, processes = ARGV[0] || 'thd/sample/256.thd', (ARGV[1] || 3).to_i
+base = "/tmp/tara_slices_test.#{$$}"
+
+# id, type, family tree, mass, position and velocity of every body
+def bodies(file)
+  thd = THDHandler.new
+  thd.load(file)
+  thd.create_bodies.list.collect do |b|
+    [b.id.to_i, b.type, b.belongs_to, b.mass] + b.pos.to_a + b.vel.to_a
+  end
+end
+
+whole = THDHandler.new
+whole.load(file)
+whole.write_snapshot("#{base}.snap", whole.create_bodies)
+expected = bodies(file)
+
+failed = 0
+[file, "#{base}.snap"].each do |input|
+  ForkCommunicator.run(processes) do |comm|
+    thd = THDHandler.new
+    thd.load(input, comm.rank, comm.size)
+    part = DistributedNBody.new(comm, thd.particles, thd.time, thd.first,
+                                thd.total)
+    # a force pass moves the bodies to their domains
+    part.set_parameters(0.01, 0, 1, 1, 0.01, false, true)
+    part.tol = 0.5
+    part.compute_acc
+    thd.write_snapshot("#{base}.out", part)
+  end
+  differ = expected.zip(bodies("#{base}.out")).count {|a, b| a != b }
+  printf("%s: %d of %d bodies differ\n", File.basename(input), differ,
+         expected.size)
+  failed += 1 if differ > 0
+end
+Dir.glob("#{base}.*").each {|f| File.delete(f) }
+puts failed == 0 ? 'OK' : 'FAILED'
@@ -0,0 +1,590 @@
+/* kernel.h -> the vectorized particle-particle gravity kernels shared by
+               the direct-summation and tree extensions
+
+   The kernels are written once against the lane macros of simd.h.
+   Pairs at zero separation (a particle and itself, or coincident
+   particles) contribute nothing.
+
+   The particle kernels come in a variant for every softening of the
+   store (SOFTENING_* in particles.h), with and without potentials. A
+   force pass picks its variants once with kernel_select and calls them
+   through the Kernel it filled in, so no loop ever tests the softening
+   or whether potentials are wanted:
+
+     none      m/r^3 and m/r, also used for any softening with eps = 0
+     plummer   m/(r^2 + eps^2)^3/2 and m/(r^2 + eps^2)^1/2
+     spline    the cubic spline kernel of Monaghan & Lattanzio, with
+               support h = 2.8 eps. Beyond h the force is exactly
+               Newtonian; at r = 0 the potential is -m/eps, as with
+               Plummer softening of the same eps.
+
+   The tree's cells (kernel_gather_quad, kernel_gather_far32) are
+   softened only in the Plummer way, and taken as Newtonian point masses
+   otherwise. The FMM's expansions (M2L, L2P in fmm.c) are always
+   Newtonian; only its direct sums between leaves are softened. */
+
+#ifndef TARA_KERNEL_H
+#define TARA_KERNEL_H
+
+#include "math.h"
+#include "particles.h"
+#include "simd.h"
+
+#if defined(__GNUC__)
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+#else
+#define KERNEL_INLINE static inline
+#endif
+
+#define SPLINE_SUPPORT 2.8
+
+typedef struct Kernel Kernel;
+
+#define KERNEL_GATHER_ARGS const Kernel *k, double xi, double yi, \
+  double zi, const double *x, const double *y, const double *z, \
+  const double *m, long n, double *ax, double *ay, double *az, double *pot
+#define KERNEL_MUTUAL_ARGS const Kernel *k, Particles *s, long i, long j0, \
+  long j1
+#define KERNEL_JERK_ARGS const Kernel *k, const double *pi, \
+  const double *vi, const double *x, const double *y, const double *z, \
+  const double *vx, const double *vy, const double *vz, const double *m, \
+  long n, double *a, double *jerk
+
+/* the kernels of one force pass (see kernel_select):
+
+   gather   one-sided sum: the acceleration at (xi, yi, zi) due to the n
+            sources in x, y, z, m is added to *ax, *ay, *az, and in the
+            potential variant -m/r of every source to *pot
+   mutual   sum over the pairs (i, j) with j in [j0, j1): particle i
+            receives the pull of every j, and by Newton's third law
+            every j the opposite pull of i; the potential variant sums
+            the potential of both sides into s->pot. i must not lie in
+            [j0, j1).
+   jerk     one-sided sum of acceleration and jerk: the particle at pi
+            moving with vi feels a = m f(r) d and
+            j = m (f(r) w + f'(r)/r (d.w) d) from every source, with d
+            and w its position and velocity relative to the particle */
+struct Kernel {
+  int softening;    /* SOFTENING_*, SOFTENING_NONE whenever eps is 0 */
+  double eps2;      /* eps^2 with Plummer softening, else 0 */
+  double hinv;      /* 1/h of the spline */
+  void (*gather)(KERNEL_GATHER_ARGS);
+  void (*mutual)(KERNEL_MUTUAL_ARGS);
+  void (*jerk)(KERNEL_JERK_ARGS);
+};
+
+/* is the force pass asked to leave the potentials in s->pot? */
+static inline int kernel_potential(const Particles *s) {
+  return s->potential != POTENTIAL_NONE && s->pot != NULL;
+}
+
+/* ... and to leave the accelerations as they were? */
+static inline int kernel_potential_only(const Particles *s) {
+  return s->potential == POTENTIAL_ONLY && s->pot != NULL;
+}
+
+/* SOFTENING --------------------------------------- */
+
+/* the softened 1/r^3 of the lanes of r2 into *f and, with potential,
+   their softened 1/r into *p; both are zero where r2 is. kind and
+   potential are constants in every variant, so only one branch is
+   ever compiled into a loop. */
+KERNEL_INLINE void kernel_soft(const int kind, const int potential,
+                               vdouble r2, vdouble eps2, vdouble hinv,
+                               vdouble *f, vdouble *p) {
+  vdouble one = VSET1(1.0);
+  if (kind == SOFTENING_SPLINE) {
+    vdouble r = VSQRT(r2), inv = VDIV(one, r);
+    vdouble u = VMUL(r, hinv), u2 = VMUL(u, u);
+    vdouble inv3 = VMUL(inv, VMUL(inv, inv));
+    vdouble h3 = VMUL(hinv, VMUL(hinv, hinv));
+    vdouble inner = VLT(u, VSET1(0.5)), outer = VLT(u, one);
+    vdouble near = VMUL(h3, VADD(VSET1(32.0/3),
+                                 VMUL(u2, VSUB(VMUL(VSET1(32.0), u),
+                                               VSET1(38.4)))));
+    vdouble mid = VSUB(VMUL(h3, VADD(VSET1(64.0/3),
+                                     VMUL(u, VADD(VSET1(-48.0),
+                                       VMUL(u, VSUB(VSET1(38.4),
+                                         VMUL(VSET1(32.0/3), u))))))),
+                       VMUL(VSET1(1.0/15), inv3));
+    *f = VPOSITIVE(r2, VSELECT(inner, near, VSELECT(outer, mid, inv3)));
+    if (potential) {
+      near = VMUL(hinv, VSUB(VSET1(2.8),
+                             VMUL(u2, VADD(VSET1(16.0/3),
+                               VMUL(u2, VSUB(VMUL(VSET1(6.4), u),
+                                             VSET1(9.6)))))));
+      mid = VSUB(VMUL(hinv, VSUB(VSET1(3.2),
+                                 VMUL(u2, VADD(VSET1(32.0/3),
+                                   VMUL(u, VADD(VSET1(-16.0),
+                                     VMUL(u, VSUB(VSET1(9.6),
+                                       VMUL(VSET1(32.0/15), u))))))))),
+                 VMUL(VSET1(1.0/15), inv));
+      *p = VPOSITIVE(r2, VSELECT(inner, near, VSELECT(outer, mid, inv)));
+    }
+    return;
+  }
+  {
+    vdouble rs = r2;
+    if (kind == SOFTENING_PLUMMER) rs = VADD(r2, eps2);
+    if (potential) {
+      *p = VPOSITIVE(r2, VDIV(one, VSQRT(rs)));
+      *f = VMUL(*p, VMUL(*p, *p));
+    } else {
+      *f = VPOSITIVE(r2, VDIV(one, VMUL(rs, VSQRT(rs))));
+    }
+  }
+}
+
+/* kernel_soft for a single pair with r2 > 0 */
+KERNEL_INLINE void kernel_soft1(const int kind, const int potential,
+                                const Kernel *k, double r2,
+                                double *f, double *p) {
+  double r, inv, u;
+  if (kind != SOFTENING_SPLINE) {
+    if (kind == SOFTENING_PLUMMER) r2 += k->eps2;
+    if (potential) {
+      *p = 1.0/sqrt(r2);
+      *f = (*p)*(*p)*(*p);
+    } else {
+      *f = 1.0/(r2*sqrt(r2));
+    }
+    return;
+  }
+  r = sqrt(r2); inv = 1.0/r; u = r*k->hinv;
+  if (u >= 1.0) {
+    *f = inv*inv*inv;
+    if (potential) *p = inv;
+  } else {
+    double h3 = k->hinv*k->hinv*k->hinv, u2 = u*u;
+    if (u < 0.5) {
+      *f = h3*(32.0/3 + u2*(32.0*u - 38.4));
+      if (potential) *p = k->hinv*(2.8 - u2*(16.0/3 + u2*(6.4*u - 9.6)));
+    } else {
+      *f = h3*(64.0/3 + u*(-48.0 + u*(38.4 - 32.0/3*u))) -
+           inv*inv*inv/15;
+      if (potential) *p = k->hinv*(3.2 - u2*(32.0/3 + u*(-16.0 +
+                                 u*(9.6 - 32.0/15*u)))) - inv/15;
+    }
+  }
+}
+
+/* the softened 1/r^3 of the lanes of r2 into *f and its derivative
+   f'(r)/r into *g, both zero where r2 is */
+KERNEL_INLINE void kernel_soft_jerk(const int kind, vdouble r2,
+                                    vdouble eps2, vdouble hinv,
+                                    vdouble *f, vdouble *g) {
+  vdouble one = VSET1(1.0);
+  if (kind == SOFTENING_SPLINE) {
+    vdouble r = VSQRT(r2), inv = VDIV(one, r);
+    vdouble u = VMUL(r, hinv);
+    vdouble inv3 = VMUL(inv, VMUL(inv, inv));
+    vdouble inv5 = VMUL(inv3, VMUL(inv, inv));
+    vdouble h4 = VMUL(VMUL(hinv, hinv), VMUL(hinv, hinv));
+    vdouble h5 = VMUL(h4, hinv);
+    vdouble inner = VLT(u, VSET1(0.5)), outer = VLT(u, one);
+    vdouble near, mid;
+    kernel_soft(SOFTENING_SPLINE, FALSE, r2, eps2, hinv, f, &mid);
+    near = VMUL(h5, VSUB(VMUL(VSET1(96.0), u), VSET1(76.8)));
+    mid = VADD(VSUB(VMUL(h5, VSUB(VSET1(76.8), VMUL(VSET1(32.0), u))),
+                    VMUL(VSET1(48.0), VMUL(h4, inv))),
+               VMUL(VSET1(0.2), inv5));
+    *g = VPOSITIVE(r2, VSELECT(inner, near,
+                               VSELECT(outer, mid,
+                                       VMUL(VSET1(-3.0), inv5))));
+    return;
+  }
+  {
+    vdouble rs = r2, inv2;
+    if (kind == SOFTENING_PLUMMER) rs = VADD(r2, eps2);
+    inv2 = VPOSITIVE(r2, VDIV(one, rs));
+    *f = VMUL(inv2, VSQRT(inv2));
+    *g = VMUL(VSET1(-3.0), VMUL(*f, inv2));
+  }
+}
+
+/* kernel_soft_jerk for a single pair with r2 > 0 */
+KERNEL_INLINE void kernel_soft_jerk1(const int kind, const Kernel *k,
+                                     double r2, double *f, double *g) {
+  double r, inv, u, h4;
+  if (kind != SOFTENING_SPLINE) {
+    if (kind == SOFTENING_PLUMMER) r2 += k->eps2;
+    *f = 1.0/(r2*sqrt(r2));
+    *g = -3.0*(*f)/r2;
+    return;
+  }
+  kernel_soft1(SOFTENING_SPLINE, FALSE, k, r2, f, NULL);
+  r = sqrt(r2); inv = 1.0/r; u = r*k->hinv;
+  h4 = k->hinv*k->hinv*k->hinv*k->hinv;
+  if (u >= 1.0)
+    *g = -3.0*inv*inv*inv*inv*inv;
+  else if (u < 0.5)
+    *g = h4*k->hinv*(96.0*u - 76.8);
+  else
+    *g = h4*k->hinv*(76.8 - 32.0*u) - 48.0*h4*inv +
+         0.2*inv*inv*inv*inv*inv;
+}
+
+/* PARTICLE KERNELS -------------------------------- */
+
+/* the gather kernel of softening kind, with potential its potential
+   variant */
+KERNEL_INLINE void kernel_gather_any(const int kind, const int potential,
+                                     KERNEL_GATHER_ARGS) {
+  vdouble vxi = VSET1(xi), vyi = VSET1(yi), vzi = VSET1(zi);
+  vdouble eps2 = VSET1(k->eps2), hinv = VSET1(k->hinv);
+  vdouble sx = VSET1(0.0), sy = VSET1(0.0), sz = VSET1(0.0);
+  vdouble sp = VSET1(0.0);
+  double tx = 0.0, ty = 0.0, tz = 0.0, tp = 0.0;
+  long j = 0;
+  for(; j + VWIDTH <= n; j += VWIDTH) {
+    vdouble dx = VSUB(VLOAD(x + j), vxi);
+    vdouble dy = VSUB(VLOAD(y + j), vyi);
+    vdouble dz = VSUB(VLOAD(z + j), vzi);
+    vdouble r2 = VADD(VADD(VMUL(dx, dx), VMUL(dy, dy)), VMUL(dz, dz));
+    vdouble mj = VLOAD(m + j), f, p;
+    kernel_soft(kind, potential, r2, eps2, hinv, &f, &p);
+    f = VMUL(mj, f);
+    sx = VADD(sx, VMUL(dx, f));
+    sy = VADD(sy, VMUL(dy, f));
+    sz = VADD(sz, VMUL(dz, f));
+    if (potential) sp = VSUB(sp, VMUL(mj, p));
+  }
+  for(; j < n; j++) {
+    double dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+    double r2 = dx*dx + dy*dy + dz*dz, f, p;
+    if (r2 <= 0.0) continue;
+    kernel_soft1(kind, potential, k, r2, &f, &p);
+    tx += dx*m[j]*f; ty += dy*m[j]*f; tz += dz*m[j]*f;
+    if (potential) tp -= m[j]*p;
+  }
+  *ax += vsum(sx) + tx;
+  *ay += vsum(sy) + ty;
+  *az += vsum(sz) + tz;
+  if (potential) *pot += vsum(sp) + tp;
+}
+
+/* the mutual kernel of softening kind, with potential its potential
+   variant */
+KERNEL_INLINE void kernel_mutual_any(const int kind, const int potential,
+                                     KERNEL_MUTUAL_ARGS) {
+  const double *x = s->x, *y = s->y, *z = s->z, *m = s->mass;
+  double *ax = s->ax, *ay = s->ay, *az = s->az, *phi = s->pot;
+  double xi = x[i], yi = y[i], zi = z[i], mi = m[i];
+  vdouble vxi = VSET1(xi), vyi = VSET1(yi), vzi = VSET1(zi);
+  vdouble vmi = VSET1(mi);
+  vdouble eps2 = VSET1(k->eps2), hinv = VSET1(k->hinv);
+  vdouble sx = VSET1(0.0), sy = VSET1(0.0), sz = VSET1(0.0);
+  vdouble sp = VSET1(0.0);
+  double tx = 0.0, ty = 0.0, tz = 0.0, tp = 0.0;
+  long j = j0;
+  for(; j + VWIDTH <= j1; j += VWIDTH) {
+    vdouble dx = VSUB(VLOAD(x + j), vxi);
+    vdouble dy = VSUB(VLOAD(y + j), vyi);
+    vdouble dz = VSUB(VLOAD(z + j), vzi);
+    vdouble r2 = VADD(VADD(VMUL(dx, dx), VMUL(dy, dy)), VMUL(dz, dz));
+    vdouble mj = VLOAD(m + j), f, p, fj, fi;
+    kernel_soft(kind, potential, r2, eps2, hinv, &f, &p);
+    fj = VMUL(mj, f);
+    fi = VMUL(vmi, f);
+    sx = VADD(sx, VMUL(dx, fj));
+    sy = VADD(sy, VMUL(dy, fj));
+    sz = VADD(sz, VMUL(dz, fj));
+    VSTORE(ax + j, VSUB(VLOAD(ax + j), VMUL(dx, fi)));
+    VSTORE(ay + j, VSUB(VLOAD(ay + j), VMUL(dy, fi)));
+    VSTORE(az + j, VSUB(VLOAD(az + j), VMUL(dz, fi)));
+    if (potential) {
+      sp = VSUB(sp, VMUL(mj, p));
+      VSTORE(phi + j, VSUB(VLOAD(phi + j), VMUL(vmi, p)));
+    }
+  }
+  for(; j < j1; j++) {
+    double dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+    double r2 = dx*dx + dy*dy + dz*dz, f, p;
+    if (r2 <= 0.0) continue;
+    kernel_soft1(kind, potential, k, r2, &f, &p);
+    tx += dx*m[j]*f; ty += dy*m[j]*f; tz += dz*m[j]*f;
+    ax[j] -= dx*mi*f; ay[j] -= dy*mi*f; az[j] -= dz*mi*f;
+    if (potential) {
+      tp -= m[j]*p;
+      phi[j] -= mi*p;
+    }
+  }
+  ax[i] += vsum(sx) + tx;
+  ay[i] += vsum(sy) + ty;
+  az[i] += vsum(sz) + tz;
+  if (potential) phi[i] += vsum(sp) + tp;
+}
+
+/* the jerk kernel of softening kind */
+KERNEL_INLINE void kernel_jerk_any(const int kind, KERNEL_JERK_ARGS) {
+  vdouble vxi = VSET1(pi[0]), vyi = VSET1(pi[1]), vzi = VSET1(pi[2]);
+  vdouble wxi = VSET1(vi[0]), wyi = VSET1(vi[1]), wzi = VSET1(vi[2]);
+  vdouble eps2 = VSET1(k->eps2), hinv = VSET1(k->hinv);
+  vdouble sx = VSET1(0.0), sy = VSET1(0.0), sz = VSET1(0.0);
+  vdouble jx = VSET1(0.0), jy = VSET1(0.0), jz = VSET1(0.0);
+  double t[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+  long j = 0;
+  for(; j + VWIDTH <= n; j += VWIDTH) {
+    vdouble dx = VSUB(VLOAD(x + j), vxi);
+    vdouble dy = VSUB(VLOAD(y + j), vyi);
+    vdouble dz = VSUB(VLOAD(z + j), vzi);
+    vdouble wx = VSUB(VLOAD(vx + j), wxi);
+    vdouble wy = VSUB(VLOAD(vy + j), wyi);
+    vdouble wz = VSUB(VLOAD(vz + j), wzi);
+    vdouble r2 = VADD(VADD(VMUL(dx, dx), VMUL(dy, dy)), VMUL(dz, dz));
+    vdouble mj = VLOAD(m + j), f, g;
+    kernel_soft_jerk(kind, r2, eps2, hinv, &f, &g);
+    f = VMUL(mj, f);
+    g = VMUL(VMUL(mj, g), VADD(VADD(VMUL(dx, wx), VMUL(dy, wy)),
+                               VMUL(dz, wz)));
+    sx = VADD(sx, VMUL(dx, f));
+    sy = VADD(sy, VMUL(dy, f));
+    sz = VADD(sz, VMUL(dz, f));
+    jx = VADD(jx, VADD(VMUL(f, wx), VMUL(g, dx)));
+    jy = VADD(jy, VADD(VMUL(f, wy), VMUL(g, dy)));
+    jz = VADD(jz, VADD(VMUL(f, wz), VMUL(g, dz)));
+  }
+  for(; j < n; j++) {
+    double dx = x[j] - pi[0], dy = y[j] - pi[1], dz = z[j] - pi[2];
+    double wx = vx[j] - vi[0], wy = vy[j] - vi[1], wz = vz[j] - vi[2];
+    double r2 = dx*dx + dy*dy + dz*dz;
+    double f, g;
+    if (r2 <= 0.0) continue;
+    kernel_soft_jerk1(kind, k, r2, &f, &g);
+    f *= m[j];
+    g *= m[j]*(dx*wx + dy*wy + dz*wz);
+    t[0] += dx*f; t[1] += dy*f; t[2] += dz*f;
+    t[3] += f*wx + g*dx; t[4] += f*wy + g*dy; t[5] += f*wz + g*dz;
+  }
+  a[0] += vsum(sx) + t[0];
+  a[1] += vsum(sy) + t[1];
+  a[2] += vsum(sz) + t[2];
+  jerk[0] += vsum(jx) + t[3];
+  jerk[1] += vsum(jy) + t[4];
+  jerk[2] += vsum(jz) + t[5];
+}
+
+/* the variants of one softening */
+#define KERNEL_VARIANTS(name, kind) \
+  static void kernel_gather_##name(KERNEL_GATHER_ARGS) { \
+    kernel_gather_any(kind, FALSE, k, xi, yi, zi, x, y, z, m, n, \
+                      ax, ay, az, pot); \
+  } \
+  static void kernel_gather_pot_##name(KERNEL_GATHER_ARGS) { \
+    kernel_gather_any(kind, TRUE, k, xi, yi, zi, x, y, z, m, n, \
+                      ax, ay, az, pot); \
+  } \
+  static void kernel_mutual_##name(KERNEL_MUTUAL_ARGS) { \
+    kernel_mutual_any(kind, FALSE, k, s, i, j0, j1); \
+  } \
+  static void kernel_mutual_pot_##name(KERNEL_MUTUAL_ARGS) { \
+    kernel_mutual_any(kind, TRUE, k, s, i, j0, j1); \
+  } \
+  static void kernel_jerk_##name(KERNEL_JERK_ARGS) { \
+    kernel_jerk_any(kind, k, pi, vi, x, y, z, vx, vy, vz, m, n, a, jerk); \
+  }
+
+KERNEL_VARIANTS(none, SOFTENING_NONE)
+KERNEL_VARIANTS(plummer, SOFTENING_PLUMMER)
+KERNEL_VARIANTS(spline, SOFTENING_SPLINE)
+
+/* fills in the kernels of a force pass on s with softening eps, with
+   pot their potential variants */
+static inline void kernel_select(Kernel *k, const Particles *s, double eps,
+                                 int pot) {
+  k->softening = (eps == 0.0) ? SOFTENING_NONE : s->softening;
+  k->eps2 = (k->softening == SOFTENING_PLUMMER) ? eps*eps : 0.0;
+  k->hinv = (k->softening == SOFTENING_SPLINE) ?
+            1.0/(SPLINE_SUPPORT*fabs(eps)) : 0.0;
+  switch (k->softening) {
+  case SOFTENING_SPLINE:
+    k->gather = pot ? kernel_gather_pot_spline : kernel_gather_spline;
+    k->mutual = pot ? kernel_mutual_pot_spline : kernel_mutual_spline;
+    k->jerk = kernel_jerk_spline;
+    break;
+  case SOFTENING_PLUMMER:
+    k->gather = pot ? kernel_gather_pot_plummer : kernel_gather_plummer;
+    k->mutual = pot ? kernel_mutual_pot_plummer : kernel_mutual_plummer;
+    k->jerk = kernel_jerk_plummer;
+    break;
+  default:
+    k->gather = pot ? kernel_gather_pot_none : kernel_gather_none;
+    k->mutual = pot ? kernel_mutual_pot_none : kernel_mutual_none;
+    k->jerk = kernel_jerk_none;
+  }
+}
+
+/* symmetric sum over the pairs (i, j) with j in [j0, j1) and j > i */
+static inline void kernel_symmetric(const Kernel *k, Particles *s, long i,
+                                    long j0, long j1) {
+  if (j0 <= i) j0 = i + 1;
+  k->mutual(k, s, i, j0, j1);
+}
+
+/* CELL KERNELS ------------------------------------ */
+
+/* one-sided sum over n far-away cells carrying a monopole and a
+   traceless quadrupole q = (xx, yy, zz, xy, xz, yz), each column its
+   own array. With d pointing from the target to the cell's centre of
+   mass, a = d (m/r^3 + 5/2 dQd/r^7) - Qd/r^5. Cells are never
+   coincident with the target, so there is no zero-distance guard. */
+static inline void kernel_gather_quad(double xi, double yi, double zi,
+                                      const double *x, const double *y,
+                                      const double *z, const double *m,
+                                      double *const *q, long n, double eps2,
+                                      double *ax, double *ay, double *az) {
+  const double *qxx = q[0], *qyy = q[1], *qzz = q[2];
+  const double *qxy = q[3], *qxz = q[4], *qyz = q[5];
+  vdouble vxi = VSET1(xi), vyi = VSET1(yi), vzi = VSET1(zi);
+  vdouble veps2 = VSET1(eps2), one = VSET1(1.0), half5 = VSET1(2.5);
+  vdouble sx = VSET1(0.0), sy = VSET1(0.0), sz = VSET1(0.0);
+  double tx = 0.0, ty = 0.0, tz = 0.0;
+  long j = 0;
+  for(; j + VWIDTH <= n; j += VWIDTH) {
+    vdouble dx = VSUB(VLOAD(x + j), vxi);
+    vdouble dy = VSUB(VLOAD(y + j), vyi);
+    vdouble dz = VSUB(VLOAD(z + j), vzi);
+    vdouble r2 = VADD(VADD(VADD(VMUL(dx, dx), VMUL(dy, dy)),
+                           VMUL(dz, dz)), veps2);
+    vdouble inv2 = VDIV(one, r2);
+    vdouble inv3 = VMUL(inv2, VDIV(one, VSQRT(r2)));
+    vdouble inv5 = VMUL(inv3, inv2);
+    vdouble inv7 = VMUL(inv5, inv2);
+    vdouble qdx = VADD(VADD(VMUL(VLOAD(qxx + j), dx), VMUL(VLOAD(qxy + j), dy)),
+                       VMUL(VLOAD(qxz + j), dz));
+    vdouble qdy = VADD(VADD(VMUL(VLOAD(qxy + j), dx), VMUL(VLOAD(qyy + j), dy)),
+                       VMUL(VLOAD(qyz + j), dz));
+    vdouble qdz = VADD(VADD(VMUL(VLOAD(qxz + j), dx), VMUL(VLOAD(qyz + j), dy)),
+                       VMUL(VLOAD(qzz + j), dz));
+    vdouble dqd = VADD(VADD(VMUL(dx, qdx), VMUL(dy, qdy)), VMUL(dz, qdz));
+    vdouble f = VADD(VMUL(VLOAD(m + j), inv3), VMUL(half5, VMUL(dqd, inv7)));
+    sx = VADD(sx, VSUB(VMUL(dx, f), VMUL(qdx, inv5)));
+    sy = VADD(sy, VSUB(VMUL(dy, f), VMUL(qdy, inv5)));
+    sz = VADD(sz, VSUB(VMUL(dz, f), VMUL(qdz, inv5)));
+  }
+  for(; j < n; j++) {
+    double dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+    double r2 = dx*dx + dy*dy + dz*dz + eps2;
+    double inv2 = 1.0/r2, inv3 = inv2/sqrt(r2);
+    double inv5 = inv3*inv2, inv7 = inv5*inv2;
+    double qdx = qxx[j]*dx + qxy[j]*dy + qxz[j]*dz;
+    double qdy = qxy[j]*dx + qyy[j]*dy + qyz[j]*dz;
+    double qdz = qxz[j]*dx + qyz[j]*dy + qzz[j]*dz;
+    double f = m[j]*inv3 + 2.5*(dx*qdx + dy*qdy + dz*qdz)*inv7;
+    tx += dx*f - qdx*inv5;
+    ty += dy*f - qdy*inv5;
+    tz += dz*f - qdz*inv5;
+  }
+  *ax += vsum(sx) + tx;
+  *ay += vsum(sy) + ty;
+  *az += vsum(sz) + tz;
+}
+
+/* kernel_gather_quad that also adds the potential of every cell,
+   -m/r - 1/2 dQd/r^5, to *pot */
+static inline void kernel_gather_quad_pot(double xi, double yi, double zi,
+                                          const double *x, const double *y,
+                                          const double *z, const double *m,
+                                          double *const *q, long n,
+                                          double eps2, double *ax,
+                                          double *ay, double *az,
+                                          double *pot) {
+  const double *qxx = q[0], *qyy = q[1], *qzz = q[2];
+  const double *qxy = q[3], *qxz = q[4], *qyz = q[5];
+  vdouble vxi = VSET1(xi), vyi = VSET1(yi), vzi = VSET1(zi);
+  vdouble veps2 = VSET1(eps2), one = VSET1(1.0), half = VSET1(0.5);
+  vdouble half5 = VSET1(2.5);
+  vdouble sx = VSET1(0.0), sy = VSET1(0.0), sz = VSET1(0.0);
+  vdouble sp = VSET1(0.0);
+  double tx = 0.0, ty = 0.0, tz = 0.0, tp = 0.0;
+  long j = 0;
+  for(; j + VWIDTH <= n; j += VWIDTH) {
+    vdouble dx = VSUB(VLOAD(x + j), vxi);
+    vdouble dy = VSUB(VLOAD(y + j), vyi);
+    vdouble dz = VSUB(VLOAD(z + j), vzi);
+    vdouble r2 = VADD(VADD(VADD(VMUL(dx, dx), VMUL(dy, dy)),
+                           VMUL(dz, dz)), veps2);
+    vdouble inv1 = VDIV(one, VSQRT(r2));
+    vdouble inv2 = VMUL(inv1, inv1);
+    vdouble inv3 = VMUL(inv2, inv1);
+    vdouble inv5 = VMUL(inv3, inv2);
+    vdouble inv7 = VMUL(inv5, inv2);
+    vdouble mj = VLOAD(m + j);
+    vdouble qdx = VADD(VADD(VMUL(VLOAD(qxx + j), dx), VMUL(VLOAD(qxy + j), dy)),
+                       VMUL(VLOAD(qxz + j), dz));
+    vdouble qdy = VADD(VADD(VMUL(VLOAD(qxy + j), dx), VMUL(VLOAD(qyy + j), dy)),
+                       VMUL(VLOAD(qyz + j), dz));
+    vdouble qdz = VADD(VADD(VMUL(VLOAD(qxz + j), dx), VMUL(VLOAD(qyz + j), dy)),
+                       VMUL(VLOAD(qzz + j), dz));
+    vdouble dqd = VADD(VADD(VMUL(dx, qdx), VMUL(dy, qdy)), VMUL(dz, qdz));
+    vdouble f = VADD(VMUL(mj, inv3), VMUL(half5, VMUL(dqd, inv7)));
+    sx = VADD(sx, VSUB(VMUL(dx, f), VMUL(qdx, inv5)));
+    sy = VADD(sy, VSUB(VMUL(dy, f), VMUL(qdy, inv5)));
+    sz = VADD(sz, VSUB(VMUL(dz, f), VMUL(qdz, inv5)));
+    sp = VSUB(sp, VADD(VMUL(mj, inv1), VMUL(half, VMUL(dqd, inv5))));
+  }
+  for(; j < n; j++) {
+    double dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+    double r2 = dx*dx + dy*dy + dz*dz + eps2;
+    double inv1 = 1.0/sqrt(r2), inv2 = inv1*inv1, inv3 = inv2*inv1;
+    double inv5 = inv3*inv2, inv7 = inv5*inv2;
+    double qdx = qxx[j]*dx + qxy[j]*dy + qxz[j]*dz;
+    double qdy = qxy[j]*dx + qyy[j]*dy + qyz[j]*dz;
+    double qdz = qxz[j]*dx + qyz[j]*dy + qzz[j]*dz;
+    double dqd = dx*qdx + dy*qdy + dz*qdz;
+    double f = m[j]*inv3 + 2.5*dqd*inv7;
+    tx += dx*f - qdx*inv5;
+    ty += dy*f - qdy*inv5;
+    tz += dz*f - qdz*inv5;
+    tp -= m[j]*inv1 + 0.5*dqd*inv5;
+  }
+  *ax += vsum(sx) + tx;
+  *ay += vsum(sy) + ty;
+  *az += vsum(sz) + tz;
+  *pot += vsum(sp) + tp;
+}
+
+/* kernel_gather over far-away sources in single precision, twice as
+   many lanes at a time. The positions of the particle and the sources
+   are relative to a centre near the particle, so float still resolves
+   their separation to a few parts in 10^7; 1/r comes from VFRSQRT and
+   one Newton step. The contributions are summed in double. */
+static inline void kernel_gather_far32(float xi, float yi, float zi,
+                                       const float *x, const float *y,
+                                       const float *z, const float *m,
+                                       long n, float eps2,
+                                       double *ax, double *ay, double *az) {
+  vfloat vxi = VFSET1(xi), vyi = VFSET1(yi), vzi = VFSET1(zi);
+  vfloat veps2 = VFSET1(eps2), half = VFSET1(0.5f), three = VFSET1(3.0f);
+  vdouble sxl = VSET1(0.0), syl = VSET1(0.0), szl = VSET1(0.0);
+  vdouble sxh = VSET1(0.0), syh = VSET1(0.0), szh = VSET1(0.0);
+  double tx = 0.0, ty = 0.0, tz = 0.0;
+  long j = 0;
+  for(; j + VFWIDTH <= n; j += VFWIDTH) {
+    vfloat dx = VFSUB(VFLOAD(x + j), vxi);
+    vfloat dy = VFSUB(VFLOAD(y + j), vyi);
+    vfloat dz = VFSUB(VFLOAD(z + j), vzi);
+    vfloat r2 = VFADD(VFADD(VFMUL(dx, dx), VFMUL(dy, dy)), VFMUL(dz, dz));
+    vfloat rs = VFADD(r2, veps2);
+    vfloat ri = VFRSQRT(rs);
+    vfloat f;
+    /* Newton: ri (3 - rs ri^2)/2 */
+    ri = VFMUL(VFMUL(half, ri), VFSUB(three, VFMUL(rs, VFMUL(ri, ri))));
+    f = VFPOSITIVE(r2, VFMUL(VFLOAD(m + j), VFMUL(ri, VFMUL(ri, ri))));
+    VFACC(sxl, sxh, VFMUL(dx, f));
+    VFACC(syl, syh, VFMUL(dy, f));
+    VFACC(szl, szh, VFMUL(dz, f));
+  }
+  for(; j < n; j++) {
+    float dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+    float r2 = dx*dx + dy*dy + dz*dz, rs = r2 + eps2, f;
+    if (r2 <= 0.0f) continue;
+    f = m[j]/(rs*sqrtf(rs));
+    tx += dx*f; ty += dy*f; tz += dz*f;
+  }
+  *ax += vsum(sxl) + vsum(sxh) + tx;
+  *ay += vsum(syl) + vsum(syh) + ty;
+  *az += vsum(szl) + vsum(szh) + tz;
+}
+
+#endif
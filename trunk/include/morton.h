@@ -0,0 +1,79 @@
+/* morton.h -> 63-bit Morton (Z-order) keys and an LSD radix sort
+
+   A key interleaves 21 bits of each coordinate, x in the highest bit
+   of every triplet, so the top three bits of a key are the octant of
+   the root cell in the same x-y-z order that the tree uses, the next
+   three the octant of the child, and so on. Sorting by key therefore
+   lays the particles out in depth-first octree order. */
+
+#ifndef TARA_MORTON_H
+#define TARA_MORTON_H
+
+#include "stdint.h"
+#include "string.h"
+
+#define MORTON_BITS 21
+#define MORTON_CELLS (1L << MORTON_BITS)
+
+/* spreads the low 21 bits of v so that there are two zero bits between
+   every two of them */
+static inline uint64_t morton_spread(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffULL;
+  v = (v | v << 16) & 0x1f0000ff0000ffULL;
+  v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+  v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+  v = (v | v << 2)  & 0x1249249249249249ULL;
+  return v;
+}
+
+/* maps a coordinate into [0, MORTON_CELLS) along one axis of the cube
+   [lo, lo + side) */
+static inline uint64_t morton_cell(double x, double lo, double scale) {
+  double c = (x - lo)*scale;
+  if (c < 0.0) return 0;
+  if (c >= (double)MORTON_CELLS) return MORTON_CELLS - 1;
+  return (uint64_t)c;
+}
+
+/* the key of a point in the cube centred on center with half-side size */
+static inline uint64_t morton_key(double x, double y, double z,
+                                  const double *center, double size) {
+  double scale = (double)MORTON_CELLS/(2.0*size);
+  return (morton_spread(morton_cell(x, center[0] - size, scale)) << 2) |
+         (morton_spread(morton_cell(y, center[1] - size, scale)) << 1) |
+          morton_spread(morton_cell(z, center[2] - size, scale));
+}
+
+/* sorts keys[0, n) together with idx[0, n), eight bits per pass. The
+   tmp buffers must hold n entries each. Passes in which every key has
+   the same digit are skipped. */
+static inline void morton_sort(uint64_t *keys, long *idx, long n,
+                               uint64_t *tmp_keys, long *tmp_idx) {
+  long count[256];
+  int shift;
+  for(shift = 0; shift < 64; shift += 8) {
+    long k, sum = 0;
+    int d, skip = 0;
+    memset(count, 0, sizeof(count));
+    for(k = 0; k < n; k++) {
+      count[(keys[k] >> shift) & 0xff]++;
+    }
+    for(d = 0; d < 256; d++) {
+      long c = count[d];
+      if (c == n) skip = 1;
+      count[d] = sum;
+      sum += c;
+    }
+    if (skip) continue;
+    for(k = 0; k < n; k++) {
+      long dst = count[(keys[k] >> shift) & 0xff]++;
+      tmp_keys[dst] = keys[k];
+      tmp_idx[dst] = idx[k];
+    }
+    memcpy(keys, tmp_keys, n*sizeof(uint64_t));
+    memcpy(idx, tmp_idx, n*sizeof(long));
+  }
+}
+
+#endif
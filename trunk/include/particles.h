@@ -0,0 +1,288 @@
+/* particles.h -> the structure-of-arrays particle store shared by all of
+                  Tara's native extensions
+
+   Every particle quantity lives in its own flat, aligned array of
+   doubles so that the integrator and force loops walk contiguous
+   memory. The Ruby side only ever sees a Particles object and Body
+   views that hold a handle into it. Rows may be reordered (Morton
+   sorting), so a handle is mapped to its current row through where[],
+   and id[] maps a row back to its handle.
+
+   The double columns of a store loaded from a binary snapshot point
+   into a private memory map of the file (map != NULL). They are copied
+   into memory of their own before the store grows or gets reordered.
+
+   The columns of the block timestep scheme (dt, ox, oy, oz) and the
+   active set, the jerks of the Hermite integrator, the potentials, and
+   the global ids and walk costs of a distributed run are only
+   allocated once they are asked for (particles_steps, particles_jerks,
+   particles_potentials, particles_domain) and never live in a
+   mapping. */
+
+#ifndef TARA_PARTICLES_H
+#define TARA_PARTICLES_H
+
+#include "stdlib.h"
+#include "string.h"
+#include "sys/mman.h"
+#include "ruby.h"
+
+#define GET_STORE(val, p) Data_Get_Struct(val, Particles, p)
+#define PARTICLES_ALIGN 64
+
+/* the softened gravity of the store's force passes (see kernel.h) */
+#define SOFTENING_PLUMMER 0
+#define SOFTENING_NONE 1
+#define SOFTENING_SPLINE 2
+
+/* what a force pass does with the potentials (the potential flag) */
+#define POTENTIAL_NONE 0
+#define POTENTIAL_WITH_FORCES 1
+#define POTENTIAL_ONLY 2   /* the accelerations are left as they were */
+
+typedef struct {
+  long n;           /* number of particles in the store */
+  long capacity;    /* allocated length of every column */
+  double *x, *y, *z;
+  double *vx, *vy, *vz;
+  double *ax, *ay, *az;
+  double *mass;
+  double *dt;       /* block timestep of every particle, 0 if unset */
+  double *ox, *oy, *oz;  /* acceleration at the start of that step */
+  long *active;     /* handles whose forces are due, nactive of them */
+  long nactive;
+  double *jx, *jy, *jz;  /* jerk, da/dt */
+  double *pot;      /* potential, left by the last force pass that had
+                       potential set */
+  int potential;    /* force passes also compute pot: POTENTIAL_* */
+  int softening;    /* SOFTENING_PLUMMER, _NONE or _SPLINE */
+  long *tag;        /* global id of every row in a distributed run, -1
+                       for the ghosts of other processes (domain.c) */
+  double *work;     /* interactions of every row in the last tree walk */
+  long *id;         /* row -> handle */
+  long *where;      /* handle -> row */
+  int threads;      /* worker threads used by the force loops */
+  void *map;        /* snapshot mapping holding the columns, or NULL */
+  size_t map_size;
+} Particles;
+
+/* grows (or allocates) a single aligned column, keeping the first n
+   entries */
+static inline void *particles_grow(void *old, size_t size, long n,
+                                   long capacity) {
+  void *p = NULL;
+  if (posix_memalign(&p, PARTICLES_ALIGN, capacity*size) != 0)
+    rb_raise(rb_eNoMemError, "failed to allocate particle store");
+  memset(p, 0, capacity*size);
+  if (old != NULL) {
+    memcpy(p, old, n*size);
+    free(old);
+  }
+  return p;
+}
+
+static inline double *particles_column(double *old, long n, long capacity) {
+  return (double *)particles_grow(old, sizeof(double), n, capacity);
+}
+
+static inline double *particles_copy(const double *src, long n,
+                                     long capacity) {
+  double *p = particles_column(NULL, 0, capacity);
+  memcpy(p, src, n*sizeof(double));
+  return p;
+}
+
+/* moves the columns of a mapped store into memory of their own */
+static inline void particles_own(Particles *s) {
+  long n = s->n, capacity = s->capacity ? s->capacity : 1;
+  if (s->map == NULL) return;
+  s->x = particles_copy(s->x, n, capacity);
+  s->y = particles_copy(s->y, n, capacity);
+  s->z = particles_copy(s->z, n, capacity);
+  s->vx = particles_copy(s->vx, n, capacity);
+  s->vy = particles_copy(s->vy, n, capacity);
+  s->vz = particles_copy(s->vz, n, capacity);
+  s->ax = particles_copy(s->ax, n, capacity);
+  s->ay = particles_copy(s->ay, n, capacity);
+  s->az = particles_copy(s->az, n, capacity);
+  s->mass = particles_copy(s->mass, n, capacity);
+  munmap(s->map, s->map_size);
+  s->map = NULL;
+  s->map_size = 0;
+}
+
+/* makes sure there is room for at least capacity particles */
+static inline void particles_reserve(Particles *s, long capacity) {
+  if (capacity <= s->capacity) return;
+  particles_own(s);
+  if (capacity < 2*s->capacity) capacity = 2*s->capacity;
+  if (capacity < 16) capacity = 16;
+  s->x = particles_column(s->x, s->n, capacity);
+  s->y = particles_column(s->y, s->n, capacity);
+  s->z = particles_column(s->z, s->n, capacity);
+  s->vx = particles_column(s->vx, s->n, capacity);
+  s->vy = particles_column(s->vy, s->n, capacity);
+  s->vz = particles_column(s->vz, s->n, capacity);
+  s->ax = particles_column(s->ax, s->n, capacity);
+  s->ay = particles_column(s->ay, s->n, capacity);
+  s->az = particles_column(s->az, s->n, capacity);
+  s->mass = particles_column(s->mass, s->n, capacity);
+  s->id = (long *)particles_grow(s->id, sizeof(long), s->n, capacity);
+  s->where = (long *)particles_grow(s->where, sizeof(long), s->n, capacity);
+  if (s->dt != NULL) {
+    s->dt = particles_column(s->dt, s->n, capacity);
+    s->ox = particles_column(s->ox, s->n, capacity);
+    s->oy = particles_column(s->oy, s->n, capacity);
+    s->oz = particles_column(s->oz, s->n, capacity);
+    s->active = (long *)particles_grow(s->active, sizeof(long), s->nactive,
+                                       capacity);
+  }
+  if (s->jx != NULL) {
+    s->jx = particles_column(s->jx, s->n, capacity);
+    s->jy = particles_column(s->jy, s->n, capacity);
+    s->jz = particles_column(s->jz, s->n, capacity);
+  }
+  if (s->pot != NULL)
+    s->pot = particles_column(s->pot, s->n, capacity);
+  if (s->tag != NULL) {
+    s->tag = (long *)particles_grow(s->tag, sizeof(long), s->n, capacity);
+    s->work = particles_column(s->work, s->n, capacity);
+  }
+  s->capacity = capacity;
+}
+
+/* allocates the block timestep columns and the active set */
+static inline void particles_steps(Particles *s) {
+  long capacity = s->capacity ? s->capacity : 1;
+  if (s->dt != NULL) return;
+  s->dt = particles_column(NULL, 0, capacity);
+  s->ox = particles_column(NULL, 0, capacity);
+  s->oy = particles_column(NULL, 0, capacity);
+  s->oz = particles_column(NULL, 0, capacity);
+  s->active = (long *)particles_grow(NULL, sizeof(long), 0, capacity);
+  s->nactive = 0;
+}
+
+/* allocates the jerk columns */
+static inline void particles_jerks(Particles *s) {
+  long capacity = s->capacity ? s->capacity : 1;
+  if (s->jx != NULL) return;
+  s->jx = particles_column(NULL, 0, capacity);
+  s->jy = particles_column(NULL, 0, capacity);
+  s->jz = particles_column(NULL, 0, capacity);
+}
+
+/* allocates the potential column */
+static inline void particles_potentials(Particles *s) {
+  if (s->pot == NULL)
+    s->pot = particles_column(NULL, 0, s->capacity ? s->capacity : 1);
+}
+
+/* a copy of the acceleration columns, for the passes that only want
+   potentials (see particles_restore_acc) */
+static inline double *particles_save_acc(const Particles *s) {
+  long n = s->n > 0 ? s->n : 1;
+  double *saved = (double *)malloc(3*n*sizeof(double));
+  if (saved == NULL)
+    rb_raise(rb_eNoMemError, "failed to save the accelerations");
+  memcpy(saved, s->ax, s->n*sizeof(double));
+  memcpy(saved + n, s->ay, s->n*sizeof(double));
+  memcpy(saved + 2*n, s->az, s->n*sizeof(double));
+  return saved;
+}
+
+/* puts the accelerations of particles_save_acc back and frees them */
+static inline void particles_restore_acc(Particles *s, double *saved) {
+  long n = s->n > 0 ? s->n : 1;
+  memcpy(s->ax, saved, s->n*sizeof(double));
+  memcpy(s->ay, saved + n, s->n*sizeof(double));
+  memcpy(s->az, saved + 2*n, s->n*sizeof(double));
+  free(saved);
+}
+
+/* allocates the global ids and the walk costs */
+static inline void particles_domain(Particles *s) {
+  long capacity = s->capacity ? s->capacity : 1;
+  if (s->tag != NULL) return;
+  s->tag = (long *)particles_grow(NULL, sizeof(long), 0, capacity);
+  s->work = particles_column(NULL, 0, capacity);
+}
+
+/* appends a particle and returns its index */
+static inline long particles_push(Particles *s, double m,
+                                  double x, double y, double z,
+                                  double vx, double vy, double vz) {
+  long i = s->n;
+  particles_reserve(s, i + 1);
+  s->mass[i] = m;
+  s->x[i] = x; s->y[i] = y; s->z[i] = z;
+  s->vx[i] = vx; s->vy[i] = vy; s->vz[i] = vz;
+  s->ax[i] = s->ay[i] = s->az[i] = 0.0;
+  s->id[i] = s->where[i] = i;
+  s->n++;
+  return i;
+}
+
+/* gathers a single column through a permutation, recycling *tmp */
+static inline void particles_gather(double **col, double **tmp,
+                                    const long *perm, long n) {
+  double *src = *col, *dst = *tmp;
+  register long k;
+  for(k = 0; k < n; k++) {
+    dst[k] = src[perm[k]];
+  }
+  *col = dst;
+  *tmp = src;
+}
+
+/* reorders the rows so that new row k is old row perm[k]; handles keep
+   pointing at their particles */
+static inline void particles_permute(Particles *s, const long *perm) {
+  double *tmp;
+  long *ids = (long *)particles_grow(NULL, sizeof(long), 0,
+                                     s->capacity ? s->capacity : 1);
+  long k, n = s->n;
+  particles_own(s);
+  tmp = particles_column(NULL, 0, s->capacity ? s->capacity : 1);
+  particles_gather(&s->x, &tmp, perm, n);
+  particles_gather(&s->y, &tmp, perm, n);
+  particles_gather(&s->z, &tmp, perm, n);
+  particles_gather(&s->vx, &tmp, perm, n);
+  particles_gather(&s->vy, &tmp, perm, n);
+  particles_gather(&s->vz, &tmp, perm, n);
+  particles_gather(&s->ax, &tmp, perm, n);
+  particles_gather(&s->ay, &tmp, perm, n);
+  particles_gather(&s->az, &tmp, perm, n);
+  particles_gather(&s->mass, &tmp, perm, n);
+  if (s->dt != NULL) {
+    particles_gather(&s->dt, &tmp, perm, n);
+    particles_gather(&s->ox, &tmp, perm, n);
+    particles_gather(&s->oy, &tmp, perm, n);
+    particles_gather(&s->oz, &tmp, perm, n);
+  }
+  if (s->jx != NULL) {
+    particles_gather(&s->jx, &tmp, perm, n);
+    particles_gather(&s->jy, &tmp, perm, n);
+    particles_gather(&s->jz, &tmp, perm, n);
+  }
+  if (s->pot != NULL)
+    particles_gather(&s->pot, &tmp, perm, n);
+  if (s->tag != NULL) {
+    particles_gather(&s->work, &tmp, perm, n);
+    for(k = 0; k < n; k++) {
+      ids[k] = s->tag[perm[k]];
+    }
+    memcpy(s->tag, ids, n*sizeof(long));
+  }
+  for(k = 0; k < n; k++) {
+    ids[k] = s->id[perm[k]];
+  }
+  free(s->id);
+  s->id = ids;
+  for(k = 0; k < n; k++) {
+    s->where[ids[k]] = k;
+  }
+  free(tmp);
+}
+
+#endif
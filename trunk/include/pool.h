@@ -0,0 +1,272 @@
+/* pool.h -> a small work-stealing thread pool for the force loops
+
+   pool_run() splits nblocks independent blocks of work evenly between
+   nthreads workers. A worker that runs dry steals the upper half of the
+   remaining range of another worker, so non-uniform blocks (tree walks
+   in clustered systems) still keep every core busy. The calling thread
+   is worker 0, and the Ruby GVL is released for the duration so other
+   Ruby threads can run. Tasks must not touch Ruby objects.
+
+   pool_run_rounds() runs nrounds rounds of nblocks blocks each on the
+   same threads, every round starting only when the last one is done,
+   for work whose blocks conflict across rounds but not within one. */
+
+#ifndef TARA_POOL_H
+#define TARA_POOL_H
+
+#include "pthread.h"
+#include "ruby.h"
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+
+#define POOL_MAX_THREADS 256
+
+typedef void (*pool_task)(void *arg, long block, int worker);
+
+typedef struct {
+  pthread_mutex_t lock;
+  long lo, hi;                    /* remaining blocks: [lo, hi) */
+  char pad[64];                   /* keeps queues on separate lines */
+} pool_queue;
+
+typedef struct {
+  pool_queue *queues;
+  int nthreads;
+  long nblocks;
+  pool_task fn;
+  void *arg;
+} pool_job;
+
+typedef struct {
+  pool_job *job;
+  int worker;
+} pool_worker;
+
+/* takes the next block from the worker's own queue */
+static inline int pool_take(pool_queue *q, long *block) {
+  int found = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->lo < q->hi) {
+    *block = q->lo++;
+    found = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+/* steals the upper half of some other worker's range; the first stolen
+   block is returned, the rest goes into the thief's own queue */
+static inline int pool_steal(pool_job *job, int self, long *block) {
+  int k;
+  for(k = 1; k < job->nthreads; k++) {
+    pool_queue *v = &job->queues[(self + k) % job->nthreads];
+    long lo = 0, hi = 0;
+    pthread_mutex_lock(&v->lock);
+    if (v->lo < v->hi) {
+      long half = (v->hi - v->lo + 1)/2;
+      hi = v->hi;
+      lo = v->hi - half;
+      v->hi = lo;
+    }
+    pthread_mutex_unlock(&v->lock);
+    if (lo < hi) {
+      pool_queue *q = &job->queues[self];
+      pthread_mutex_lock(&q->lock);
+      q->lo = lo + 1;
+      q->hi = hi;
+      pthread_mutex_unlock(&q->lock);
+      *block = lo;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static inline void *pool_work(void *data) {
+  pool_worker *w = (pool_worker *)data;
+  pool_job *job = w->job;
+  long block;
+  while (pool_take(&job->queues[w->worker], &block) ||
+         pool_steal(job, w->worker, &block)) {
+    job->fn(job->arg, block, w->worker);
+  }
+  return NULL;
+}
+
+static inline void *pool_dispatch(void *data) {
+  pool_job *job = (pool_job *)data;
+  pthread_t threads[POOL_MAX_THREADS];
+  pool_worker workers[POOL_MAX_THREADS];
+  pool_queue queues[POOL_MAX_THREADS];
+  int t, started;
+  
+  job->queues = queues;
+  for(t = 0; t < job->nthreads; t++) {
+    pthread_mutex_init(&queues[t].lock, NULL);
+    queues[t].lo = job->nblocks*t/job->nthreads;
+    queues[t].hi = job->nblocks*(t + 1)/job->nthreads;
+    workers[t].job = job;
+    workers[t].worker = t;
+  }
+  for(started = 1; started < job->nthreads; started++) {
+    if (pthread_create(&threads[started], NULL, pool_work,
+                       &workers[started]) != 0)
+      break;
+  }
+  /* if a thread could not be started, its range is stolen by the rest */
+  pool_work(&workers[0]);
+  for(t = 1; t < started; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  for(t = 0; t < job->nthreads; t++) {
+    pthread_mutex_destroy(&queues[t].lock);
+  }
+  return NULL;
+}
+
+/* runs fn(arg, block, worker) for every block in [0, nblocks) */
+static inline void pool_run(int nthreads, long nblocks,
+                            pool_task fn, void *arg) {
+  pool_job job;
+  if (nblocks <= 0) return;
+  if (nthreads > POOL_MAX_THREADS) nthreads = POOL_MAX_THREADS;
+  if (nthreads > nblocks) nthreads = (int)nblocks;
+  if (nthreads < 1) nthreads = 1;
+  job.nthreads = nthreads;
+  job.nblocks = nblocks;
+  job.fn = fn;
+  job.arg = arg;
+#ifdef HAVE_RUBY_THREAD_H
+  rb_thread_call_without_gvl(pool_dispatch, &job, NULL, NULL);
+#else
+  pool_dispatch(&job);
+#endif
+}
+
+
+/* ROUNDS ------------------------------------------ */
+
+typedef void (*pool_round_task)(void *arg, long round, long block,
+                                int worker);
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t next_round;
+  int nthreads;                   /* threads taking part */
+  int done;                       /* threads through with this round */
+  long round, nrounds;
+  long next, nblocks;             /* next unclaimed block of the round */
+  pool_round_task fn;
+  void *arg;
+} pool_rounds;
+
+typedef struct {
+  pool_rounds *job;
+  int worker;
+} pool_round_worker;
+
+/* claims blocks of the current round until there are none left, then
+   waits for the others; the last one to arrive opens the next round */
+static inline void *pool_round_work(void *data) {
+  pool_round_worker *w = (pool_round_worker *)data;
+  pool_rounds *job = w->job;
+  pthread_mutex_lock(&job->lock);
+  while (job->round < job->nrounds) {
+    long round = job->round;
+    if (job->next < job->nblocks) {
+      long block = job->next++;
+      pthread_mutex_unlock(&job->lock);
+      job->fn(job->arg, round, block, w->worker);
+      pthread_mutex_lock(&job->lock);
+    } else if (++job->done == job->nthreads) {
+      job->done = 0;
+      job->next = 0;
+      job->round++;
+      pthread_cond_broadcast(&job->next_round);
+    } else {
+      while (job->round == round)
+        pthread_cond_wait(&job->next_round, &job->lock);
+    }
+  }
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+static inline void *pool_round_dispatch(void *data) {
+  pool_rounds *job = (pool_rounds *)data;
+  pthread_t threads[POOL_MAX_THREADS];
+  pool_round_worker workers[POOL_MAX_THREADS];
+  int t, started;
+  
+  for(t = 0; t < job->nthreads; t++) {
+    workers[t].job = job;
+    workers[t].worker = t;
+  }
+  /* the workers wait on the lock until it is known how many started */
+  pthread_mutex_lock(&job->lock);
+  for(started = 1; started < job->nthreads; started++) {
+    if (pthread_create(&threads[started], NULL, pool_round_work,
+                       &workers[started]) != 0)
+      break;
+  }
+  job->nthreads = started;
+  pthread_mutex_unlock(&job->lock);
+  pool_round_work(&workers[0]);
+  for(t = 1; t < started; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  return NULL;
+}
+
+/* the slots a <= b that block of round meets in a round-robin
+   tournament of nslots (even) slots: slot nslots - 1 stays put while
+   the others rotate, so every two slots meet in one of the first
+   nslots - 1 rounds, in blocks [0, nslots/2); the last round meets
+   every slot with itself. Returns 0 if the block has no pair. */
+static inline int pool_pairing(long nslots, long round, long block,
+                               long *a, long *b) {
+  if (round == nslots - 1) {
+    *a = *b = block;
+    return block < nslots;
+  }
+  if (block >= nslots/2) return 0;
+  if (block == 0) {
+    *a = round; *b = nslots - 1;
+  } else {
+    *a = (round + block) % (nslots - 1);
+    *b = (round - block + nslots - 1) % (nslots - 1);
+  }
+  if (*a > *b) { long c = *a; *a = *b; *b = c; }
+  return 1;
+}
+
+/* runs fn(arg, round, block, worker) for every block in [0, nblocks) of
+   every round in [0, nrounds), one round after the other */
+static inline void pool_run_rounds(int nthreads, long nrounds, long nblocks,
+                                   pool_round_task fn, void *arg) {
+  pool_rounds job;
+  if (nrounds <= 0 || nblocks <= 0) return;
+  if (nthreads > POOL_MAX_THREADS) nthreads = POOL_MAX_THREADS;
+  if (nthreads > nblocks) nthreads = (int)nblocks;
+  if (nthreads < 1) nthreads = 1;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.next_round, NULL);
+  job.nthreads = nthreads;
+  job.done = 0;
+  job.round = 0;
+  job.nrounds = nrounds;
+  job.next = 0;
+  job.nblocks = nblocks;
+  job.fn = fn;
+  job.arg = arg;
+#ifdef HAVE_RUBY_THREAD_H
+  rb_thread_call_without_gvl(pool_round_dispatch, &job, NULL, NULL);
+#else
+  pool_round_dispatch(&job);
+#endif
+  pthread_cond_destroy(&job.next_round);
+  pthread_mutex_destroy(&job.lock);
+}
+
+#endif
@@ -0,0 +1,122 @@
+/* simd.h -> the lane macros (V*) behind Tara's vectorized loops
+
+   The macros map onto AVX2 (4 doubles), SSE2 (2 doubles) or plain
+   scalar C, whichever the compiler was told it may use, so a loop is
+   written once for all three. Loads and stores may be unaligned.
+   VLT(a, b) is the lane mask of a < b, and VSELECT(c, a, b) takes the
+   lanes of a where c is set and those of b elsewhere.
+
+   The VF* macros are their single precision counterparts, twice as
+   wide (VFWIDTH = 2*VWIDTH, but 1 in scalar C). VFACC(lo, hi, a) adds
+   the lanes of a float vector into two double vectors, lanes
+   0..VWIDTH-1 into lo and the rest into hi, so float kernels can keep
+   their sums in double. VFRSQRT is the hardware estimate of 1/sqrt,
+   good to about 12 bits; one Newton step takes it to full float
+   precision. */
+
+#ifndef TARA_SIMD_H
+#define TARA_SIMD_H
+
+#include "math.h"
+
+#if defined(__AVX2__)
+#include "immintrin.h"
+#define VWIDTH 4
+typedef __m256d vdouble;
+#define VLOAD(p)       _mm256_loadu_pd(p)
+#define VSTORE(p, a)   _mm256_storeu_pd(p, a)
+#define VSET1(a)       _mm256_set1_pd(a)
+#define VADD(a, b)     _mm256_add_pd(a, b)
+#define VSUB(a, b)     _mm256_sub_pd(a, b)
+#define VMUL(a, b)     _mm256_mul_pd(a, b)
+#define VDIV(a, b)     _mm256_div_pd(a, b)
+#define VSQRT(a)       _mm256_sqrt_pd(a)
+#define VMIN(a, b)     _mm256_min_pd(a, b)
+#define VMAX(a, b)     _mm256_max_pd(a, b)
+#define VPOSITIVE(a, b) \
+  _mm256_and_pd(_mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_GT_OQ), b)
+#define VLT(a, b)      _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define VSELECT(c, a, b) _mm256_blendv_pd(b, a, c)
+static inline double vsum(vdouble a) {
+  __m128d lo = _mm256_castpd256_pd128(a);
+  __m128d hi = _mm256_extractf128_pd(a, 1);
+  lo = _mm_add_pd(lo, hi);
+  return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+#define VFWIDTH 8
+typedef __m256 vfloat;
+#define VFLOAD(p)      _mm256_loadu_ps(p)
+#define VFSET1(a)      _mm256_set1_ps(a)
+#define VFADD(a, b)    _mm256_add_ps(a, b)
+#define VFSUB(a, b)    _mm256_sub_ps(a, b)
+#define VFMUL(a, b)    _mm256_mul_ps(a, b)
+#define VFRSQRT(a)     _mm256_rsqrt_ps(a)
+#define VFPOSITIVE(a, b) \
+  _mm256_and_ps(_mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_GT_OQ), b)
+#define VFACC(lo, hi, a) do { \
+    lo = _mm256_add_pd(lo, _mm256_cvtps_pd(_mm256_castps256_ps128(a))); \
+    hi = _mm256_add_pd(hi, _mm256_cvtps_pd(_mm256_extractf128_ps(a, 1))); \
+  } while (0)
+#elif defined(__SSE2__)
+#include "emmintrin.h"
+#define VWIDTH 2
+typedef __m128d vdouble;
+#define VLOAD(p)       _mm_loadu_pd(p)
+#define VSTORE(p, a)   _mm_storeu_pd(p, a)
+#define VSET1(a)       _mm_set1_pd(a)
+#define VADD(a, b)     _mm_add_pd(a, b)
+#define VSUB(a, b)     _mm_sub_pd(a, b)
+#define VMUL(a, b)     _mm_mul_pd(a, b)
+#define VDIV(a, b)     _mm_div_pd(a, b)
+#define VSQRT(a)       _mm_sqrt_pd(a)
+#define VMIN(a, b)     _mm_min_pd(a, b)
+#define VMAX(a, b)     _mm_max_pd(a, b)
+#define VPOSITIVE(a, b) _mm_and_pd(_mm_cmpgt_pd(a, _mm_setzero_pd()), b)
+#define VLT(a, b)      _mm_cmplt_pd(a, b)
+#define VSELECT(c, a, b) _mm_or_pd(_mm_and_pd(c, a), _mm_andnot_pd(c, b))
+static inline double vsum(vdouble a) {
+  return _mm_cvtsd_f64(_mm_add_sd(a, _mm_unpackhi_pd(a, a)));
+}
+#define VFWIDTH 4
+typedef __m128 vfloat;
+#define VFLOAD(p)      _mm_loadu_ps(p)
+#define VFSET1(a)      _mm_set1_ps(a)
+#define VFADD(a, b)    _mm_add_ps(a, b)
+#define VFSUB(a, b)    _mm_sub_ps(a, b)
+#define VFMUL(a, b)    _mm_mul_ps(a, b)
+#define VFRSQRT(a)     _mm_rsqrt_ps(a)
+#define VFPOSITIVE(a, b) _mm_and_ps(_mm_cmpgt_ps(a, _mm_setzero_ps()), b)
+#define VFACC(lo, hi, a) do { \
+    lo = _mm_add_pd(lo, _mm_cvtps_pd(a)); \
+    hi = _mm_add_pd(hi, _mm_cvtps_pd(_mm_movehl_ps(a, a))); \
+  } while (0)
+#else
+#define VWIDTH 1
+typedef double vdouble;
+#define VLOAD(p)       (*(p))
+#define VSTORE(p, a)   (*(p) = (a))
+#define VSET1(a)       (a)
+#define VADD(a, b)     ((a) + (b))
+#define VSUB(a, b)     ((a) - (b))
+#define VMUL(a, b)     ((a) * (b))
+#define VDIV(a, b)     ((a) / (b))
+#define VSQRT(a)       sqrt(a)
+#define VMIN(a, b)     ((a) < (b) ? (a) : (b))
+#define VMAX(a, b)     ((a) > (b) ? (a) : (b))
+#define VPOSITIVE(a, b) ((a) > 0.0 ? (b) : 0.0)
+#define VLT(a, b)      ((a) < (b))
+#define VSELECT(c, a, b) ((c) ? (a) : (b))
+#define vsum(a)        (a)
+#define VFWIDTH 1
+typedef float vfloat;
+#define VFLOAD(p)      (*(p))
+#define VFSET1(a)      (a)
+#define VFADD(a, b)    ((a) + (b))
+#define VFSUB(a, b)    ((a) - (b))
+#define VFMUL(a, b)    ((a) * (b))
+#define VFRSQRT(a)     (1.0f/sqrtf(a))
+#define VFPOSITIVE(a, b) ((a) > 0.0f ? (b) : 0.0f)
+#define VFACC(lo, hi, a) ((lo) += (double)(a))
+#endif
+
+#endif
@@ -0,0 +1,22 @@
+/* vector_array.h -> a packed array of 3-vectors, shared by the vector
+                     extension that defines VectorArray and the
+                     extensions that fill one
+
+   The n vectors lie in a single aligned buffer of 3n doubles, x y z of
+   vector 0 first, then vector 1, and so on. */
+
+#ifndef TARA_VECTOR_ARRAY_H
+#define TARA_VECTOR_ARRAY_H
+
+#include "ruby.h"
+
+#define GET_ARRAY(val, p) Data_Get_Struct(val, VectorArray, p)
+
+typedef struct {
+  double *data;     /* 3*n doubles */
+  long n;
+} VectorArray;
+
+void Init_vector_array();
+
+#endif
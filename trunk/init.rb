@@ -1,11 +1,12 @@
 #!/usr/bin/env ruby
 
-# sets up the files
-dirs = ["pairwise/", "tree/", "vector/"]
+# sets up the files; the arguments go on to every extconf.rb, e.g.
+# --with-native to build for the SIMD of this host only
+dirs = ["pairwise/", "c_tree/", "vector/", "particles/", "c_thd/", "domain/"]
 dirs.each do |dir|
   Dir.chdir(dir)
   puts "creating extensions in #{dir}"
-  `ruby extconf.rb`
+  `ruby extconf.rb #{ARGV.join(' ')}`
   puts `make`
   Dir.chdir("..")
 end
\ No newline at end of file
@@ -1,2 +1,13 @@
 require('mkmf')
+$CPPFLAGS << ' -I../include'
+$CFLAGS << ' -O3'
+# the kernels in include/kernel.h use SSE2, which every x86-64 has; with
+# --with-native (ruby init.rb --with-native) they use the widest SIMD of
+# the build host, and the extension only runs on hosts that have it too
+if with_config('native', false) &&
+   try_compile('int main() { return 0; }', '-march=native')
+  $CFLAGS << ' -march=native'
+end
+have_header('ruby/thread.h')
+have_library('pthread')
 create_makefile('pairwise')
@@ -1,14 +1,21 @@
 #include "stdio.h"
 #include "ruby.h"
 #include "math.h"
+#include "particles.h"
+#include "kernel.h"
+#include "pool.h"
 
 #define GET_VEC(val,p) Data_Get_Struct(val, Vector, p)
+#define J_BLOCK 1024
+#define I_BLOCK 64
 typedef struct {
   double vec[3];
 } Vector;
 
+static VALUE cVector;
+
 static VALUE get_new_vector() {
-  return rb_eval_string("Vector.new");
+  return rb_obj_alloc(cVector);
 }
 
 static VALUE pairwise_acc( VALUE self, VALUE b, VALUE other_body, 
@@ -35,7 +42,7 @@ static VALUE pairwise_acc( VALUE self, VALUE b, VALUE other_body,
 static VALUE pairwise_potential(VALUE self, VALUE mass, VALUE other_mass,
   VALUE pos, VALUE other_pos, VALUE eps) {
   Vector *p; GET_VEC(pos, p);
-  Vector *op; GET_VEC(other_pos, p);
+  Vector *op; GET_VEC(other_pos, op);
   double fmass = NUM2DBL(mass);
   double fother_mass = NUM2DBL(other_mass);
   double feps = NUM2DBL(eps);
@@ -45,16 +52,246 @@ static VALUE pairwise_potential(VALUE self, VALUE mass, VALUE other_mass,
   double r1 = op->vec[1] - p->vec[1];
   double r2 = op->vec[2] - p->vec[2];
   
-  epot = (-fmass*fother_mass)/sqrt(r0*r0 + r1*r1 + r2*r2 + eps*eps);
+  epot = (-fmass*fother_mass)/sqrt(r0*r0 + r1*r1 + r2*r2 + feps*feps);
   return rb_float_new(epot);
 }
 
+typedef struct {
+  Particles *s;
+  Kernel k;
+  long tile, ntiles;  /* the blocks of the threaded symmetric pass */
+} DirectJob;
+
+/* adds the pull of every particle on row i, and its potential if the
+   pass asks for it */
+static void gather_row(const Kernel *k, Particles *s, long i) {
+  k->gather(k, s->x[i], s->y[i], s->z[i], s->x, s->y, s->z, s->mass,
+            s->n, &s->ax[i], &s->ay[i], &s->az[i],
+            s->pot != NULL ? &s->pot[i] : NULL);
+}
+
+/* single-threaded pass: each pair is visited once (Newton's third law),
+   and the j-loop is blocked so that a tile of sources stays in cache
+   while every i is swept over it */
+static void direct_symmetric_task(void *arg, long block, int worker) {
+  DirectJob *job = (DirectJob *)arg;
+  Particles *s = job->s;
+  long n = s->n, i, jb;
+  for(jb = 0; jb < n; jb += J_BLOCK) {
+    long j1 = (jb + J_BLOCK < n) ? jb + J_BLOCK : n;
+    for(i = 0; i < j1 - 1; i++) {
+      kernel_symmetric(&job->k, s, i, jb, j1);
+    }
+  }
+}
+
+/* threaded pass, still once per pair: the store is cut into an even
+   number of blocks, and a tile pairs the rows of two blocks (or those
+   of one block among themselves). A round of pool_run_rounds only runs
+   tiles that share no block, so no two workers ever write the same
+   acceleration, and the sums come out in the same order whichever
+   worker runs a tile. The rounds pair the blocks as in a round-robin
+   tournament (pool_pairing). */
+static void direct_tile_task(void *arg, long round, long block,
+                             int worker) {
+  DirectJob *job = (DirectJob *)arg;
+  Particles *s = job->s;
+  long a, b, a0, a1, b0, b1, i;
+  if (!pool_pairing(job->ntiles, round, block, &a, &b)) return;
+  a0 = a*job->tile; b0 = b*job->tile;
+  /* the block that makes an odd count even is empty */
+  if (b0 >= s->n) return;
+  a1 = (a0 + job->tile < s->n) ? a0 + job->tile : s->n;
+  b1 = (b0 + job->tile < s->n) ? b0 + job->tile : s->n;
+  for(i = a0; i < a1; i++) {
+    kernel_symmetric(&job->k, s, i, b0, b1);
+  }
+}
+
+/* active pass: every worker owns a block of the active set and sums
+   over all j */
+static void direct_active_task(void *arg, long block, int worker) {
+  DirectJob *job = (DirectJob *)arg;
+  Particles *s = job->s;
+  long q0 = block*I_BLOCK, q1 = q0 + I_BLOCK, q;
+  if (q1 > s->nactive) q1 = s->nactive;
+  for(q = q0; q < q1; q++) {
+    long i = s->where[s->active[q]];
+    s->ax[i] = s->ay[i] = s->az[i] = 0.0;
+    if (kernel_potential(s)) s->pot[i] = 0.0;
+    gather_row(&job->k, s, i);
+  }
+}
+
+/* computes the acceleration of every particle in the store in a single
+   native pass, spread over the store's worker threads. With active,
+   only the particles of the store's active set get new accelerations.
+   If the store asks for potentials, they come out of the same pass. */
+static VALUE all_accelerations(int argc, VALUE *argv, VALUE self) {
+  VALUE store, l_eps, active;
+  Particles *s;
+  DirectJob job;
+  double *saved = NULL;
+  long n;
+  
+  rb_scan_args(argc, argv, "21", &store, &l_eps, &active);
+  GET_STORE(store, s);
+  n = s->n;
+  job.s = s;
+  kernel_select(&job.k, s, NUM2DBL(l_eps), kernel_potential(s));
+  if (kernel_potential_only(s)) saved = particles_save_acc(s);
+  if (RTEST(active)) {
+    pool_run(s->threads, (s->nactive + I_BLOCK - 1)/I_BLOCK,
+             direct_active_task, &job);
+    if (saved != NULL) particles_restore_acc(s, saved);
+    return store;
+  }
+  memset(s->ax, 0, n*sizeof(double));
+  memset(s->ay, 0, n*sizeof(double));
+  memset(s->az, 0, n*sizeof(double));
+  if (kernel_potential(s)) memset(s->pot, 0, n*sizeof(double));
+  if (s->threads > 1) {
+    /* tiles small enough that every round has four for each worker,
+       but no larger than the cache blocking of the single pass */
+    job.tile = (n + 8*s->threads - 1)/(8*s->threads);
+    if (job.tile > J_BLOCK) job.tile = J_BLOCK;
+    if (job.tile < I_BLOCK) job.tile = I_BLOCK;
+    job.ntiles = (n + job.tile - 1)/job.tile;
+    job.ntiles += job.ntiles % 2;
+    pool_run_rounds(s->threads, job.ntiles, job.ntiles, direct_tile_task,
+                    &job);
+  } else {
+    pool_run(1, 1, direct_symmetric_task, &job);
+  }
+  if (saved != NULL) particles_restore_acc(s, saved);
+  return store;
+}
+
+/* every worker owns a block of i and sums acceleration and jerk over
+   all j */
+static void jerk_block_task(void *arg, long block, int worker) {
+  DirectJob *job = (DirectJob *)arg;
+  Particles *s = job->s;
+  long i0 = block*I_BLOCK, i1 = i0 + I_BLOCK, i;
+  if (i1 > s->n) i1 = s->n;
+  for(i = i0; i < i1; i++) {
+    double p[3], v[3], a[3] = {0.0, 0.0, 0.0}, jerk[3] = {0.0, 0.0, 0.0};
+    p[0] = s->x[i]; p[1] = s->y[i]; p[2] = s->z[i];
+    v[0] = s->vx[i]; v[1] = s->vy[i]; v[2] = s->vz[i];
+    job->k.jerk(&job->k, p, v, s->x, s->y, s->z, s->vx, s->vy, s->vz,
+                s->mass, s->n, a, jerk);
+    s->ax[i] = a[0]; s->ay[i] = a[1]; s->az[i] = a[2];
+    s->jx[i] = jerk[0]; s->jy[i] = jerk[1]; s->jz[i] = jerk[2];
+  }
+}
 
+static void acc_jerk(Particles *s, double eps) {
+  DirectJob job;
+  job.s = s;
+  kernel_select(&job.k, s, eps, FALSE);
+  particles_jerks(s);
+  pool_run(s->threads, (s->n + I_BLOCK - 1)/I_BLOCK, jerk_block_task, &job);
+}
+
+/* computes the acceleration and the jerk of every particle in one
+   direct pass */
+static VALUE all_jerks(VALUE self, VALUE store, VALUE l_eps) {
+  Particles *s; GET_STORE(store, s);
+  acc_jerk(s, NUM2DBL(l_eps));
+  return store;
+}
+
+/* one step of the fourth-order Hermite scheme: predicts positions and
+   velocities from acceleration and jerk, computes both again at the
+   predicted state and corrects with
+
+     v1 = v0 + (a0 + a1) dt/2 + (j0 - j1) dt^2/12
+     x1 = x0 + (v0 + v1) dt/2 + (a0 - a1) dt^2/12
+
+   The store must already hold the accelerations and jerks of the
+   current state (all_jerks). */
+static VALUE hermite_step(VALUE self, VALUE store, VALUE l_dt,
+                          VALUE l_eps) {
+  Particles *s; GET_STORE(store, s);
+  double dt = NUM2DBL(l_dt), eps = NUM2DBL(l_eps);
+  double dt2 = dt*dt/2, dt3 = dt*dt*dt/6, dt12 = dt*dt/12;
+  double *x0, *v0, *a0, *j0;
+  double *x[3], *v[3], *a[3], *jerk[3];
+  long i, n = s->n;
+  int k;
+  
+  particles_jerks(s);
+  x[0] = s->x; x[1] = s->y; x[2] = s->z;
+  v[0] = s->vx; v[1] = s->vy; v[2] = s->vz;
+  a[0] = s->ax; a[1] = s->ay; a[2] = s->az;
+  jerk[0] = s->jx; jerk[1] = s->jy; jerk[2] = s->jz;
+  x0 = ALLOC_N(double, 12*(n > 0 ? n : 1));
+  v0 = x0 + 3*n; a0 = v0 + 3*n; j0 = a0 + 3*n;
+  for(k = 0; k < 3; k++) {
+    memcpy(x0 + k*n, x[k], n*sizeof(double));
+    memcpy(v0 + k*n, v[k], n*sizeof(double));
+    memcpy(a0 + k*n, a[k], n*sizeof(double));
+    memcpy(j0 + k*n, jerk[k], n*sizeof(double));
+    for(i = 0; i < n; i++) {
+      x[k][i] += dt*v[k][i] + dt2*a[k][i] + dt3*jerk[k][i];
+      v[k][i] += dt*a[k][i] + dt2*jerk[k][i];
+    }
+  }
+  
+  acc_jerk(s, eps);
+  
+  for(k = 0; k < 3; k++) {
+    for(i = 0; i < n; i++) {
+      long at = k*n + i;
+      v[k][i] = v0[at] + 0.5*dt*(a0[at] + a[k][i]) +
+                dt12*(j0[at] - jerk[k][i]);
+      x[k][i] = x0[at] + 0.5*dt*(v0[at] + v[k][i]) +
+                dt12*(a0[at] - a[k][i]);
+    }
+  }
+  xfree(x0);
+  return store;
+}
+
+/* every worker owns a block of i and sums the potential over all j;
+   the accelerations are left alone */
+static void potential_block_task(void *arg, long block, int worker) {
+  DirectJob *job = (DirectJob *)arg;
+  Particles *s = job->s;
+  long i0 = block*I_BLOCK, i1 = i0 + I_BLOCK, i;
+  if (i1 > s->n) i1 = s->n;
+  for(i = i0; i < i1; i++) {
+    double ax = 0.0, ay = 0.0, az = 0.0;
+    s->pot[i] = 0.0;
+    job->k.gather(&job->k, s->x[i], s->y[i], s->z[i], s->x, s->y, s->z,
+                  s->mass, s->n, &ax, &ay, &az, &s->pot[i]);
+  }
+}
+
+/* computes the exact potential of every particle by direct summation,
+   without touching the accelerations */
+static VALUE all_potentials(VALUE self, VALUE store, VALUE l_eps) {
+  Particles *s; GET_STORE(store, s);
+  DirectJob job;
+  job.s = s;
+  kernel_select(&job.k, s, NUM2DBL(l_eps), TRUE);
+  particles_potentials(s);
+  pool_run(s->threads, (s->n + I_BLOCK - 1)/I_BLOCK, potential_block_task,
+           &job);
+  return store;
+}
 
 VALUE mSpeedUp;
 void Init_pairwise() {
+  rb_require("vector/vector");
+  cVector = rb_const_get(rb_cObject, rb_intern("Vector"));
   mSpeedUp = rb_define_module("SpeedUp");
   rb_define_module_function(mSpeedUp, "pairwise_acc", pairwise_acc, 4);
   rb_define_module_function(mSpeedUp, "get_potential_energy",
                             pairwise_potential, 5);
+  rb_define_module_function(mSpeedUp, "all_accelerations",
+                            all_accelerations, -1);
+  rb_define_module_function(mSpeedUp, "all_jerks", all_jerks, 2);
+  rb_define_module_function(mSpeedUp, "all_potentials", all_potentials, 2);
+  rb_define_module_function(mSpeedUp, "hermite_step", hermite_step, 3);
 }
\ No newline at end of file
@@ -0,0 +1,6 @@
+require 'mkmf'
+$CPPFLAGS << ' -I../include'
+# the trajectory writer (output.c) runs in its own thread
+have_header('ruby/thread.h')
+have_library('pthread')
+create_makefile('particles')
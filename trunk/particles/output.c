@@ -0,0 +1,477 @@
+/* output.c -> formats trajectory frames natively and writes them from a
+               background thread (see output.h) */
+
+#include "stdio.h"
+#include "errno.h"
+#include "unistd.h"
+#include "ruby.h"
+#include "particles.h"
+#include "output.h"
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+
+#define GET_WRITER(val, p) Data_Get_Struct(val, Writer, p)
+/* longest "x y z\n" line: three %.17g numbers and their separators */
+#define LINE_SIZE 80
+
+VALUE cTrajectoryWriter;
+static ID id_fileno, id_flush;
+
+/* FORMATTING ------------------------------- */
+
+/* the shortest of %.15g .. %.17g that reads back as v */
+static int format_double(char *p, double v) {
+  int len = 0, prec;
+  for(prec = 15; prec <= 17; prec++) {
+    len = sprintf(p, "%.*g", prec, v);
+    if (strtod(p, NULL) == v) break;
+  }
+  return len;
+}
+
+/* the formatting runs in the writer thread, so running out of memory
+   is reported through the error field */
+static int buffer_reserve(OutputBuffer *b, size_t size) {
+  if (size > b->size) {
+    char *data = (char *)realloc(b->data, size);
+    if (data == NULL) return ENOMEM;
+    b->data = data;
+    b->size = size;
+  }
+  return 0;
+}
+
+/* one "x y z" (or "x y z vx vy vz") line per particle */
+static int format_text(Writer *w, OutputBuffer *b) {
+  char *p;
+  const double *v = b->values;
+  int k, columns = (w->flags & TRAJECTORY_VELOCITIES) ? 6 : 3;
+  long i, n = b->n;
+  if (buffer_reserve(b, n*columns/3*LINE_SIZE) != 0) return ENOMEM;
+  p = b->data;
+  for(i = 0; i < n; i++) {
+    for(k = 0; k < columns; k++) {
+      p += format_double(p, *v++);
+      *p++ = (k == columns - 1) ? '\n' : ' ';
+    }
+  }
+  b->len = p - b->data;
+  return 0;
+}
+
+/* a binary frame (see output.h), preceded by the file header if it is
+   the first one */
+static int format_binary(Writer *w, OutputBuffer *b) {
+  char *p;
+  int k, columns = (w->flags & TRAJECTORY_VELOCITIES) ? 6 : 3;
+  long i, n = b->n;
+  size_t frame = trajectory_frame_size(n, w->flags);
+  size_t header = (w->offset == 0) ? sizeof(TrajectoryHeader) : 0;
+  if (buffer_reserve(b, header + frame) != 0) return ENOMEM;
+  memset(b->data, 0, header + frame);
+  p = b->data;
+  if (header) {
+    TrajectoryHeader *h = (TrajectoryHeader *)p;
+    memcpy(h->magic, TRAJECTORY_MAGIC, 8);
+    h->version = TRAJECTORY_VERSION;
+    h->byte_order = TRAJECTORY_BYTE_ORDER;
+    h->n = n;
+    h->flags = w->flags;
+    p += header;
+  }
+  memcpy(p, &b->time, sizeof(double));
+  p += sizeof(double);
+  /* the copies are interleaved per particle, the frame is column-wise */
+  for(k = 0; k < columns; k++) {
+    const double *v = b->values + k;
+    if (w->flags & TRAJECTORY_FLOAT32) {
+      float *col = (float *)p + k*n;
+      for(i = 0; i < n; i++, v += columns) {
+        col[i] = (float)*v;
+      }
+    }
+    else {
+      double *col = (double *)p + k*n;
+      for(i = 0; i < n; i++, v += columns) {
+        col[i] = *v;
+      }
+    }
+  }
+  b->len = header + frame;
+  return 0;
+}
+
+static int write_fully(int fd, const char *data, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t k = write(fd, data + done, len - done);
+    if (k < 0) {
+      if (errno != EINTR) return errno;
+    }
+    else done += k;
+  }
+  return 0;
+}
+
+/* records where the frame in b went; runs in the writer thread */
+static int add_to_index(Writer *w, OutputBuffer *b) {
+  long k = w->frames_written;
+  if (k == w->index_size) {
+    long size = w->index_size ? 2*w->index_size : 256;
+    uint64_t *offsets = (uint64_t *)realloc(w->offsets,
+                                            size*sizeof(uint64_t));
+    double *times;
+    if (offsets == NULL) return ENOMEM;
+    w->offsets = offsets;
+    times = (double *)realloc(w->times, size*sizeof(double));
+    if (times == NULL) return ENOMEM;
+    w->times = times;
+    w->index_size = size;
+  }
+  w->offsets[k] = w->offset + b->len - trajectory_frame_size(b->n, w->flags);
+  w->times[k] = b->time;
+  return 0;
+}
+
+/* WRITER THREAD ---------------------------- */
+static void *writer_thread(void *data) {
+  Writer *w = (Writer *)data;
+  while (1) {
+    OutputBuffer *b;
+    int error;
+    pthread_mutex_lock(&w->lock);
+    while (w->count == 0 && !w->closing) {
+      pthread_cond_wait(&w->ready, &w->lock);
+    }
+    if (w->count == 0) {
+      pthread_mutex_unlock(&w->lock);
+      break;
+    }
+    b = &w->buffers[w->head];
+    error = w->error;
+    pthread_mutex_unlock(&w->lock);
+    /* after a failed write the frames are dropped, the error is raised
+       on the Ruby side (error is only shared under the lock) */
+    if (error == 0) {
+      if (w->format == FORMAT_BINARY) {
+        error = format_binary(w, b);
+        if (error == 0) error = add_to_index(w, b);
+      }
+      else error = format_text(w, b);
+    }
+    if (error == 0) error = write_fully(w->fd, b->data, b->len);
+    if (error == 0) {
+      w->offset += b->len;
+      w->frames_written++;
+    }
+    pthread_mutex_lock(&w->lock);
+    w->error = error;
+    w->head = (w->head + 1) % OUTPUT_BUFFERS;
+    w->count--;
+    pthread_cond_signal(&w->done);
+    pthread_mutex_unlock(&w->lock);
+  }
+  return NULL;
+}
+
+/* waits until at most max buffers are queued */
+typedef struct {
+  Writer *w;
+  int max;
+} WaitJob;
+
+static void *wait_for_writer(void *data) {
+  WaitJob *job = (WaitJob *)data;
+  Writer *w = job->w;
+  pthread_mutex_lock(&w->lock);
+  while (w->count > job->max) {
+    pthread_cond_wait(&w->done, &w->lock);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+static void writer_wait(Writer *w, int max) {
+  WaitJob job;
+  job.w = w;
+  job.max = max;
+#ifdef HAVE_RUBY_THREAD_H
+  rb_thread_call_without_gvl(wait_for_writer, &job, NULL, NULL);
+#else
+  wait_for_writer(&job);
+#endif
+}
+
+/* raises the error of the writer thread, if there was one; the thread
+   may still be running, so the error is copied under the lock */
+static void check_error(Writer *w) {
+  int error;
+  pthread_mutex_lock(&w->lock);
+  error = w->error;
+  pthread_mutex_unlock(&w->lock);
+  if (error != 0)
+    rb_raise(rb_eIOError, "ERROR: trajectory output failed: %s",
+             strerror(error));
+}
+
+/* appends the frame index to a binary trajectory */
+static int write_index(Writer *w) {
+  TrajectoryFooter footer;
+  long frames = w->frames_written;
+  int error = 0;
+  if (w->offset == 0) {
+    /* no frame at all, there still has to be a header */
+    TrajectoryHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRAJECTORY_MAGIC, 8);
+    h.version = TRAJECTORY_VERSION;
+    h.byte_order = TRAJECTORY_BYTE_ORDER;
+    h.flags = w->flags;
+    error = write_fully(w->fd, (const char *)&h, sizeof(h));
+    w->offset = sizeof(h);
+  }
+  memset(&footer, 0, sizeof(footer));
+  memcpy(footer.magic, TRAJECTORY_INDEX_MAGIC, 8);
+  footer.frames = frames;
+  footer.index_offset = w->offset + 8;
+  if (error == 0)
+    error = write_fully(w->fd, TRAJECTORY_INDEX_MAGIC, 8);
+  if (error == 0 && frames > 0)
+    error = write_fully(w->fd, (const char *)w->offsets,
+                        frames*sizeof(uint64_t));
+  if (error == 0 && frames > 0)
+    error = write_fully(w->fd, (const char *)w->times,
+                        frames*sizeof(double));
+  if (error == 0)
+    error = write_fully(w->fd, (const char *)&footer, sizeof(footer));
+  return error;
+}
+
+/* flushes everything, stops the thread, finishes a binary trajectory
+   with its index and closes the descriptor */
+static void writer_stop(Writer *w) {
+  if (!w->running) return;
+  pthread_mutex_lock(&w->lock);
+  w->closing = 1;
+  pthread_cond_signal(&w->ready);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+  /* the thread is gone, the error is this thread's alone again */
+  if (w->format == FORMAT_BINARY && w->error == 0)
+    w->error = write_index(w);
+  close(w->fd);
+  w->running = 0;
+}
+
+/* ALLOCATION METHODS ----------------------- */
+static void writer_free(Writer *w) {
+  int k;
+  writer_stop(w);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->ready);
+  pthread_cond_destroy(&w->done);
+  for(k = 0; k < OUTPUT_BUFFERS; k++) {
+    xfree(w->buffers[k].values);
+    free(w->buffers[k].data);
+  }
+  free(w->offsets);
+  free(w->times);
+  xfree(w);
+}
+
+static VALUE writer_alloc(VALUE klass) {
+  Writer *w = ALLOC(Writer);
+  memset(w, 0, sizeof(Writer));
+  w->fd = -1;
+  w->n = -1;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->ready, NULL);
+  pthread_cond_init(&w->done, NULL);
+  return Data_Wrap_Struct(klass, 0, writer_free, w);
+}
+
+/* TrajectoryWriter.new(io, format='text', velocities=false) writes to
+   io's file descriptor, whatever io has buffered is flushed first.
+   format is 'text', 'binary' or 'binary32' (binary with floats) */
+static VALUE writer_initialize(int argc, VALUE *argv, VALUE self) {
+  Writer *w; GET_WRITER(self, w);
+  VALUE io, format, velocities;
+  int fd;
+  rb_scan_args(argc, argv, "12", &io, &format, &velocities);
+  if (NIL_P(format) || strcmp(StringValueCStr(format), "text") == 0)
+    w->format = FORMAT_TEXT;
+  else if (strcmp(StringValueCStr(format), "binary") == 0)
+    w->format = FORMAT_BINARY;
+  else if (strcmp(StringValueCStr(format), "binary32") == 0) {
+    w->format = FORMAT_BINARY;
+    w->flags |= TRAJECTORY_FLOAT32;
+  }
+  else
+    rb_raise(rb_eArgError, "ERROR: unknown output format %s",
+             StringValueCStr(format));
+  if (RTEST(velocities)) w->flags |= TRAJECTORY_VELOCITIES;
+  rb_funcall(io, id_flush, 0);
+  fd = dup(NUM2INT(rb_funcall(io, id_fileno, 0)));
+  if (fd < 0) rb_sys_fail("dup");
+  w->fd = fd;
+  if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+    close(fd);
+    rb_raise(rb_eRuntimeError, "ERROR: could not start the writer thread");
+  }
+  w->running = 1;
+  return self;
+}
+
+/* copies the positions (and velocities) of every particle, in handle
+   order */
+static void copy_frame(Writer *w, OutputBuffer *b, const Particles *s,
+                       double time) {
+  double *v;
+  int columns = (w->flags & TRAJECTORY_VELOCITIES) ? 6 : 3;
+  long h, n = s->n;
+  if (n > b->capacity) {
+    REALLOC_N(b->values, double, columns*n);
+    b->capacity = n;
+  }
+  v = b->values;
+  for(h = 0; h < n; h++, v += columns) {
+    long i = s->where[h];
+    v[0] = s->x[i];
+    v[1] = s->y[i];
+    v[2] = s->z[i];
+    if (columns == 6) {
+      v[3] = s->vx[i];
+      v[4] = s->vy[i];
+      v[5] = s->vz[i];
+    }
+  }
+  b->n = n;
+  b->time = time;
+}
+
+/* WRITER METHODS --------------------------- */
+
+/* returns the next free buffer, waiting for one if necessary */
+static OutputBuffer *next_buffer(Writer *w) {
+  if (!w->running)
+    rb_raise(rb_eIOError, "ERROR: trajectory writer is closed");
+  check_error(w);
+  writer_wait(w, OUTPUT_BUFFERS - 1);
+  return &w->buffers[(w->head + w->count) % OUTPUT_BUFFERS];
+}
+
+static void queue_buffer(Writer *w) {
+  pthread_mutex_lock(&w->lock);
+  w->count++;
+  w->frames++;
+  pthread_cond_signal(&w->ready);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* queues the particles in store as the frame at time (0 if not given) */
+static VALUE writer_write(int argc, VALUE *argv, VALUE self) {
+  Writer *w; GET_WRITER(self, w);
+  VALUE store, time;
+  Particles *s;
+  rb_scan_args(argc, argv, "11", &store, &time);
+  GET_STORE(store, s);
+  if (w->format == FORMAT_BINARY) {
+    if (w->n < 0) w->n = s->n;
+    else if (w->n != s->n)
+      rb_raise(rb_eArgError, "ERROR: every frame of a binary trajectory "
+               "needs the same %ld particles", w->n);
+  }
+  copy_frame(w, next_buffer(w), s, NIL_P(time) ? 0.0 : NUM2DBL(time));
+  queue_buffer(w);
+  return self;
+}
+
+/* write_tagged(records, n, time=0) queues the frame of n particles
+   held in an array of packed records tag x y z (vx vy vz), one String
+   per process of a distributed run (see Domain.frame); every particle
+   goes where its tag puts it in handle order, and every tag 0...n must
+   be there once */
+static VALUE writer_write_tagged(int argc, VALUE *argv, VALUE self) {
+  Writer *w; GET_WRITER(self, w);
+  VALUE records, rb_n, time;
+  OutputBuffer *b;
+  int k, columns = (w->flags & TRAJECTORY_VELOCITIES) ? 6 : 3;
+  long q, n, count = 0;
+  char *seen;
+  rb_scan_args(argc, argv, "21", &records, &rb_n, &time);
+  Check_Type(records, T_ARRAY);
+  n = NUM2LONG(rb_n);
+  if (w->format == FORMAT_BINARY && w->n >= 0 && w->n != n)
+    rb_raise(rb_eArgError, "ERROR: every frame of a binary trajectory "
+             "needs the same %ld particles", w->n);
+  b = next_buffer(w);
+  if (n > b->capacity) {
+    REALLOC_N(b->values, double, columns*n);
+    b->capacity = n;
+  }
+  seen = ALLOC_N(char, n > 0 ? n : 1);
+  memset(seen, 0, n);
+  for(k = 0; k < RARRAY_LEN(records); k++) {
+    VALUE str = rb_ary_entry(records, k);
+    const double *r;
+    long m;
+    StringValue(str);
+    r = (const double *)RSTRING_PTR(str);
+    m = RSTRING_LEN(str)/((columns + 1)*sizeof(double));
+    for(q = 0; q < m; q++, r += columns + 1) {
+      long tag = (long)r[0];
+      if (tag < 0 || tag >= n || seen[tag]) {
+        xfree(seen);
+        rb_raise(rb_eArgError, "ERROR: particle %ld is not in a frame of "
+                 "%ld once", tag, n);
+      }
+      seen[tag] = 1;
+      memcpy(b->values + columns*tag, r + 1, columns*sizeof(double));
+    }
+    count += m;
+  }
+  xfree(seen);
+  if (count != n)
+    rb_raise(rb_eArgError, "ERROR: %ld of the %ld particles of a frame",
+             count, n);
+  if (w->format == FORMAT_BINARY && w->n < 0) w->n = n;
+  b->n = n;
+  b->time = NIL_P(time) ? 0.0 : NUM2DBL(time);
+  queue_buffer(w);
+  return self;
+}
+
+/* waits until every queued frame has been written */
+static VALUE writer_flush(VALUE self) {
+  Writer *w; GET_WRITER(self, w);
+  if (w->running) writer_wait(w, 0);
+  check_error(w);
+  return self;
+}
+
+static VALUE writer_close(VALUE self) {
+  Writer *w; GET_WRITER(self, w);
+  writer_stop(w);
+  check_error(w);
+  return Qnil;
+}
+
+static VALUE writer_frames(VALUE self) {
+  Writer *w; GET_WRITER(self, w);
+  return LONG2NUM(w->frames);
+}
+
+void Init_output() {
+  id_fileno = rb_intern("fileno");
+  id_flush = rb_intern("flush");
+  cTrajectoryWriter = rb_define_class("TrajectoryWriter", rb_cObject);
+  rb_define_alloc_func(cTrajectoryWriter, writer_alloc);
+  rb_define_method(cTrajectoryWriter, "initialize", writer_initialize, -1);
+  rb_define_method(cTrajectoryWriter, "write", writer_write, -1);
+  rb_define_method(cTrajectoryWriter, "write_tagged", writer_write_tagged,
+                   -1);
+  rb_define_method(cTrajectoryWriter, "flush", writer_flush, 0);
+  rb_define_method(cTrajectoryWriter, "close", writer_close, 0);
+  rb_define_method(cTrajectoryWriter, "frames", writer_frames, 0);
+}
@@ -0,0 +1,107 @@
+/* output.h -> the asynchronous trajectory writer
+
+   A TrajectoryWriter owns a small ring of frame buffers and a pthread
+   that drains them into a file descriptor. The integrator only copies
+   the positions of a frame into the next free buffer and queues it; the
+   writer thread formats the text and writes it. Only when every buffer
+   is still waiting does the integrator block (without the GVL) until
+   the writer thread catches up.
+
+   Frames are written either as text, one "x y z" (or "x y z vx vy vz")
+   line per particle, or as a binary trajectory:
+
+     TrajectoryHeader
+     frame 0, frame 1, ...
+     TRAJECTORY_INDEX_MAGIC
+     the frame index: offset of every frame (uint64), then its time
+     (double)
+     TrajectoryFooter
+
+   Every binary frame has the same layout: the time as a double, then
+   the columns x, y, z (and vx, vy, vz) of n values each, in handle
+   order, as doubles or, with TRAJECTORY_FLOAT32, as floats; a frame is
+   padded to a multiple of 8 bytes. The index is only written when the
+   writer is closed. A trajectory without one (an interrupted run) can
+   still be read, since every frame has the same size; the magic in
+   front of the index tells where the frames end if only the footer is
+   missing. */
+
+#ifndef TARA_OUTPUT_H
+#define TARA_OUTPUT_H
+
+#include "stdint.h"
+#include "pthread.h"
+#include "ruby.h"
+#include "particles.h"
+
+#define OUTPUT_BUFFERS 3
+
+#define TRAJECTORY_MAGIC "TARATRAJ"
+#define TRAJECTORY_INDEX_MAGIC "TARAINDX"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_BYTE_ORDER 0x01020304
+#define TRAJECTORY_FLOAT32 1
+#define TRAJECTORY_VELOCITIES 2
+
+#define FORMAT_TEXT 0
+#define FORMAT_BINARY 1
+
+typedef struct {
+  char magic[8];          /* TRAJECTORY_MAGIC, not terminated */
+  uint32_t version;       /* TRAJECTORY_VERSION of the writer */
+  uint32_t byte_order;    /* TRAJECTORY_BYTE_ORDER as the writer saw it */
+  int64_t n;              /* particles in every frame */
+  uint32_t flags;         /* TRAJECTORY_FLOAT32 | TRAJECTORY_VELOCITIES */
+  uint32_t reserved;
+} TrajectoryHeader;
+
+typedef struct {
+  char magic[8];          /* TRAJECTORY_INDEX_MAGIC, not terminated */
+  uint64_t frames;
+  uint64_t index_offset;  /* of the offsets, from the start of the file */
+} TrajectoryFooter;
+
+/* bytes taken by one binary frame */
+static inline size_t trajectory_frame_size(int64_t n, uint32_t flags) {
+  size_t value = (flags & TRAJECTORY_FLOAT32) ? sizeof(float)
+                                              : sizeof(double);
+  size_t columns = (flags & TRAJECTORY_VELOCITIES) ? 6 : 3;
+  return sizeof(double) + (columns*n*value + 7)/8*8;
+}
+
+typedef struct {
+  double time;
+  double *values;         /* x y z (vx vy vz) of every particle, in
+                             handle order */
+  long n, capacity;       /* particles in the frame, room in values */
+  char *data;             /* the formatted frame */
+  size_t len, size;
+} OutputBuffer;
+
+typedef struct {
+  int fd;                 /* private dup of the output's descriptor */
+  int running;            /* writer thread started and not joined */
+  int closing;            /* no more frames, writer exits when drained */
+  int error;              /* errno of the first failed write, or 0 */
+  int format;             /* FORMAT_TEXT or FORMAT_BINARY */
+  uint32_t flags;         /* TRAJECTORY_FLOAT32, TRAJECTORY_VELOCITIES */
+  long n;                 /* particles per binary frame, -1 before the
+                             first one */
+  uint64_t offset;        /* bytes written so far */
+  uint64_t *offsets;      /* the frame index, kept by the writer thread */
+  double *times;
+  long index_size;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;   /* a buffer was queued, or closing was set */
+  pthread_cond_t done;    /* a buffer was written */
+  OutputBuffer buffers[OUTPUT_BUFFERS];
+  int head, count;        /* ring of queued buffers */
+  long frames;            /* frames queued so far */
+  long frames_written;    /* frames the writer thread got out */
+} Writer;
+
+void Init_output();
+void Init_trajectory();
+
+#endif
@@ -0,0 +1,588 @@
+/* particles.c -> the native structure-of-arrays particle store behind
+                  NBody. Body objects are lightweight views into it. */
+
+#include "stdio.h"
+#include "math.h"
+#include "ruby.h"
+#include "particles.h"
+#include "snapshot.h"
+#include "output.h"
+#include "vector_array.h"
+
+#define GET_VEC(val, p) Data_Get_Struct(val, Vector, p)
+
+VALUE cParticles;
+static VALUE cVector;
+static VALUE cVectorArray;
+
+typedef struct {
+  double vec[3];
+} Vector;
+
+/* ALLOCATION METHODS ----------------------- */
+static void particles_free(Particles *s) {
+  if (s->map != NULL) munmap(s->map, s->map_size);
+  else {
+    free(s->x); free(s->y); free(s->z);
+    free(s->vx); free(s->vy); free(s->vz);
+    free(s->ax); free(s->ay); free(s->az);
+    free(s->mass);
+  }
+  free(s->dt); free(s->ox); free(s->oy); free(s->oz);
+  free(s->active);
+  free(s->jx); free(s->jy); free(s->jz);
+  free(s->pot);
+  free(s->tag); free(s->work);
+  free(s->id); free(s->where);
+  free(s);
+}
+
+static VALUE particles_alloc(VALUE klass) {
+  Particles *s = ALLOC(Particles);
+  memset(s, 0, sizeof(Particles));
+  return Data_Wrap_Struct(klass, 0, particles_free, s);
+}
+
+static VALUE particles_initialize(int argc, VALUE *argv, VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  if (argc > 1)
+    rb_raise(rb_eArgError, "ERROR: Particles.new takes at most a capacity");
+  if (argc == 1)
+    particles_reserve(s, NUM2LONG(argv[0]));
+  return self;
+}
+
+/* UTILITY METHODS ---------------------------------- */
+
+/* maps a particle handle onto its current row */
+static long check_index(Particles *s, VALUE index) {
+  long i = NUM2LONG(index);
+  if (i < 0 || i >= s->n)
+    rb_raise(rb_eIndexError, "particle index %ld out of range", i);
+  return s->where[i];
+}
+
+static VALUE new_vector(double x, double y, double z) {
+  VALUE new_vec = rb_obj_alloc(cVector);
+  Vector *p; GET_VEC(new_vec, p);
+  p->vec[0] = x;
+  p->vec[1] = y;
+  p->vec[2] = z;
+  return new_vec;
+}
+
+static void get_triple(VALUE vec, double *x, double *y, double *z) {
+  Vector *p; GET_VEC(vec, p);
+  *x = p->vec[0];
+  *y = p->vec[1];
+  *z = p->vec[2];
+}
+
+/* STORE METHODS ------------------------------------ */
+
+/* appends a particle, returns its handle */
+static VALUE particles_push_rb(VALUE self, VALUE mass, VALUE pos, VALUE vel) {
+  Particles *s; GET_STORE(self, s);
+  double x, y, z, vx, vy, vz;
+  get_triple(pos, &x, &y, &z);
+  get_triple(vel, &vx, &vy, &vz);
+  return LONG2NUM(particles_push(s, NUM2DBL(mass), x, y, z, vx, vy, vz));
+}
+
+/* copies position, velocity and acceleration of the particles from[k]
+   of source into the particles to[k] of this store */
+static VALUE particles_copy_from(VALUE self, VALUE source, VALUE from,
+                                 VALUE to) {
+  Particles *s; GET_STORE(self, s);
+  Particles *o; GET_STORE(source, o);
+  long k;
+  Check_Type(from, T_ARRAY);
+  Check_Type(to, T_ARRAY);
+  if (RARRAY_LEN(from) != RARRAY_LEN(to))
+    rb_raise(rb_eArgError, "ERROR: copying %ld particles into %ld",
+             RARRAY_LEN(from), RARRAY_LEN(to));
+  for(k = 0; k < RARRAY_LEN(from); k++) {
+    long j = NUM2LONG(rb_ary_entry(from, k)), i;
+    if (j < 0 || j >= o->n)
+      rb_raise(rb_eIndexError, "particle index %ld out of range", j);
+    j = o->where[j];
+    i = check_index(s, rb_ary_entry(to, k));
+    s->x[i] = o->x[j]; s->y[i] = o->y[j]; s->z[i] = o->z[j];
+    s->vx[i] = o->vx[j]; s->vy[i] = o->vy[j]; s->vz[i] = o->vz[j];
+    s->ax[i] = o->ax[j]; s->ay[i] = o->ay[j]; s->az[i] = o->az[j];
+  }
+  return self;
+}
+
+static VALUE particles_size(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  return LONG2NUM(s->n);
+}
+
+/* INTEGRATOR METHODS ------------------------------- */
+
+/* half-kick: v += a*dt/2 for every particle, or with a handle for that
+   particle only (Body#kick) */
+static VALUE particles_kick(int argc, VALUE *argv, VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  VALUE rb_dt, handle;
+  double hdt;
+  double *vx = s->vx, *vy = s->vy, *vz = s->vz;
+  const double *ax = s->ax, *ay = s->ay, *az = s->az;
+  register long i, n = s->n;
+  rb_scan_args(argc, argv, "11", &rb_dt, &handle);
+  hdt = 0.5*NUM2DBL(rb_dt);
+  if (!NIL_P(handle)) {
+    i = check_index(s, handle);
+    vx[i] += hdt*ax[i];
+    vy[i] += hdt*ay[i];
+    vz[i] += hdt*az[i];
+    return self;
+  }
+  for(i = 0; i < n; i++) {
+    vx[i] += hdt*ax[i];
+    vy[i] += hdt*ay[i];
+    vz[i] += hdt*az[i];
+  }
+  return self;
+}
+
+/* drift: x += v*dt for every particle, or with a handle for that
+   particle only (Body#drift) */
+static VALUE particles_drift(int argc, VALUE *argv, VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  VALUE rb_dt, handle;
+  double dt;
+  double *x = s->x, *y = s->y, *z = s->z;
+  const double *vx = s->vx, *vy = s->vy, *vz = s->vz;
+  register long i, n = s->n;
+  rb_scan_args(argc, argv, "11", &rb_dt, &handle);
+  dt = NUM2DBL(rb_dt);
+  if (!NIL_P(handle)) {
+    i = check_index(s, handle);
+    x[i] += dt*vx[i];
+    y[i] += dt*vy[i];
+    z[i] += dt*vz[i];
+    return self;
+  }
+  for(i = 0; i < n; i++) {
+    x[i] += dt*vx[i];
+    y[i] += dt*vy[i];
+    z[i] += dt*vz[i];
+  }
+  return self;
+}
+
+/* BLOCK TIMESTEP METHODS --------------------------- */
+
+/* The block scheme splits a step dt_max of the integrator into
+   substeps h = dt_max/2^L. Every particle has its own step dt = m*h,
+   m a power of two, and a step of m substeps starts and ends on a
+   multiple of m, so the particles whose steps end together form the
+   active set of that substep. Every substep drifts every particle; only
+   the active ones get new forces and their closing half-kick. */
+
+/* substeps in the block step of row i; a particle without one starts
+   on the finest level */
+static long substeps(Particles *s, long i, double h) {
+  if (s->dt[i] <= 0.0) s->dt[i] = h;
+  return lround(s->dt[i]/h);
+}
+
+/* opens the step of every particle whose step starts at substep k:
+   remembers its acceleration and gives it the first half-kick */
+static VALUE particles_block_start(VALUE self, VALUE rb_h, VALUE rb_k) {
+  Particles *s; GET_STORE(self, s);
+  double h = NUM2DBL(rb_h);
+  long k = NUM2LONG(rb_k);
+  register long i;
+  particles_steps(s);
+  for(i = 0; i < s->n; i++) {
+    double hdt;
+    if (k % substeps(s, i, h) != 0) continue;
+    hdt = 0.5*s->dt[i];
+    s->ox[i] = s->ax[i]; s->oy[i] = s->ay[i]; s->oz[i] = s->az[i];
+    s->vx[i] += hdt*s->ax[i];
+    s->vy[i] += hdt*s->ay[i];
+    s->vz[i] += hdt*s->az[i];
+  }
+  return self;
+}
+
+/* makes the particles whose step ends at substep k the active set and
+   returns how many there are */
+static VALUE particles_block_active(VALUE self, VALUE rb_h, VALUE rb_k) {
+  Particles *s; GET_STORE(self, s);
+  double h = NUM2DBL(rb_h);
+  long k = NUM2LONG(rb_k), handle;
+  particles_steps(s);
+  s->nactive = 0;
+  for(handle = 0; handle < s->n; handle++) {
+    if (k % substeps(s, s->where[handle], h) == 0)
+      s->active[s->nactive++] = handle;
+  }
+  return LONG2NUM(s->nactive);
+}
+
+/* closes the step of the active set at substep k with the second
+   half-kick, and picks the next step of every active particle from how
+   much its acceleration changed: eta*dt*|a|/|a - a_start|, rounded down
+   to a power of two between h and dt_max. A step only ever grows by a
+   factor of two, and only where the longer step stays aligned. */
+static VALUE particles_block_finish(VALUE self, VALUE rb_h, VALUE rb_k,
+                                    VALUE rb_eta, VALUE rb_dt_max) {
+  Particles *s; GET_STORE(self, s);
+  double h = NUM2DBL(rb_h), eta = NUM2DBL(rb_eta);
+  long k = NUM2LONG(rb_k), top = lround(NUM2DBL(rb_dt_max)/h), q;
+  particles_steps(s);
+  for(q = 0; q < s->nactive; q++) {
+    long i = s->where[s->active[q]], m = substeps(s, i, h), next = 1;
+    double hdt = 0.5*s->dt[i], want;
+    double dx = s->ax[i] - s->ox[i], dy = s->ay[i] - s->oy[i],
+           dz = s->az[i] - s->oz[i];
+    double da = sqrt(dx*dx + dy*dy + dz*dz);
+    s->vx[i] += hdt*s->ax[i];
+    s->vy[i] += hdt*s->ay[i];
+    s->vz[i] += hdt*s->az[i];
+    
+    want = (da > 0.0) ? eta*s->dt[i]*sqrt(s->ax[i]*s->ax[i] +
+                          s->ay[i]*s->ay[i] + s->az[i]*s->az[i])/da/h
+                      : (double)top;
+    while (2*next <= top && 2*next <= want) next *= 2;
+    if (next > m) next = (k % (2*m) == 0) ? 2*m : m;
+    s->dt[i] = next*h;
+  }
+  return self;
+}
+
+/* the handles of the active set */
+static VALUE particles_active(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  VALUE handles = rb_ary_new2(s->nactive);
+  long q;
+  for(q = 0; q < s->nactive; q++) {
+    rb_ary_push(handles, LONG2NUM(s->active[q]));
+  }
+  return handles;
+}
+
+/* makes the given handles the active set for the force engines */
+static VALUE particles_set_active(VALUE self, VALUE handles) {
+  Particles *s; GET_STORE(self, s);
+  long q, n;
+  Check_Type(handles, T_ARRAY);
+  n = RARRAY_LEN(handles);
+  particles_steps(s);
+  if (n > s->n)
+    rb_raise(rb_eArgError, "ERROR: more active particles than particles");
+  for(q = 0; q < n; q++) {
+    long handle = NUM2LONG(rb_ary_entry(handles, q));
+    if (handle < 0 || handle >= s->n)
+      rb_raise(rb_eIndexError, "particle index %ld out of range", handle);
+    s->active[q] = handle;
+  }
+  s->nactive = n;
+  return handles;
+}
+
+/* the block timestep of a particle, 0 before it got one */
+static VALUE particles_timestep(VALUE self, VALUE index) {
+  Particles *s; GET_STORE(self, s);
+  long i = check_index(s, index);
+  return rb_float_new(s->dt != NULL ? s->dt[i] : 0.0);
+}
+
+static VALUE particles_clear_acc(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  memset(s->ax, 0, s->n*sizeof(double));
+  memset(s->ay, 0, s->n*sizeof(double));
+  memset(s->az, 0, s->n*sizeof(double));
+  return self;
+}
+
+/* DIAGNOSTIC METHODS ------------------------------- */
+
+/* sum of m v^2/2 */
+static VALUE particles_kinetic_energy(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  double e = 0.0;
+  register long i;
+  for(i = 0; i < s->n; i++) {
+    e += s->mass[i]*(s->vx[i]*s->vx[i] + s->vy[i]*s->vy[i] +
+                     s->vz[i]*s->vz[i]);
+  }
+  return rb_float_new(0.5*e);
+}
+
+/* sum of m pot/2, from the potentials the last force pass with
+   potential set left behind */
+static VALUE particles_potential_energy(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  double e = 0.0;
+  register long i;
+  if (s->pot == NULL)
+    rb_raise(rb_eRuntimeError, "ERROR: no potentials have been computed");
+  for(i = 0; i < s->n; i++) {
+    e += s->mass[i]*s->pot[i];
+  }
+  return rb_float_new(0.5*e);
+}
+
+/* sum of m v */
+static VALUE particles_momentum(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  double p[3] = {0.0, 0.0, 0.0};
+  register long i;
+  for(i = 0; i < s->n; i++) {
+    p[0] += s->mass[i]*s->vx[i];
+    p[1] += s->mass[i]*s->vy[i];
+    p[2] += s->mass[i]*s->vz[i];
+  }
+  return new_vector(p[0], p[1], p[2]);
+}
+
+/* sum of m x cross v, about the origin */
+static VALUE particles_angular_momentum(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  double l[3] = {0.0, 0.0, 0.0};
+  register long i;
+  for(i = 0; i < s->n; i++) {
+    l[0] += s->mass[i]*(s->y[i]*s->vz[i] - s->z[i]*s->vy[i]);
+    l[1] += s->mass[i]*(s->z[i]*s->vx[i] - s->x[i]*s->vz[i]);
+    l[2] += s->mass[i]*(s->x[i]*s->vy[i] - s->y[i]*s->vx[i]);
+  }
+  return new_vector(l[0], l[1], l[2]);
+}
+
+/* ACCESSOR METHODS -------------------------------------------*/
+static VALUE particles_potential(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  if (s->potential == POTENTIAL_ONLY) return rb_str_new2("only");
+  return s->potential ? Qtrue : Qfalse;
+}
+
+/* with potential set, every force pass also leaves the potential of
+   each particle behind (see potential_energy); with 'only' it leaves
+   the accelerations as they were and computes nothing but potentials */
+static VALUE particles_set_potential(VALUE self, VALUE potential) {
+  Particles *s; GET_STORE(self, s);
+  int only = RB_TYPE_P(potential, T_STRING) &&
+             strcmp(StringValueCStr(potential), "only") == 0;
+  if (RB_TYPE_P(potential, T_STRING) && !only)
+    rb_raise(rb_eArgError, "ERROR: unknown potential %s",
+             StringValueCStr(potential));
+  if (RTEST(potential)) particles_potentials(s);
+  s->potential = only ? POTENTIAL_ONLY :
+                 RTEST(potential) ? POTENTIAL_WITH_FORCES : POTENTIAL_NONE;
+  return potential;
+}
+
+static const char *softenings[] = {"plummer", "none", "spline"};
+
+static VALUE particles_softening(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  return rb_str_new2(softenings[s->softening]);
+}
+
+/* the softening of every force pass on the store: "plummer" (the
+   default), "none", which ignores eps, or "spline", the compact kernel
+   whose force is exactly Newtonian beyond 2.8 eps (see kernel.h) */
+static VALUE particles_set_softening(VALUE self, VALUE softening) {
+  Particles *s; GET_STORE(self, s);
+  const char *name = StringValueCStr(softening);
+  register int k;
+  for(k = 0; k < 3; k++) {
+    if (strcmp(name, softenings[k]) == 0) {
+      s->softening = k;
+      return softening;
+    }
+  }
+  rb_raise(rb_eArgError, "ERROR: unknown softening %s", name);
+  return Qnil;
+}
+
+static VALUE particles_threads(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  return INT2NUM(s->threads > 0 ? s->threads : 1);
+}
+
+static VALUE particles_set_threads(VALUE self, VALUE threads) {
+  Particles *s; GET_STORE(self, s);
+  int t = NUM2INT(threads);
+  if (t < 1)
+    rb_raise(rb_eArgError, "ERROR: at least one thread is required");
+  s->threads = t;
+  return threads;
+}
+
+static VALUE particles_mass(VALUE self, VALUE index) {
+  Particles *s; GET_STORE(self, s);
+  return rb_float_new(s->mass[check_index(s, index)]);
+}
+
+static VALUE particles_set_mass(VALUE self, VALUE index, VALUE mass) {
+  Particles *s; GET_STORE(self, s);
+  s->mass[check_index(s, index)] = NUM2DBL(mass);
+  return mass;
+}
+
+static VALUE particles_pos(VALUE self, VALUE index) {
+  Particles *s; GET_STORE(self, s);
+  long i = check_index(s, index);
+  return new_vector(s->x[i], s->y[i], s->z[i]);
+}
+
+static VALUE particles_set_pos(VALUE self, VALUE index, VALUE vec) {
+  Particles *s; GET_STORE(self, s);
+  long i = check_index(s, index);
+  get_triple(vec, &s->x[i], &s->y[i], &s->z[i]);
+  return vec;
+}
+
+static VALUE particles_vel(VALUE self, VALUE index) {
+  Particles *s; GET_STORE(self, s);
+  long i = check_index(s, index);
+  return new_vector(s->vx[i], s->vy[i], s->vz[i]);
+}
+
+static VALUE particles_set_vel(VALUE self, VALUE index, VALUE vec) {
+  Particles *s; GET_STORE(self, s);
+  long i = check_index(s, index);
+  get_triple(vec, &s->vx[i], &s->vy[i], &s->vz[i]);
+  return vec;
+}
+
+static VALUE particles_acc(VALUE self, VALUE index) {
+  Particles *s; GET_STORE(self, s);
+  long i = check_index(s, index);
+  return new_vector(s->ax[i], s->ay[i], s->az[i]);
+}
+
+static VALUE particles_set_acc(VALUE self, VALUE index, VALUE vec) {
+  Particles *s; GET_STORE(self, s);
+  long i = check_index(s, index);
+  get_triple(vec, &s->ax[i], &s->ay[i], &s->az[i]);
+  return vec;
+}
+
+/* ARRAY METHODS ---------------------------------------------*/
+
+/* a VectorArray of the columns x, y, z, in handle order */
+static VALUE export_columns(Particles *s, const double *x, const double *y,
+                            const double *z) {
+  VALUE n = LONG2NUM(s->n);
+  VALUE array = rb_class_new_instance(1, &n, cVectorArray);
+  VectorArray *a; GET_ARRAY(array, a);
+  long h;
+  for(h = 0; h < s->n; h++) {
+    long i = s->where[h];
+    a->data[3*h] = x[i];
+    a->data[3*h + 1] = y[i];
+    a->data[3*h + 2] = z[i];
+  }
+  return array;
+}
+
+static void import_columns(Particles *s, VALUE array, double *x, double *y,
+                           double *z) {
+  VectorArray *a; GET_ARRAY(array, a);
+  long h;
+  if (a->n != s->n)
+    rb_raise(rb_eArgError, "ERROR: the store has %ld particles, the "
+             "VectorArray %ld", s->n, a->n);
+  for(h = 0; h < s->n; h++) {
+    long i = s->where[h];
+    x[i] = a->data[3*h];
+    y[i] = a->data[3*h + 1];
+    z[i] = a->data[3*h + 2];
+  }
+}
+
+static VALUE particles_positions(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  return export_columns(s, s->x, s->y, s->z);
+}
+
+static VALUE particles_set_positions(VALUE self, VALUE array) {
+  Particles *s; GET_STORE(self, s);
+  import_columns(s, array, s->x, s->y, s->z);
+  return array;
+}
+
+static VALUE particles_velocities(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  return export_columns(s, s->vx, s->vy, s->vz);
+}
+
+static VALUE particles_set_velocities(VALUE self, VALUE array) {
+  Particles *s; GET_STORE(self, s);
+  import_columns(s, array, s->vx, s->vy, s->vz);
+  return array;
+}
+
+static VALUE particles_accelerations(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  return export_columns(s, s->ax, s->ay, s->az);
+}
+
+/* [m0, m1, ...] in handle order */
+static VALUE particles_masses(VALUE self) {
+  Particles *s; GET_STORE(self, s);
+  VALUE list = rb_ary_new2(s->n);
+  long h;
+  for(h = 0; h < s->n; h++) {
+    rb_ary_push(list, rb_float_new(s->mass[s->where[h]]));
+  }
+  return list;
+}
+
+/* MAIN RUBY DECLARATION ------------------------------------- */
+void Init_particles() {
+  rb_require("vector/vector");
+  cVector = rb_const_get(rb_cObject, rb_intern("Vector"));
+  cVectorArray = rb_const_get(rb_cObject, rb_intern("VectorArray"));
+  cParticles = rb_define_class("Particles", rb_cObject);
+  rb_define_alloc_func(cParticles, particles_alloc);
+  rb_define_method(cParticles, "initialize", particles_initialize, -1);
+  rb_define_method(cParticles, "push", particles_push_rb, 3);
+  rb_define_method(cParticles, "copy_from", particles_copy_from, 3);
+  rb_define_method(cParticles, "size", particles_size, 0);
+  rb_define_method(cParticles, "kick", particles_kick, -1);
+  rb_define_method(cParticles, "drift", particles_drift, -1);
+  rb_define_method(cParticles, "clear_acc", particles_clear_acc, 0);
+  rb_define_method(cParticles, "block_start", particles_block_start, 2);
+  rb_define_method(cParticles, "block_active", particles_block_active, 2);
+  rb_define_method(cParticles, "block_finish", particles_block_finish, 4);
+  rb_define_method(cParticles, "active", particles_active, 0);
+  rb_define_method(cParticles, "active=", particles_set_active, 1);
+  rb_define_method(cParticles, "timestep", particles_timestep, 1);
+  rb_define_method(cParticles, "kinetic_energy", particles_kinetic_energy, 0);
+  rb_define_method(cParticles, "potential_energy",
+                   particles_potential_energy, 0);
+  rb_define_method(cParticles, "momentum", particles_momentum, 0);
+  rb_define_method(cParticles, "angular_momentum",
+                   particles_angular_momentum, 0);
+  rb_define_method(cParticles, "potential", particles_potential, 0);
+  rb_define_method(cParticles, "potential=", particles_set_potential, 1);
+  rb_define_method(cParticles, "softening", particles_softening, 0);
+  rb_define_method(cParticles, "softening=", particles_set_softening, 1);
+  rb_define_method(cParticles, "threads", particles_threads, 0);
+  rb_define_method(cParticles, "threads=", particles_set_threads, 1);
+  rb_define_method(cParticles, "mass", particles_mass, 1);
+  rb_define_method(cParticles, "set_mass", particles_set_mass, 2);
+  rb_define_method(cParticles, "pos", particles_pos, 1);
+  rb_define_method(cParticles, "set_pos", particles_set_pos, 2);
+  rb_define_method(cParticles, "vel", particles_vel, 1);
+  rb_define_method(cParticles, "set_vel", particles_set_vel, 2);
+  rb_define_method(cParticles, "acc", particles_acc, 1);
+  rb_define_method(cParticles, "set_acc", particles_set_acc, 2);
+  rb_define_method(cParticles, "positions", particles_positions, 0);
+  rb_define_method(cParticles, "positions=", particles_set_positions, 1);
+  rb_define_method(cParticles, "velocities", particles_velocities, 0);
+  rb_define_method(cParticles, "velocities=", particles_set_velocities, 1);
+  rb_define_method(cParticles, "accelerations", particles_accelerations, 0);
+  rb_define_method(cParticles, "masses", particles_masses, 0);
+  Init_snapshot();
+  Init_output();
+  Init_trajectory();
+}
@@ -0,0 +1,528 @@
+/* snapshot.c -> writes and maps binary snapshots (see snapshot.h)
+
+   Writing walks the store in handle order, so a freshly loaded store
+   has row == handle again. A checkpoint keeps the rows in the order
+   they are in (force sums then add up in the same order after a
+   restart) and adds a handle column to map them back. Loading maps the
+   whole file MAP_PRIVATE and points the double columns of a new
+   Particles store straight into the mapping: there is no parsing at
+   all, pages are read on first touch and whatever the integrator
+   writes stays private to the process.
+
+   The processes of a distributed run each load a range of the rows and
+   write the rows of their range into one file: the first process
+   creates it, the others fill in their parts of the columns. */
+
+#include "stdio.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/stat.h"
+#include "ruby.h"
+#include "particles.h"
+#include "snapshot.h"
+
+#define GET_SNAPSHOT(val, p) Data_Get_Struct(val, Snapshot, p)
+#define NUM_COLUMNS 14
+#define MAX_EXTRA 4
+
+VALUE cSnapshot;
+extern VALUE cParticles;
+
+typedef struct {
+  void *map;
+  size_t map_size;
+  const SnapshotHeader *header;
+  const int64_t *id, *group, *type;
+  const int64_t *handle;  /* row -> handle, NULL if rows are handles */
+  VALUE path;
+  int fd;                 /* the file that was opened and checked */
+} Snapshot;
+
+/* the columns a store is pointed at, in the order of snapshot_particles */
+#define STORE_COLUMNS 10
+
+static const char *column_names[NUM_COLUMNS] = {
+  "mass", "x", "y", "z", "vx", "vy", "vz", "ax", "ay", "az",
+  "id", "group", "type", "handle"
+};
+
+/* ALLOCATION METHODS ----------------------- */
+static void snapshot_mark(Snapshot *snap) {
+  rb_gc_mark(snap->path);
+}
+
+static void snapshot_free(Snapshot *snap) {
+  if (snap->map != NULL) munmap(snap->map, snap->map_size);
+  if (snap->fd >= 0) close(snap->fd);
+  xfree(snap);
+}
+
+static VALUE snapshot_alloc(VALUE klass) {
+  Snapshot *snap = ALLOC(Snapshot);
+  memset(snap, 0, sizeof(Snapshot));
+  snap->path = Qnil;
+  snap->fd = -1;
+  return Data_Wrap_Struct(klass, snapshot_mark, snapshot_free, snap);
+}
+
+/* UTILITY METHODS -------------------------- */
+static size_t aligned(size_t offset) {
+  return (offset + COLUMN_ALIGN - 1)/COLUMN_ALIGN*COLUMN_ALIGN;
+}
+
+/* maps the file open at fd (opened from path) and checks that it is a
+   snapshot this reader understands. The caller closes fd. */
+static void *map_file(int fd, VALUE path, size_t *size) {
+  struct stat st;
+  void *map;
+  const SnapshotHeader *h;
+  if (fstat(fd, &st) != 0) rb_sys_fail(StringValueCStr(path));
+  if ((size_t)st.st_size < sizeof(SnapshotHeader))
+    rb_raise(rb_eArgError, "ERROR: %s is not a Tara snapshot",
+             StringValueCStr(path));
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) rb_sys_fail(StringValueCStr(path));
+  *size = st.st_size;
+  h = (const SnapshotHeader *)map;
+  if (memcmp(h->magic, SNAPSHOT_MAGIC, 8) != 0) {
+    munmap(map, *size);
+    rb_raise(rb_eArgError, "ERROR: %s is not a Tara snapshot",
+             StringValueCStr(path));
+  }
+  if (h->byte_order != SNAPSHOT_BYTE_ORDER) {
+    munmap(map, *size);
+    rb_raise(rb_eArgError, "ERROR: %s was written with a different byte "
+             "order", StringValueCStr(path));
+  }
+  if (h->version > SNAPSHOT_VERSION) {
+    munmap(map, *size);
+    rb_raise(rb_eArgError, "ERROR: %s is a version %u snapshot, this "
+             "reader knows up to version %d", StringValueCStr(path),
+             h->version, SNAPSHOT_VERSION);
+  }
+  if (h->n < 0 ||
+      sizeof(SnapshotHeader) + h->ncolumns*sizeof(SnapshotColumn) > *size ||
+      h->meta_offset + h->meta_size > *size) {
+    munmap(map, *size);
+    rb_raise(rb_eArgError, "ERROR: %s is truncated", StringValueCStr(path));
+  }
+  return map;
+}
+
+/* points *col at the column called name, or at NULL if the snapshot
+   has none; returns 0 if the column is broken */
+static int column_at(void *map, size_t size, const char *name,
+                     uint32_t type, void **col) {
+  const SnapshotHeader *h = (const SnapshotHeader *)map;
+  const SnapshotColumn *c = (const SnapshotColumn *)(h + 1);
+  uint32_t k;
+  *col = NULL;
+  for(k = 0; k < h->ncolumns; k++) {
+    if (strncmp(c[k].name, name, 8) != 0) continue;
+    if (c[k].type != type || c[k].offset % COLUMN_ALIGN != 0 ||
+        c[k].offset + h->n*8 > size)
+      return 0;
+    *col = (char *)map + c[k].offset;
+    return 1;
+  }
+  return 1;
+}
+
+/* returns the column called name, or NULL if the snapshot has none.
+   Only for mappings that already have an owner to unmap them. */
+static void *find_column(void *map, size_t size, const char *name,
+                         uint32_t type) {
+  void *col;
+  if (!column_at(map, size, name, type, &col))
+    rb_raise(rb_eArgError, "ERROR: broken column %s in snapshot", name);
+  return col;
+}
+
+/* unmaps a mapping nothing owns yet and raises */
+static void give_up(void *map, size_t size, const char *why,
+                    const char *name) {
+  munmap(map, size);
+  rb_raise(rb_eArgError, "ERROR: %s %s in snapshot", why, name);
+}
+
+static void write_all(FILE *f, const void *data, size_t size, VALUE path) {
+  if (size > 0 && fwrite(data, 1, size, f) != size) {
+    fclose(f);
+    rb_sys_fail(StringValueCStr(path));
+  }
+}
+
+/* writes n entries of a column from row first on */
+static void write_column(FILE *f, const SnapshotColumn *c, long first,
+                         const void *data, long n, VALUE path) {
+  if (fseek(f, (long)(c->offset + first*8), SEEK_SET) != 0) {
+    fclose(f);
+    rb_sys_fail(StringValueCStr(path));
+  }
+  write_all(f, data, n*8, path);
+}
+
+/* fills in the header and the column table of a snapshot of n rows,
+   with the handle column if it keeps its rows and the nextra columns
+   after that; returns the size of the file */
+static size_t layout(SnapshotHeader *h, SnapshotColumn *c, long n,
+                     double time, long meta_size, int rows, int nextra,
+                     const char **extra_names) {
+  size_t offset;
+  int k, ncolumns = (rows ? NUM_COLUMNS : NUM_COLUMNS - 1) + nextra;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, SNAPSHOT_MAGIC, 8);
+  h->version = SNAPSHOT_VERSION;
+  h->byte_order = SNAPSHOT_BYTE_ORDER;
+  h->n = n;
+  h->time = time;
+  h->ncolumns = ncolumns;
+  h->meta_offset = sizeof(*h) + ncolumns*sizeof(SnapshotColumn);
+  h->meta_size = meta_size;
+  offset = aligned(h->meta_offset + h->meta_size);
+  memset(c, 0, ncolumns*sizeof(SnapshotColumn));
+  for(k = 0; k < ncolumns; k++) {
+    strncpy(c[k].name, k < ncolumns - nextra ? column_names[k]
+                       : extra_names[k - ncolumns + nextra], 8);
+    c[k].type = (k < 10 || k >= ncolumns - nextra) ? COLUMN_FLOAT64
+                                                   : COLUMN_INT64;
+    c[k].offset = offset;
+    offset = aligned(offset + n*8);
+  }
+  return offset;
+}
+
+/* creates path with the header, the column table and the meta data; the
+   padding and the columns read as zeros until they are written */
+static FILE *create_file(VALUE path, const SnapshotHeader *h,
+                         const SnapshotColumn *c, VALUE meta, size_t size) {
+  FILE *f = fopen(StringValueCStr(path), "wb");
+  if (f == NULL) rb_sys_fail(StringValueCStr(path));
+  write_all(f, h, sizeof(*h), path);
+  write_all(f, c, h->ncolumns*sizeof(SnapshotColumn), path);
+  write_all(f, RSTRING_PTR(meta), h->meta_size, path);
+  if (fflush(f) != 0 || ftruncate(fileno(f), size) != 0) {
+    fclose(f);
+    rb_sys_fail(StringValueCStr(path));
+  }
+  return f;
+}
+
+/* syncs and closes a snapshot written by f */
+static void finish_file(FILE *f, VALUE path) {
+  if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+    fclose(f);
+    rb_sys_fail(StringValueCStr(path));
+  }
+  if (fclose(f) != 0) rb_sys_fail(StringValueCStr(path));
+}
+
+/* checks that the file open in f starts with the header h and the
+   column table c, as a snapshot being written by several processes */
+static void check_layout(FILE *f, const SnapshotHeader *h,
+                         const SnapshotColumn *c, VALUE path) {
+  SnapshotHeader fh;
+  SnapshotColumn fc[NUM_COLUMNS + MAX_EXTRA];
+  if (fread(&fh, sizeof(fh), 1, f) != 1 ||
+      memcmp(&fh, h, sizeof(fh)) != 0 ||
+      fread(fc, sizeof(SnapshotColumn), h->ncolumns, f) != h->ncolumns ||
+      memcmp(fc, c, h->ncolumns*sizeof(SnapshotColumn)) != 0) {
+    fclose(f);
+    rb_raise(rb_eArgError, "ERROR: %s is not the snapshot being written",
+             StringValueCStr(path));
+  }
+}
+
+/* SNAPSHOT METHODS ------------------------- */
+
+/* Snapshot.create(path, total, time, meta) creates a snapshot of total
+   rows whose columns the processes of a distributed run then fill in
+   with Snapshot.write */
+static VALUE snapshot_create(VALUE klass, VALUE path, VALUE rb_total,
+                             VALUE time, VALUE meta) {
+  SnapshotHeader h;
+  SnapshotColumn c[NUM_COLUMNS];
+  long total = NUM2LONG(rb_total);
+  size_t size;
+  if (total < 0)
+    rb_raise(rb_eArgError, "ERROR: a snapshot of %ld rows", total);
+  StringValue(meta);
+  size = layout(&h, c, total, NUM2DBL(time), RSTRING_LEN(meta), 0, 0, NULL);
+  finish_file(create_file(path, &h, c, meta, size), path);
+  return path;
+}
+
+/* Snapshot.write(path, store, time, meta, ids, groups, types, rows=false,
+   first=nil, total=nil) writes the store and the per body tables (arrays
+   indexed by handle) to path. With rows the store is written in its
+   current row order, followed by a handle column and the columns of the
+   integrator's own state: dt once the store has block timesteps, jx,
+   jy, jz once it has jerks. With first and total the store is the rows
+   [first, first + size) of the snapshot of total rows Snapshot.create
+   made at path, and only they are written. The file is synced before
+   this returns, so it can be renamed into place safely */
+static VALUE snapshot_write(int argc, VALUE *argv, VALUE klass) {
+  VALUE path, store, time, meta, ids, groups, types, rows, rb_first,
+        rb_total;
+  Particles *s;
+  SnapshotHeader h;
+  SnapshotColumn c[NUM_COLUMNS + MAX_EXTRA];
+  const double *src[10], *extra[MAX_EXTRA];
+  const char *extra_names[MAX_EXTRA];
+  double *dcol;
+  int64_t *icol;
+  size_t size;
+  long i, n, first, total;
+  int k, ncolumns, nextra = 0;
+  FILE *f;
+  rb_scan_args(argc, argv, "73", &path, &store, &time, &meta, &ids, &groups,
+               &types, &rows, &rb_first, &rb_total);
+  GET_STORE(store, s);
+  n = s->n;
+  first = NIL_P(rb_first) ? 0 : NUM2LONG(rb_first);
+  total = NIL_P(rb_total) ? n : NUM2LONG(rb_total);
+  if (first < 0 || first + n > total || (RTEST(rows) && total != n))
+    rb_raise(rb_eIndexError, "ERROR: rows %ld to %ld of a snapshot of %ld",
+             first, first + n, total);
+  if (RTEST(rows) && s->dt != NULL) {
+    extra_names[nextra] = "dt"; extra[nextra++] = s->dt;
+  }
+  if (RTEST(rows) && s->jx != NULL) {
+    extra_names[nextra] = "jx"; extra[nextra++] = s->jx;
+    extra_names[nextra] = "jy"; extra[nextra++] = s->jy;
+    extra_names[nextra] = "jz"; extra[nextra++] = s->jz;
+  }
+  StringValue(meta);
+  Check_Type(ids, T_ARRAY);
+  Check_Type(groups, T_ARRAY);
+  Check_Type(types, T_ARRAY);
+  if (RARRAY_LEN(ids) != n || RARRAY_LEN(groups) != n ||
+      RARRAY_LEN(types) != n)
+    rb_raise(rb_eArgError, "ERROR: need an id, group and type for each of "
+             "the %ld particles", n);
+
+  size = layout(&h, c, total, NUM2DBL(time), RSTRING_LEN(meta),
+                RTEST(rows), nextra, extra_names);
+  ncolumns = h.ncolumns;
+  if (NIL_P(rb_first)) f = create_file(path, &h, c, meta, size);
+  else {
+    f = fopen(StringValueCStr(path), "r+b");
+    if (f == NULL) rb_sys_fail(StringValueCStr(path));
+    check_layout(f, &h, c, path);
+  }
+
+  src[0] = s->mass;
+  src[1] = s->x; src[2] = s->y; src[3] = s->z;
+  src[4] = s->vx; src[5] = s->vy; src[6] = s->vz;
+  src[7] = s->ax; src[8] = s->ay; src[9] = s->az;
+  dcol = ALLOC_N(double, n > 0 ? n : 1);
+  for(k = 0; k < 10; k++) {
+    for(i = 0; i < n; i++) {
+      dcol[i] = RTEST(rows) ? src[k][i] : src[k][s->where[i]];
+    }
+    write_column(f, &c[k], first, dcol, n, path);
+  }
+  xfree(dcol);
+  icol = ALLOC_N(int64_t, n > 0 ? n : 1);
+  for(k = 0; k < 3; k++) {
+    VALUE table = (k == 0) ? ids : (k == 1) ? groups : types;
+    for(i = 0; i < n; i++) {
+      icol[i] = NUM2LL(rb_ary_entry(table, RTEST(rows) ? s->id[i] : i));
+    }
+    write_column(f, &c[10 + k], first, icol, n, path);
+  }
+  if (RTEST(rows)) {
+    for(i = 0; i < n; i++) {
+      icol[i] = s->id[i];
+    }
+    write_column(f, &c[13], first, icol, n, path);
+  }
+  xfree(icol);
+  for(k = 0; k < nextra; k++) {
+    write_column(f, &c[ncolumns - nextra + k], first, extra[k], n, path);
+  }
+  finish_file(f, path);
+  return path;
+}
+
+static VALUE snapshot_initialize(VALUE self, VALUE path) {
+  Snapshot *snap; GET_SNAPSHOT(self, snap);
+  StringValue(path);
+  snap->path = rb_str_dup(path);
+  /* the file stays open, so that every store of this snapshot maps the
+     very file checked here, even once another one is renamed over path
+     (as Checkpoint#write does) */
+  snap->fd = open(StringValueCStr(path), O_RDONLY);
+  if (snap->fd < 0) rb_sys_fail(StringValueCStr(path));
+  snap->map = map_file(snap->fd, path, &snap->map_size);
+  snap->header = (const SnapshotHeader *)snap->map;
+  snap->id = find_column(snap->map, snap->map_size, "id", COLUMN_INT64);
+  snap->group = find_column(snap->map, snap->map_size, "group",
+                            COLUMN_INT64);
+  snap->type = find_column(snap->map, snap->map_size, "type", COLUMN_INT64);
+  snap->handle = find_column(snap->map, snap->map_size, "handle",
+                             COLUMN_INT64);
+  return self;
+}
+
+static VALUE snapshot_size(VALUE self) {
+  Snapshot *snap; GET_SNAPSHOT(self, snap);
+  return LONG2NUM((long)snap->header->n);
+}
+
+static VALUE snapshot_time(VALUE self) {
+  Snapshot *snap; GET_SNAPSHOT(self, snap);
+  return rb_float_new(snap->header->time);
+}
+
+static VALUE snapshot_version(VALUE self) {
+  Snapshot *snap; GET_SNAPSHOT(self, snap);
+  return INT2NUM(snap->header->version);
+}
+
+static VALUE snapshot_meta(VALUE self) {
+  Snapshot *snap; GET_SNAPSHOT(self, snap);
+  return rb_str_new((const char *)snap->map + snap->header->meta_offset,
+                    snap->header->meta_size);
+}
+
+/* the rows [first, last) of the snapshot, by default all of them */
+static void get_range(VALUE from, VALUE to, long n, long *first,
+                      long *last) {
+  *first = NIL_P(from) ? 0 : NUM2LONG(from);
+  *last = NIL_P(to) ? n : NUM2LONG(to);
+  if (*first < 0 || *last > n || *first > *last)
+    rb_raise(rb_eIndexError, "ERROR: rows %ld to %ld of a snapshot of %ld",
+             *first, *last, n);
+}
+
+/* particles(first=0, last=size) is a new Particles store of the rows
+   [first, last), its columns a private mapping of the snapshot, a
+   mapping of its own so that stores never share what they write. Only
+   the pages of those rows are ever read. A checkpoint, whose rows are
+   not in handle order, is only loaded whole. Every column is checked
+   before the store gets any of them: until the store owns the mapping,
+   every error unmaps it. */
+static VALUE snapshot_particles(int argc, VALUE *argv, VALUE self) {
+  Snapshot *snap; GET_SNAPSHOT(self, snap);
+  VALUE from, to, store;
+  Particles *s;
+  size_t size;
+  void *map, *col[STORE_COLUMNS], *dt, *jx, *jy, *jz, *rows;
+  const int64_t *handle;
+  long i, n, first, last;
+  int k;
+  rb_scan_args(argc, argv, "02", &from, &to);
+  get_range(from, to, (long)snap->header->n, &first, &last);
+  if (snap->handle != NULL && last - first != snap->header->n)
+    rb_raise(rb_eArgError, "ERROR: a checkpoint is only loaded whole");
+  store = rb_class_new_instance(0, 0, cParticles);
+  GET_STORE(store, s);
+  map = map_file(snap->fd, snap->path, &size);
+  n = (long)((const SnapshotHeader *)map)->n;
+  if (n != snap->header->n) give_up(map, size, "changed", "row count");
+  for(k = 0; k < STORE_COLUMNS; k++) {
+    if (!column_at(map, size, column_names[k], COLUMN_FLOAT64, &col[k]))
+      give_up(map, size, "broken column", column_names[k]);
+    if (col[k] == NULL)
+      give_up(map, size, "no column", column_names[k]);
+  }
+  if (!column_at(map, size, "dt", COLUMN_FLOAT64, &dt))
+    give_up(map, size, "broken column", "dt");
+  if (!column_at(map, size, "jx", COLUMN_FLOAT64, &jx))
+    give_up(map, size, "broken column", "jx");
+  if (!column_at(map, size, "jy", COLUMN_FLOAT64, &jy))
+    give_up(map, size, "broken column", "jy");
+  if (!column_at(map, size, "jz", COLUMN_FLOAT64, &jz))
+    give_up(map, size, "broken column", "jz");
+  if (!column_at(map, size, "handle", COLUMN_INT64, &rows))
+    give_up(map, size, "broken column", "handle");
+  handle = (const int64_t *)rows;
+  if (handle != NULL) {
+    /* every handle exactly once, or where[] would point at wrong rows */
+    unsigned char *seen = (unsigned char *)calloc(n/8 + 1, 1);
+    if (seen == NULL) give_up(map, size, "no memory to check", "handle");
+    for(i = 0; i < n; i++) {
+      int64_t h = handle[i];
+      if (h < 0 || h >= n || (seen[h/8] & (1 << (h%8)))) {
+        free(seen);
+        give_up(map, size, "broken column", "handle");
+      }
+      seen[h/8] |= 1 << (h%8);
+    }
+    free(seen);
+  }
+  
+  /* from here on the store owns the mapping */
+  s->mass = (double *)col[0] + first;
+  s->x = (double *)col[1] + first; s->y = (double *)col[2] + first;
+  s->z = (double *)col[3] + first;
+  s->vx = (double *)col[4] + first; s->vy = (double *)col[5] + first;
+  s->vz = (double *)col[6] + first;
+  s->ax = (double *)col[7] + first; s->ay = (double *)col[8] + first;
+  s->az = (double *)col[9] + first;
+  n = last - first;
+  s->map = map;
+  s->map_size = size;
+  s->n = s->capacity = n;
+  s->id = (long *)particles_grow(NULL, sizeof(long), 0, n > 0 ? n : 1);
+  s->where = (long *)particles_grow(NULL, sizeof(long), 0, n > 0 ? n : 1);
+  for(i = 0; i < n; i++) {
+    s->id[i] = s->where[i] = i;
+  }
+  if (handle != NULL) {
+    for(i = 0; i < n; i++) {
+      long h = (long)handle[i];
+      s->id[i] = h;
+      s->where[h] = i;
+    }
+  }
+  /* the integrator's state is copied, it never lives in the mapping */
+  if (dt != NULL) {
+    particles_steps(s);
+    memcpy(s->dt, (double *)dt + first, n*sizeof(double));
+  }
+  if (jx != NULL && jy != NULL && jz != NULL) {
+    particles_jerks(s);
+    memcpy(s->jx, (double *)jx + first, n*sizeof(double));
+    memcpy(s->jy, (double *)jy + first, n*sizeof(double));
+    memcpy(s->jz, (double *)jz + first, n*sizeof(double));
+  }
+  return store;
+}
+
+/* each_body(first=0, last=size) yields the handle, id, group index and
+   type index (nil if there is none) of the rows [first, last), in row
+   order; the handles are those of the store particles(first, last)
+   returns */
+static VALUE snapshot_each_body(int argc, VALUE *argv, VALUE self) {
+  Snapshot *snap; GET_SNAPSHOT(self, snap);
+  VALUE from, to;
+  long i, first, last;
+  rb_scan_args(argc, argv, "02", &from, &to);
+  get_range(from, to, (long)snap->header->n, &first, &last);
+  for(i = first; i < last; i++) {
+    VALUE id = snap->id ? LL2NUM(snap->id[i]) : INT2FIX(0);
+    VALUE group = snap->group ? LL2NUM(snap->group[i]) : INT2FIX(0);
+    VALUE type = (snap->type && snap->type[i] >= 0) ?
+      LL2NUM(snap->type[i]) : Qnil;
+    VALUE handle = snap->handle ? LL2NUM(snap->handle[i])
+                                : LONG2NUM(i - first);
+    rb_yield_values(4, handle, id, group, type);
+  }
+  return self;
+}
+
+void Init_snapshot() {
+  cSnapshot = rb_define_class("Snapshot", rb_cObject);
+  rb_define_alloc_func(cSnapshot, snapshot_alloc);
+  rb_define_singleton_method(cSnapshot, "create", snapshot_create, 4);
+  rb_define_singleton_method(cSnapshot, "write", snapshot_write, -1);
+  rb_define_method(cSnapshot, "initialize", snapshot_initialize, 1);
+  rb_define_method(cSnapshot, "size", snapshot_size, 0);
+  rb_define_method(cSnapshot, "time", snapshot_time, 0);
+  rb_define_method(cSnapshot, "version", snapshot_version, 0);
+  rb_define_method(cSnapshot, "meta", snapshot_meta, 0);
+  rb_define_method(cSnapshot, "particles", snapshot_particles, -1);
+  rb_define_method(cSnapshot, "each_body", snapshot_each_body, -1);
+}
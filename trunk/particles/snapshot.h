@@ -0,0 +1,57 @@
+/* snapshot.h -> layout of Tara's binary snapshot files
+
+   A snapshot is a binary companion of a .thd file:
+
+     SnapshotHeader
+     SnapshotColumn[ncolumns]
+     meta data (text, see thd/thd_handler.rb), padded to COLUMN_ALIGN
+     the columns, n entries each, every one starting at a multiple of
+     COLUMN_ALIGN
+
+   The double columns mass, x, y, z, vx, vy, vz, ax, ay, az are laid out
+   exactly like the columns of a Particles store, so a snapshot is
+   loaded by mapping the file and pointing the store at them. The int64
+   columns id, group and type hold the THD id of every body and its
+   index into the group and type tables of the meta data. A checkpoint
+   stores the rows in the order the store had them and adds an int64
+   handle column (row -> handle); without it row i is handle i. A
+   checkpoint also has the double columns the integrator keeps for itself:
+   dt, the step of every row with block timesteps, and jx, jy, jz, the
+   jerks of the Hermite integrator.
+   Everything is written in the byte order of the writing machine;
+   byte_order tells a reader whether that is its own. */
+
+#ifndef TARA_SNAPSHOT_H
+#define TARA_SNAPSHOT_H
+
+#include "stdint.h"
+
+#define SNAPSHOT_MAGIC "TARASNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+#define COLUMN_ALIGN 64
+
+#define COLUMN_FLOAT64 0
+#define COLUMN_INT64 1
+
+typedef struct {
+  char magic[8];          /* SNAPSHOT_MAGIC, not terminated */
+  uint32_t version;       /* SNAPSHOT_VERSION of the writer */
+  uint32_t byte_order;    /* SNAPSHOT_BYTE_ORDER as the writer saw it */
+  int64_t n;              /* number of bodies */
+  double time;            /* system time of the snapshot */
+  uint32_t ncolumns;
+  uint32_t reserved;
+  uint64_t meta_offset, meta_size;
+} SnapshotHeader;
+
+typedef struct {
+  char name[8];           /* '\0' padded */
+  uint32_t type;          /* COLUMN_FLOAT64 or COLUMN_INT64 */
+  uint32_t reserved;
+  uint64_t offset;        /* from the start of the file */
+} SnapshotColumn;
+
+void Init_snapshot();
+
+#endif
@@ -0,0 +1,227 @@
+/* trajectory.c -> random access to binary trajectories (see output.h)
+
+   The whole file is mapped read-only; frame k is found through the
+   index at the end of the file, or from the fixed frame size if the
+   run that wrote it never got to close it. Nothing is read before it
+   is asked for. */
+
+#include "stdio.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/stat.h"
+#include "ruby.h"
+#include "particles.h"
+#include "output.h"
+
+#define GET_TRAJECTORY(val, p) Data_Get_Struct(val, Trajectory, p)
+
+VALUE cTrajectoryReader;
+
+typedef struct {
+  char *map;
+  size_t map_size;
+  const TrajectoryHeader *header;
+  long frames;
+  const uint64_t *offsets;  /* from the index, NULL if there is none */
+} Trajectory;
+
+/* ALLOCATION METHODS ----------------------- */
+static void trajectory_free(Trajectory *t) {
+  if (t->map != NULL) munmap(t->map, t->map_size);
+  xfree(t);
+}
+
+static VALUE trajectory_alloc(VALUE klass) {
+  Trajectory *t = ALLOC(Trajectory);
+  memset(t, 0, sizeof(Trajectory));
+  return Data_Wrap_Struct(klass, 0, trajectory_free, t);
+}
+
+/* UTILITY METHODS -------------------------- */
+static void broken(Trajectory *t, const char *path, const char *why) {
+  munmap(t->map, t->map_size);
+  t->map = NULL;
+  rb_raise(rb_eArgError, "ERROR: %s %s", path, why);
+}
+
+/* start of frame k */
+static const char *frame_at(Trajectory *t, VALUE index) {
+  long k = NUM2LONG(index);
+  size_t offset;
+  if (k < 0) k += t->frames;
+  if (k < 0 || k >= t->frames)
+    rb_raise(rb_eIndexError, "frame %ld out of range", NUM2LONG(index));
+  if (t->offsets != NULL) offset = t->offsets[k];
+  else offset = sizeof(TrajectoryHeader) +
+         k*trajectory_frame_size(t->header->n, t->header->flags);
+  return t->map + offset;
+}
+
+static double value_at(Trajectory *t, const char *frame, int column,
+                       long i) {
+  const char *values = frame + sizeof(double);
+  long at = column*t->header->n + i;
+  if (t->header->flags & TRAJECTORY_FLOAT32)
+    return ((const float *)values)[at];
+  return ((const double *)values)[at];
+}
+
+static VALUE columns_of(Trajectory *t, VALUE index, int first) {
+  const char *frame;
+  VALUE rows;
+  long i, n = (long)t->header->n;
+  if (first > 0 && !(t->header->flags & TRAJECTORY_VELOCITIES))
+    rb_raise(rb_eArgError, "ERROR: trajectory has no velocities");
+  frame = frame_at(t, index);
+  rows = rb_ary_new2(n);
+  for(i = 0; i < n; i++) {
+    rb_ary_push(rows, rb_ary_new3(3,
+                  rb_float_new(value_at(t, frame, first, i)),
+                  rb_float_new(value_at(t, frame, first + 1, i)),
+                  rb_float_new(value_at(t, frame, first + 2, i))));
+  }
+  return rows;
+}
+
+/* TRAJECTORY METHODS ----------------------- */
+static VALUE trajectory_initialize(VALUE self, VALUE path) {
+  Trajectory *t; GET_TRAJECTORY(self, t);
+  const char *name = StringValueCStr(path);
+  const TrajectoryFooter *footer;
+  struct stat st;
+  size_t frame;
+  int fd = open(name, O_RDONLY);
+  if (fd < 0) rb_sys_fail(name);
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    rb_sys_fail(name);
+  }
+  if ((size_t)st.st_size < sizeof(TrajectoryHeader)) {
+    close(fd);
+    rb_raise(rb_eArgError, "ERROR: %s is not a Tara trajectory", name);
+  }
+  t->map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (t->map == MAP_FAILED) {
+    t->map = NULL;
+    rb_sys_fail(name);
+  }
+  t->map_size = st.st_size;
+  t->header = (const TrajectoryHeader *)t->map;
+  if (memcmp(t->header->magic, TRAJECTORY_MAGIC, 8) != 0)
+    broken(t, name, "is not a Tara trajectory");
+  if (t->header->byte_order != TRAJECTORY_BYTE_ORDER)
+    broken(t, name, "was written with a different byte order");
+  if (t->header->version > TRAJECTORY_VERSION)
+    broken(t, name, "was written by a newer version of Tara");
+  if (t->header->n < 0)
+    broken(t, name, "is broken");
+  frame = trajectory_frame_size(t->header->n, t->header->flags);
+
+  footer = (const TrajectoryFooter *)(t->map + t->map_size -
+                                      sizeof(TrajectoryFooter));
+  if (t->map_size >= sizeof(TrajectoryHeader) + sizeof(TrajectoryFooter) &&
+      memcmp(footer->magic, TRAJECTORY_INDEX_MAGIC, 8) == 0) {
+    long k;
+    t->frames = (long)footer->frames;
+    if (footer->index_offset < sizeof(TrajectoryHeader) + 8 ||
+        footer->index_offset + t->frames*(sizeof(uint64_t) + sizeof(double))
+        + sizeof(TrajectoryFooter) > t->map_size)
+      broken(t, name, "has a broken frame index");
+    t->offsets = (const uint64_t *)(t->map + footer->index_offset);
+    for(k = 0; k < t->frames; k++) {
+      if (t->offsets[k] + frame > footer->index_offset)
+        broken(t, name, "has a broken frame index");
+    }
+  }
+  else {
+    /* an interrupted run: every complete frame is still there, up to
+       the start of the index if the run got as far as writing it */
+    long k, frames = (t->map_size - sizeof(TrajectoryHeader))/frame;
+    for(k = 0; k < frames; k++) {
+      const char *at = t->map + sizeof(TrajectoryHeader) + k*frame;
+      if (memcmp(at, TRAJECTORY_INDEX_MAGIC, 8) == 0) break;
+    }
+    t->frames = k;
+  }
+  return self;
+}
+
+static VALUE trajectory_size(VALUE self) {
+  Trajectory *t; GET_TRAJECTORY(self, t);
+  return LONG2NUM(t->frames);
+}
+
+static VALUE trajectory_particles(VALUE self) {
+  Trajectory *t; GET_TRAJECTORY(self, t);
+  return LONG2NUM((long)t->header->n);
+}
+
+static VALUE trajectory_is_float32(VALUE self) {
+  Trajectory *t; GET_TRAJECTORY(self, t);
+  return (t->header->flags & TRAJECTORY_FLOAT32) ? Qtrue : Qfalse;
+}
+
+static VALUE trajectory_has_velocities(VALUE self) {
+  Trajectory *t; GET_TRAJECTORY(self, t);
+  return (t->header->flags & TRAJECTORY_VELOCITIES) ? Qtrue : Qfalse;
+}
+
+static VALUE trajectory_time(VALUE self, VALUE index) {
+  Trajectory *t; GET_TRAJECTORY(self, t);
+  double time;
+  memcpy(&time, frame_at(t, index), sizeof(double));
+  return rb_float_new(time);
+}
+
+/* [[x, y, z], ...] of frame index, in handle order */
+static VALUE trajectory_positions(VALUE self, VALUE index) {
+  Trajectory *t; GET_TRAJECTORY(self, t);
+  return columns_of(t, index, 0);
+}
+
+static VALUE trajectory_velocities(VALUE self, VALUE index) {
+  Trajectory *t; GET_TRAJECTORY(self, t);
+  return columns_of(t, index, 3);
+}
+
+/* copies frame index into the positions (and velocities) of a store of
+   the same size and returns the frame's time */
+static VALUE trajectory_read(VALUE self, VALUE index, VALUE store) {
+  Trajectory *t; GET_TRAJECTORY(self, t);
+  Particles *s; GET_STORE(store, s);
+  const char *frame = frame_at(t, index);
+  double time;
+  long h;
+  if (s->n != t->header->n)
+    rb_raise(rb_eArgError, "ERROR: the store has %ld particles, the "
+             "trajectory %ld", s->n, (long)t->header->n);
+  for(h = 0; h < s->n; h++) {
+    long i = s->where[h];
+    s->x[i] = value_at(t, frame, 0, h);
+    s->y[i] = value_at(t, frame, 1, h);
+    s->z[i] = value_at(t, frame, 2, h);
+    if (t->header->flags & TRAJECTORY_VELOCITIES) {
+      s->vx[i] = value_at(t, frame, 3, h);
+      s->vy[i] = value_at(t, frame, 4, h);
+      s->vz[i] = value_at(t, frame, 5, h);
+    }
+  }
+  memcpy(&time, frame, sizeof(double));
+  return rb_float_new(time);
+}
+
+void Init_trajectory() {
+  cTrajectoryReader = rb_define_class("TrajectoryReader", rb_cObject);
+  rb_define_alloc_func(cTrajectoryReader, trajectory_alloc);
+  rb_define_method(cTrajectoryReader, "initialize", trajectory_initialize, 1);
+  rb_define_method(cTrajectoryReader, "size", trajectory_size, 0);
+  rb_define_method(cTrajectoryReader, "particles", trajectory_particles, 0);
+  rb_define_method(cTrajectoryReader, "float32?", trajectory_is_float32, 0);
+  rb_define_method(cTrajectoryReader, "velocities?",
+                   trajectory_has_velocities, 0);
+  rb_define_method(cTrajectoryReader, "time", trajectory_time, 1);
+  rb_define_method(cTrajectoryReader, "positions", trajectory_positions, 1);
+  rb_define_method(cTrajectoryReader, "velocities", trajectory_velocities, 1);
+  rb_define_method(cTrajectoryReader, "read", trajectory_read, 2);
+}
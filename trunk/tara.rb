@@ -1,14 +1,19 @@
-require 'tree/tree'
+require 'c_tree/tree'
 require 'vector/vector'
 require 'pairwise/pairwise'
+require 'particles/particles'
 require 'body.rb'
 require 'thd/thd_handler.rb'
+require 'thd/checkpoint.rb'
 require 'parser.rb'
+require 'distributed.rb'
 
 
 # PARSER ----------------------------------------------------
 help_header = <<ENDSTR
 tara < fig8.thd
+tara -in fig8.thb
+tara -rs tara.chk
 Integrates the dynamical equations of motion for a small-N system specified 
 by a .thd file.
 
@@ -22,24 +27,34 @@ parser.load ['-h', '--help', 'prints out help',
 parser.load ['-dt', '--timestep', 'the integration timestep: <float>',
   Proc.new{ |arg| @dt = arg.to_f }, true, 1]
 
-@t_start = 0
+@t_start = nil
 parser.load ['-ts', '--time_start', 
-  'the system time when starting integration: <float>',
+  'the system time when starting integration, by default the time of '+
+  'the input snapshot or 0: <float>',
   Proc.new{ |arg| @t_start = arg.to_f }, true, 1]
 
 @t_end = 10
 parser.load ['-te', '--time_end', 
-  'the system time when stopping integration: <float>',
-  Proc.new{ |arg| @t_end = arg.to_f }, true, 1]
+  'the system time when stopping integration, also for a restarted run: '+
+  '<float>',
+  Proc.new{ |arg| @t_end = arg.to_f; @t_end_given = true }, true, 1]
 
 @out_dt = 0.1
-parser.load ['-o', '--output_interval', 'write-out interval: <float>',
+parser.load ['-o', '--output_interval', 
+  'system time between two trajectory frames, every step if it is not '+
+  'larger than the timestep: <float>',
   Proc.new{ |arg| @out_dt = arg.to_f }, false, 1]
   
 @eps = 0.0
 parser.load ['-e', '--epsilon', 'softening parameter: <float>',
   Proc.new{ |arg| @eps = arg.to_f }, false, 1]
   
+@softening = 'plummer'
+parser.load ['-sk', '--softening',
+  'the softened force: plummer, spline (exactly Newtonian beyond 2.8 '+
+  'times the softening parameter) or none: <string>',
+  Proc.new{ |arg| @softening = arg }, false, 1]
+  
 @tol = 0.5
 parser.load ['-tol', '--opening_tolerance', 
   'the opening tolerance that determines whether a node is to be opened '+
@@ -47,8 +62,22 @@ parser.load ['-tol', '--opening_tolerance',
   Proc.new{ |arg| @tol = arg.to_f }, false, 1]
 
 @integrator = 'leapfrog'
-parser.load ['-i', '--integrator', 'the integrator to use <leapfrog>',
+parser.load ['-i', '--integrator', 
+  'the integrator to use; block gives every body a power-of-two '+
+  'fraction of the timestep of its own, hermite is fourth order with '+
+  'direct forces <leapfrog|block|hermite>',
   Proc.new{ |arg| @integrator = arg }, false, 1]
+
+@max_level = 6
+parser.load ['-ml', '--max_level', 
+  'the block integrator splits the timestep down to timestep/2^level: '+
+  '<int>',
+  Proc.new{ |arg| @max_level = arg.to_i }, false, 1]
+
+@eta = 0.02
+parser.load ['-eta', '--eta', 
+  'accuracy of the block integrator\'s timestep criterion: <float>',
+  Proc.new{ |arg| @eta = arg.to_f }, false, 1]
   
 @step_out = false
 parser.load ['-s', '--output_files', 'turns on file output',
@@ -58,14 +87,210 @@ parser.load ['-s', '--output_files', 'turns on file output',
 parser.load ['-nt', '--no_tree', 'disables the B&H tree',
   Proc.new{ @use_tree = false; warn 'tree disabled' }, false, 0]
 
+@solver = 'tree'
+parser.load ['-so', '--solver', 
+  'the force solver to use <direct|tree|fmm>',
+  Proc.new{ |arg| @solver = arg; @use_tree = (arg != 'direct') }, false, 1]
+
+@force_error = false
+parser.load ['-fe', '--force_error', 
+  'reports the force error of the solver against direct summation',
+  Proc.new{ @force_error = true }, false, 0]
+
+@threads = 1
+parser.load ['-th', '--threads', 
+  'number of threads used by the force calculation: <int>',
+  Proc.new{ |arg| @threads = arg.to_i }, false, 1]
+
+@morton = false
+parser.load ['-m', '--morton', 
+  'sorts the particles along a Morton curve and builds the tree '+
+  'from the sorted keys',
+  Proc.new{ @morton = true }, false, 0]
+
+@multipole_order = 1
+parser.load ['-mo', '--multipole_order', 
+  'multipole order of the tree cells, 1 (monopole) or 2 (quadrupole); '+
+  'quadrupoles allow a larger opening tolerance for the same accuracy: '+
+  '<int>',
+  Proc.new{ |arg| @multipole_order = arg.to_i }, false, 1]
+
+@subsystems = nil
+parser.load ['-ss', '--subsystems', 
+  'integrates the bodies below these nodes of the THD hierarchy as '+
+  'subsystems, seen by the solver at their centre of mass: '+
+  '<name,name,...>',
+  Proc.new{ |arg| @subsystems = arg.split(',') }, false, 1]
+
+@subsystem_steps = 32
+parser.load ['-sst', '--subsystem_steps', 
+  'internal Hermite steps of a subsystem for every timestep: <int>',
+  Proc.new{ |arg| @subsystem_steps = arg.to_i }, false, 1]
+
+@mixed_precision = false
+parser.load ['-mp', '--mixed_precision', 
+  'sums the far field of the tree walk in single precision; with '+
+  '--force_error its error against the double walk is reported',
+  Proc.new{ @mixed_precision = true }, false, 0]
+
+@rebuild_threshold = nil
+parser.load ['-rt', '--rebuild_threshold', 
+  'refits the tree to the moved particles instead of rebuilding it, '+
+  'until more than this fraction of them have left their cells: <float>',
+  Proc.new{ |arg| @rebuild_threshold = arg.to_f }, false, 1]
+
+@output_format = 'text'
+parser.load ['-of', '--output_format', 
+  'the trajectory format: text, binary (indexed frames of doubles) or '+
+  'binary32 (the same with floats) <text|binary|binary32>',
+  Proc.new{ |arg| @output_format = arg }, false, 1]
+
+@output_velocities = false
+parser.load ['-ov', '--output_velocities', 
+  'writes the velocities into the trajectory as well',
+  Proc.new{ @output_velocities = true }, false, 0]
+
+@trajectory = $stdout
+parser.load ['-tr', '--trajectory', 
+  'writes the trajectory into a file instead of stdout: <filename>',
+  Proc.new{ |arg| @trajectory = File.new(arg, 'wb') }, false, 1]
+
+@checkpoint_interval = nil
+parser.load ['-ci', '--checkpoint_interval', 
+  'system time between two checkpoints of the full state: <float>',
+  Proc.new{ |arg| @checkpoint_interval = arg.to_f }, false, 1]
+
+@checkpoint_file = 'tara.chk'
+parser.load ['-cf', '--checkpoint_file', 
+  'checkpoints go to <base>.0 and <base>.1 in turn, default tara.chk: '+
+  '<base>',
+  Proc.new{ |arg| @checkpoint_file = arg }, false, 1]
+
+@restart = nil
+parser.load ['-rs', '--restart', 
+  'resumes the run from the newest checkpoint <base>.0 or <base>.1, '+
+  'with the parameters it was started with: <base>',
+  Proc.new{ |arg| @restart = arg }, false, 1]
+
+@input = $stdin
+parser.load ['-in', '--input', 
+  'reads the system from a .thd file or a binary snapshot instead of '+
+  'stdin: <filename>',
+  Proc.new{ |arg| @input = arg }, false, 1]
+
+@snapshot = nil
+parser.load ['-ws', '--write_snapshot', 
+  'writes the final state as a binary snapshot: <filename>',
+  Proc.new{ |arg| @snapshot = arg }, false, 1]
+
+@diagnostics = nil
+parser.load ['-di', '--diagnostics_interval', 
+  'logs energy, momentum and angular momentum to stderr every this many '+
+  'steps: <int>',
+  Proc.new{ |arg| @diagnostics = arg.to_i }, false, 1]
+
+@stats_interval = nil
+parser.load ['-si', '--stats_interval', 
+  'writes the time spent in every phase and the tree walk counters as '+
+  'a JSON line every this many steps: <int>',
+  Proc.new{ |arg| @stats_interval = arg.to_i }, false, 1]
+
+@stats_io = $stderr
+parser.load ['-sf', '--stats_file', 
+  'writes the stats lines into a file instead of stderr: <filename>',
+  Proc.new{ |arg| @stats_io = File.new(arg, 'w') }, false, 1]
+
+@processes = nil
+parser.load ['-np', '--processes', 
+  'splits the system between this many local processes, each one '+
+  'integrating a domain of its own (leapfrog with the tree solver only): '+
+  '<int>',
+  Proc.new{ |arg| @processes = arg.to_i }, false, 1]
+
+@mpi = false
+parser.load ['-mpi', '--mpi', 
+  'splits the system between the processes of the MPI job tara was '+
+  'started in, like --processes',
+  Proc.new{ @mpi = true }, false, 0]
+
 parser.parse_argv()
 # ______________________________________ END PARSER
 
+if @subsystems && @checkpoint_interval then
+  raise "\nA run with subsystems cannot be checkpointed!\n" end
+
+# sets up a fresh run of nbody from the options
+def configure(nbody)
+  nbody.set_parameters(@dt, @t_start, @t_end, @out_dt, @eps, 
+                       @step_out, @use_tree, @threads, @morton,
+                       @multipole_order, @solver)
+  nbody.set_block_steps(@max_level, @eta)
+  nbody.softening = @softening
+  nbody.tol = @tol
+  nbody.rebuild_threshold = @rebuild_threshold
+  nbody.mixed_precision = @mixed_precision
+  nbody.set_subsystems(@subsystems, @subsystem_steps) if @subsystems
+end
+
+# integrates nbody and reports on it; in a distributed run every process
+# calls this, and only rank 0 (root) reports
+def run(nbody, thd, root=true)
+  log = root ? $stderr : File.open(File::NULL, 'w')
+  nbody.set_diagnostics(@diagnostics, log) if @diagnostics
+  nbody.set_stats(@stats_interval, @stats_io) if @stats_interval && root
+  nbody.set_output(@output_format, @output_velocities, @trajectory)
+  if @checkpoint_interval then
+    nbody.checkpoint = Checkpoint.new(@checkpoint_file, @checkpoint_interval)
+  end
+  log.puts "FORCE error (median, 99%, max): #{nbody.force_error(@tol).join(' ')}" if @force_error
+  if @force_error && nbody.mixed_precision then
+    log.puts "FORCE mixed precision error (median, 99%, max): " +
+             nbody.mixed_precision_error(@tol).join(' ') end
+  log.puts "START energy: #{nbody.energy}" 
+  nbody.evolve(@integrator, @tol)
+  log.puts "END energy: #{nbody.energy}"
+  log.puts "FORCE evaluations: #{nbody.evaluations}"
+  log.puts "TREE builds: #{nbody.tree_builds} refits: #{nbody.tree_refits}" if @use_tree
+  log.puts "TIMES " + nbody.class::PHASES.collect {|phase|
+    "#{phase}= #{nbody.stats[phase].round(6)}" }.join(' ')
+  thd.write_snapshot(@snapshot, nbody) if @snapshot
+end
+
 thd = THDHandler.new
-thd.load_stream($stdin)
-nbody = thd.create_bodies
-nbody.set_parameters(@dt, @t_start, @t_end, @out_dt, @eps, 
-                     @step_out, @use_tree)
-warn "START energy: #{nbody.energy}" 
-nbody.evolve(@integrator, @tol)
-warn "END energy: #{nbody.energy}"
\ No newline at end of file
+if @restart then
+  if @processes || @mpi then
+    raise "\nA distributed run cannot be restarted from a checkpoint!\n" end
+  thd.load_snapshot(Checkpoint.latest(@restart))
+  nbody = thd.create_bodies
+  params = thd.parameters
+  params['t_end'] = @t_end.to_s if @t_end_given
+  nbody.restart(params)
+  @integrator, @tol = nbody.parameters.values_at('integrator', 'tol')
+  @checkpoint_file = @restart
+elsif !(@processes || @mpi) then
+  # a binary snapshot is only mapped
+  thd.load(@input)
+  @t_start ||= (thd.time || 0)
+  nbody = thd.create_bodies
+  configure(nbody)
+end
+if @processes || @mpi then
+  # every process loads its own slice of the input and nothing else
+  distributed = Proc.new do |comm|
+    thd.load(@input, comm.rank, comm.size)
+    @t_start ||= (thd.time || 0)
+    part = DistributedNBody.new(comm, thd.particles, thd.time, thd.first,
+                                thd.total)
+    configure(part)
+    run(part, thd, comm.rank == 0)
+  end
+  if @mpi then
+    unless defined?(MPICommunicator) then
+      raise "\nThe domain extension was built without MPI!\n" end
+    distributed.call(MPICommunicator.new)
+  else
+    ForkCommunicator.run(@processes, &distributed)
+  end
+else
+  run(nbody, thd)
+end
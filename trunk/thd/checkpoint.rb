@@ -0,0 +1,58 @@
+=begin rdoc
+Periodic checkpoints of the complete state of an NBody: the particle
+store with positions, velocities and accelerations in its current row
+order, the system time, the step count, the run parameters and the
+hierarchy, as a binary snapshot (particles/snapshot.h).
+
+Checkpoints go to two files, base.0 and base.1, in turn. Each one is
+written to a temporary file that is synced and then renamed over the
+older of the two, so a job killed at any point leaves at least one
+complete checkpoint behind.
+=end
+class Checkpoint
+  require 'thd/thd_handler.rb'
+  attr_reader :base, :interval
+  
+  # checkpoints into base.0 and base.1 every interval of system time
+  def initialize(base, interval)
+    @base, @interval = base, interval
+    # carry on with the slot that does not hold the newest checkpoint
+    latest = Checkpoint.latest(base, false)
+    @slot = (latest == Checkpoint.slots(base)[0]) ? 1 : 0
+  end
+  
+  def self.slots(base)
+    ["#{base}.0", "#{base}.1"]
+  end
+  
+  # steps between two checkpoints for the timestep dt
+  def every(dt)
+    @interval > dt ? (@interval/dt).round : 1
+  end
+  
+  def write(nbody)
+    slot = Checkpoint.slots(@base)[@slot]
+    THDHandler.new.write_snapshot(slot + '.tmp', nbody, nbody.time, true)
+    File.rename(slot + '.tmp', slot)
+    @slot = 1 - @slot
+    # a tree refitted since its last build is not in the checkpoint
+    nbody.rebuild_tree
+  end
+  
+  # the newest of the two checkpoints of base that can be read
+  def self.latest(base, required=true)
+    best, best_time = nil, nil
+    slots(base).each do |file|
+      next unless File.exist?(file)
+      begin
+        time = Snapshot.new(file).time
+      rescue ArgumentError, SystemCallError
+        next
+      end
+      best, best_time = file, time if best_time.nil? || time > best_time
+    end
+    if best.nil? && required then
+      raise "\nNo checkpoint #{base}.0 or #{base}.1 found!\n" end
+    best
+  end
+end
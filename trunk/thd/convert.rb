@@ -0,0 +1,25 @@
+# convert.rb -> converts between .thd files and binary snapshots
+# usage (from the Tara directory):
+#   ruby thd/convert.rb fig8.thd fig8.thb     XML -> binary
+#   ruby thd/convert.rb fig8.thb fig8.thd     binary -> XML
+# the input format is detected, the output format follows the output
+# file's extension (.thd and .xml are XML, anything else is binary)
+$LOAD_PATH.unshift(File.dirname(File.dirname(File.expand_path(__FILE__))))
+require 'vector/vector'
+require 'body.rb'
+require 'thd/thd_handler.rb'
+
+if ARGV.size != 2 then
+  warn 'usage: ruby thd/convert.rb <input> <output>'
+  exit(1)
+end
+input, output = ARGV
+thd = THDHandler.new
+thd.load(input)
+nbody = thd.create_bodies
+if ['.thd', '.xml'].include?(File.extname(output)) then
+  File.open(output, 'w') {|out| thd.write_xml(out, nbody) }
+else
+  thd.write_snapshot(output, nbody)
+end
+warn "#{input} -> #{output}: #{thd}"
@@ -0,0 +1,57 @@
+# a run restarted from a checkpoint must end in exactly the state of the
+# same run done in one go, for every solver and with tree refits:
+#   ruby -I. thd/tests/restart.rb [system.thd]
+require 'c_tree/tree'
+require 'vector/vector'
+require 'particles/particles'
+require 'body.rb'
+require 'thd/thd_handler.rb'
+
+file = ARGV[0] || 'thd/sample/256.thd'
+base = "/tmp/tara_restart_test.#{$$}"
+
+def tara(args)
+  system("ruby -I. tara.rb #{args} -o 1000 > /dev/null 2>&1") or
+    raise "\ntara #{args} failed!\n"
+end
+
+# positions and velocities of every body, by handle
+def final_state(snapshot)
+  store = Snapshot.new(snapshot).particles
+  (0...store.size).collect {|h| store.pos(h).to_a + store.vel(h).to_a }
+end
+
+failed = 0
+{ 'tree' => '-so tree', 'fmm' => '-so fmm', 'direct' => '-so direct',
+  'refits' => '-so tree -rt 0.9' }.each do |name, options|
+  run = "-in #{file} -dt 0.01 -e 0.01 #{options}"
+  # the run in one go checkpoints too: a checkpoint forces the next step
+  # to rebuild the tree (see Checkpoint#write)
+  tara("#{run} -te 0.5 -ci 0.25 -cf #{base}.other -ws #{base}.whole")
+  tara("#{run} -te 0.25 -ci 0.25 -cf #{base}.chk")
+  tara("-rs #{base}.chk -te 0.5 -ws #{base}.resumed")
+  whole, resumed = final_state("#{base}.whole"), final_state("#{base}.resumed")
+  differ = (0...whole.size).count {|h| whole[h] != resumed[h] }
+  printf("%-6s %d of %d bodies differ\n", name, differ, whole.size)
+  failed += 1 if differ > 0
+  Dir.glob("#{base}.*").each {|f| File.delete(f) }
+end
+
+# the internal stores of subsystems are not checkpointed, so a run with
+# subsystems must refuse to write checkpoints
+File.open("#{base}.thd", 'w') do |f|
+  f.puts '<space><cluster>',
+    '<binary><body mass="1" pos="0 0 0" vel="0 0 0"/>',
+    '<body mass="1" pos="0.01 0 0" vel="0 10 0"/></binary>',
+    '<body mass="1" pos="1 0 0" vel="0 1 0"/>',
+    '<body mass="1" pos="0 1 0" vel="-1 0 0"/>',
+    '<body mass="1" pos="-1 -1 0" vel="0.5 -0.5 0"/>',
+    '</cluster></space>'
+end
+refused = !system("ruby -I. tara.rb -in #{base}.thd -dt 0.01 -te 0.5 " +
+                  "-ss binary -nt -ci 0.25 -cf #{base}.chk -o 1000 " +
+                  "> /dev/null 2>&1") && !File.exist?("#{base}.chk.0")
+puts "binary subsystem checkpoint #{refused ? 'refused' : 'written'}"
+failed += 1 unless refused
+Dir.glob("#{base}.*").each {|f| File.delete(f) }
+puts failed == 0 ? 'OK' : 'FAILED'
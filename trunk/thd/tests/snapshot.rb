@@ -0,0 +1,77 @@
+# loads broken copies of a snapshot: every one must raise an
+# ArgumentError and leave nothing behind that the GC trips over
+#   ruby -I. thd/tests/snapshot.rb
+require 'c_tree/tree'
+require 'vector/vector'
+require 'particles/particles'
+require 'body.rb'
+require 'thd/thd_handler.rb'
+
+HEADER = 56   # SnapshotHeader, see particles/snapshot.h
+COLUMN = 24   # SnapshotColumn
+
+thd = THDHandler.new
+thd.load('fig8.thd')
+nbody = thd.create_bodies
+base = "/tmp/tara_snapshot_test.#{$$}"
+thd.write_snapshot(base, nbody, 0.0, true)
+data = File.binread(base)
+columns = data[32, 4].unpack('L')[0]
+# the offset in the column table of the entry called name
+entry = lambda do |name|
+  (0...columns).collect {|k| HEADER + k*COLUMN }.find do |at|
+    data[at, 8].delete("\0") == name end
+end
+
+broken = {}
+broken['truncated'] = data[0, data.size - 64]
+missing = data.dup
+missing[entry.call('vz'), 8] = "vq\0\0\0\0\0\0"
+broken['missing column'] = missing
+handle = data.dup
+at = data[entry.call('handle') + 16, 8].unpack('Q')[0]
+handle[at, 8] = [99].pack('q')
+broken['broken handle'] = handle
+twice = data.dup
+twice[at + 8, 8] = data[at, 8]
+broken['handle twice'] = twice
+
+failed = 0
+broken.each do |name, bytes|
+  File.binwrite(base, bytes)
+  begin
+    THDHandler.new.load_snapshot(base)
+    puts "#{name}: loaded"
+    failed += 1
+  rescue ArgumentError => e
+    puts "#{name}: #{e.message}"
+  end
+  GC.start
+end
+File.binwrite(base, data)
+loaded = THDHandler.new
+loaded.load_snapshot(base)
+puts "intact: #{loaded.create_bodies.particles.size} bodies"
+GC.start
+
+# a snapshot renamed over the file after it was opened (as a checkpoint
+# slot is) must not change what the opened one loads
+snapshot = Snapshot.new(base)
+moved = data.dup
+at = data[entry.call('x') + 16, 8].unpack('Q')[0]
+moved[at, 8*nbody.list.size] = ([42.0]*nbody.list.size).pack('d*')
+File.binwrite(base + '.tmp', moved)
+File.rename(base + '.tmp', base)
+begin
+  store = snapshot.particles
+  same = (0...store.size).all? {|h| store.pos(h).to_a == nbody.list[h].pos.to_a }
+  puts "renamed over: #{same ? 'the opened file' : 'the new file'}"
+  failed += 1 unless same
+rescue ArgumentError => e
+  puts "renamed over: #{e.message}"
+  failed += 1
+end
+snapshot = store = nil
+GC.start
+File.delete(base)
+puts(failed == 0 ? 'OK' : 'FAILED')
@@ -12,9 +12,13 @@ SAMPLE:
   c.load_stream($stdin)
   nbody = c.create_bodies
   p nbody.list
-  puts nbody.stream
+  puts c
     >>>> then run as: ruby scriptname < fig8.thd
 NOTES:
+The stream is read by the THDReader extension in c_thd/, which pulls
+the input in chunks and fills the particle store as it goes.
+Binary snapshots (particles/snapshot.h) are mapped instead of read;
+thd/convert.rb converts between the two formats.
 This handler assumes that the .thd files follow the XML schema
 given in TARA_DIR/thd/SCHEMA
 =end
@@ -26,64 +30,192 @@ files that have the .thd (Tara Hierarchical Dataset) extensions
 
 class THDHandler
 
-  # the REXML require's
-  require 'rexml/document'
-  include REXML
+  require 'c_thd/thd'
+  require 'particles/particles'
   
-  # loads an XML stream specified by a given filename, or $stdin
-  def load_stream(filename)
+  # first bytes of a binary snapshot (SNAPSHOT_MAGIC in snapshot.h)
+  SNAPSHOT_MAGIC = 'TARASNAP'
+  
+  # system time and run parameters of a loaded snapshot, nil for XML
+  attr_reader :time, :parameters
+  # the store of the loaded stream, a mapping for a snapshot
+  attr_reader :particles
+  # the bodies loaded are [first, first + particles.size) of total
+  attr_reader :first, :total
+  
+  # loads filename (or $stdin), whichever of the two formats it is in.
+  # Process rank of size in a distributed run loads only the bodies
+  # [rank*n/size, (rank+1)*n/size) of the n there are.
+  def load(filename, rank=0, size=1)
+    if filename != $stdin &&
+       File.open(filename, 'rb') {|f| f.read(8) } == SNAPSHOT_MAGIC then
+      load_snapshot(filename, rank, size)
+    else load_stream(filename, rank, size) end
+  end
+  
+  # streams the .thd file specified by a given filename, or $stdin,
+  # straight into a particle store. Only the store and a small table of
+  # ids, groups and types is kept, no document tree is built. A slice
+  # takes a first pass that only counts the bodies
+  def load_stream(filename, rank=0, size=1)
+    @first, last = 0, nil
+    if size > 1 then
+      if filename == $stdin then
+        raise "\nA distributed run reads its system from a file!\n" end
+      n = File.open(filename) {|f| THDReader.new.read(f, Particles.new, 0, 0) }
+      @first, last = rank*n/size, (rank + 1)*n/size
+    end
     if filename != $stdin then
       stream = File.new(filename)
     else stream = filename end 
-    @doc = Document.new(stream)
+    @particles = Particles.new
+    @reader = THDReader.new
+    @total = @reader.read(stream, @particles, @first, last)
+    @last = @first + @particles.size
+    stream.close if stream != filename
+    if size > 1 && @total != n then
+      raise "\n#{filename} changed while it was read!\n" end
+    @source, @groups, @types = @reader, @reader.groups, @reader.types
+    @time = @parameters = nil
     $stderr.puts('stream loaded')
   end
   
-  # returns the stream associated with the handler
+  # maps a binary snapshot (see particles/snapshot.h) into a particle
+  # store, nothing but the small meta data block is parsed
+  def load_snapshot(filename, rank=0, size=1)
+    snapshot = Snapshot.new(filename)
+    @total = snapshot.size
+    @first, @last = rank*@total/size, (rank + 1)*@total/size
+    @particles = snapshot.particles(@first, @last)
+    @source, @groups, @types = snapshot, [], []
+    @time, @parameters = snapshot.time, {}
+    snapshot.meta.each_line do |line|
+      key, value = line.chomp.split(' ', 2)
+      case key
+      when 'param' then
+        name, value = value.split(' ', 2)
+        @parameters[name] = value
+      when 'group' then @groups.push(value.to_s.split(' '))
+      when 'type' then @types.push(value.to_s)
+      end
+    end
+    $stderr.puts('snapshot loaded')
+  end
+  
+  # describes the stream associated with the handler
   def to_s
-    @doc.to_s
+    return '' if @source.nil?
+    "#{@source.size} bodies in #{@groups.size} groups"
   end
   
-  # after the stream has been loaded, pulls out all the 'body'
-  # nodes, makes Body's and returns an NBody Object.
+  # after the stream has been loaded, makes a Body view of every
+  # 'body' node and returns an NBody Object that shares the store.
   def create_bodies()
-    if @doc.nil? then raise "\nNo stream loaded!" end
+    if @source.nil? then raise "\nNo stream loaded!" end
+    # a group is the list of node names below <space>. Bodies located
+    # one node below <space> belong_to that node's name, deeper bodies
+    # keep the whole family tree, first node below <space> first
+    belongs_to = @groups.collect do |path|
+      path.size == 1 ? path[0] : path
+    end
     list = []
-    # '//body' pulls out all the 'body' nodes regardless
-    # of where they are in the document
-    XPath.each( @doc, '//body' ) do |body|
-      id = body.attributes['id'].to_i
-      mass = body.attributes['mass'].to_f
-      pos = body.attributes['pos'].split.collect!{|x| x.to_f}
-      vel = body.attributes['vel'].split.collect!{|x| x.to_f}
-      type = body.attributes['type']
-      
-      # if the bodies are located one node below <space>
-      if body.parent.parent.name == 'space' then
-        belongs_to = body.parent.name
-      # or if the bodies are N-nodes below <space>,
-      # keep loading the names of their parent nodes into their
-      # family tree, till the first node below <space> is found
-      else
-        belongs_to = []
-        c = body.parent
-        while c.name != 'space' do
-          belongs_to.push(c.name)
-          c = c.parent
-        end
-        # reverse ruby array behavior to reflect the 
-        # proper heirarchy, with the first node below <space>
-        # at the beginning
-        belongs_to.reverse!
-      end
-      new_body = Body.new(id, mass, pos, vel, belongs_to, type)
-      list.push(new_body)
+    each_body do |index, id, group, type|
+      type = @types[type] if type
+      list[index] = Body.view(@particles, index, id, belongs_to[group], type)
     end
-    # loads the open document and the list into a new NBody Object
-    new_nbody_obj = NBody.new(@doc, list)
+    # loads the list and its store into a new NBody Object
+    new_nbody_obj = NBody.new(nil, list, @particles)
+    new_nbody_obj.time = @time
     # modifies the history
     new_nbody_obj.add_to_history('accessed by THDHandler')
     new_nbody_obj
   end
+  
+  # writes nbody as a binary snapshot at the given system time. With
+  # rows the store keeps its row order (see Checkpoint)
+  def write_snapshot(filename, nbody, time=(nbody.time || 0.0), rows=false)
+    # a distributed run (DistributedNBody) is written by every process
+    return write_slice(filename, nbody, time) if nbody.respond_to?(:home)
+    groups, types = {}, {}
+    size = nbody.particles.size
+    ids, group_of, type_of = Array.new(size, 0), Array.new(size, 0),
+                             Array.new(size, -1)
+    nbody.list.each do |b|
+      path = path_of(b)
+      ids[b.index] = b.id.to_i
+      group_of[b.index] = (groups[path] ||= groups.size)
+      type_of[b.index] = (types[b.type] ||= types.size) unless b.type.nil?
+    end
+    meta = ''
+    nbody.parameters.each {|name, value| meta << "param #{name} #{value}\n" }
+    groups.keys.each {|path| meta << "group #{path.join(' ')}\n" }
+    types.keys.each {|type| meta << "type #{type}\n" }
+    Snapshot.write(filename, nbody.particles, time.to_f, meta,
+                   ids, group_of, type_of, rows)
+  end
+  
+  # writes nbody as a .thd document to out (an IO), nesting the bodies
+  # by their belongs_to family trees
+  def write_xml(out, nbody)
+    root = [{}, []]   # child nodes by name, bodies
+    nbody.list.each do |b|
+      node = root
+      path_of(b).each {|name| node = (node[0][name] ||= [{}, []]) }
+      node[1].push(b)
+    end
+    out.puts '<space>'
+    write_node(out, root, 1)
+    out.puts '</space>'
+  end
+  
+  private
+  
+  # yields the handle, id, group and type index of every body loaded
+  def each_body(&block)
+    if @source.is_a?(Snapshot) then
+      @source.each_body(@first, @last, &block)
+    else @source.each_body(&block) end
+  end
+  
+  # every process of a distributed run writes the rows of the bodies it
+  # loaded (DistributedNBody#home) into one snapshot, with the group and
+  # type tables of the input, once rank 0 has created the file
+  def write_slice(filename, nbody, time)
+    store = nbody.home
+    ids, group_of, type_of = [], [], []
+    each_body do |index, id, group, type|
+      ids[index], group_of[index], type_of[index] = id, group, type || -1
+    end
+    meta = ''
+    nbody.parameters.each {|name, value| meta << "param #{name} #{value}\n" }
+    @groups.each {|path| meta << "group #{path.join(' ')}\n" }
+    @types.each {|type| meta << "type #{type}\n" }
+    if nbody.comm.rank == 0 then
+      Snapshot.create(filename, nbody.total, time.to_f, meta) end
+    nbody.comm.barrier
+    Snapshot.write(filename, store, time.to_f, meta, ids, group_of, type_of,
+                   false, nbody.first, nbody.total)
+    nbody.comm.barrier
+  end
+  
+  # the node names between <space> and a body
+  def path_of(body)
+    return body.belongs_to if body.belongs_to.is_a?(Array)
+    body.belongs_to == 'space' ? [] : [body.belongs_to]
+  end
+  
+  def write_node(out, node, depth)
+    indent = '  '*depth
+    node[1].each do |b|
+      type = b.type.nil? ? '' : " type=\"#{b.type}\""
+      out.puts "#{indent}<body id=\"#{b.id}\"#{type} mass=\"#{b.mass}\" " +
+        "pos=\"#{b.pos.to_a.join(' ')}\" vel=\"#{b.vel.to_a.join(' ')}\"/>"
+    end
+    node[0].each do |name, child|
+      out.puts "#{indent}<#{name}>"
+      write_node(out, child, depth + 1)
+      out.puts "#{indent}</#{name}>"
+    end
+  end
 
-end
\ No newline at end of file
+end
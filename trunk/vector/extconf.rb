@@ -1,2 +1,10 @@
 require 'mkmf'
+$CPPFLAGS << ' -I../include'
+$CFLAGS << ' -O3'
+# VectorArray (vector_array.c) uses SSE2, or with --with-native the
+# widest SIMD of the build host (see pairwise/extconf.rb)
+if with_config('native', false) &&
+   try_compile('int main() { return 0; }', '-march=native')
+  $CFLAGS << ' -march=native'
+end
 create_makefile('vector')
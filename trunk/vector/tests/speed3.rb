@@ -0,0 +1,17 @@
+# the half-kick v += a*(dt/2) of 1000 bodies, 1000 times over: first
+# with the allocating operators, then in place
+require 'vector/vector'
+
+vel = Array.new(1000) { Vector.new(rand, rand, rand) }
+acc = Array.new(1000) { Vector.new(rand, rand, rand) }
+hdt = 0.005
+
+[['v + a*hdt', Proc.new {|i| vel[i] = vel[i] + acc[i]*hdt }],
+ ['v.axpy!(hdt, a)', Proc.new {|i| vel[i].axpy!(hdt, acc[i]) }]].each do |name, kick|
+  GC.start
+  objects = GC.stat(:total_allocated_objects)
+  start = Time.now
+  1000.times { 1000.times {|i| kick.call(i) } }
+  printf("%-16s %.3f s, %d objects\n", name, Time.now - start,
+         GC.stat(:total_allocated_objects) - objects)
+end
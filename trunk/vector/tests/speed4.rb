@@ -0,0 +1,20 @@
+# the half-kick of speed3.rb once more, now on packed VectorArrays, and
+# the largest coordinate the tree used to find with an inject
+require 'vector/vector'
+
+vel = Array.new(1000) { Vector.new(rand, rand, rand) }
+acc = Array.new(1000) { Vector.new(rand, rand, rand) }
+vels, accs = VectorArray.new(vel), VectorArray.new(acc)
+hdt = 0.005
+
+[['v.axpy!(hdt, a)', Proc.new { 1000.times {|i| vel[i].axpy!(hdt, acc[i]) } }],
+ ['VectorArray axpy!', Proc.new { vels.axpy!(hdt, accs) }],
+ ['inject max', Proc.new { vel.inject(0) {|m, v| [m, v.abs.max].max } }],
+ ['VectorArray max_abs', Proc.new { vels.max_abs }]].each do |name, job|
+  GC.start
+  objects = GC.stat(:total_allocated_objects)
+  start = Time.now
+  1000.times { job.call }
+  printf("%-20s %.3f s, %d objects\n", name, Time.now - start,
+         GC.stat(:total_allocated_objects) - objects)
+end
@@ -3,6 +3,7 @@
 #include "stdio.h"
 #include "math.h"
 #include "ruby.h"
+#include "vector_array.h"
 
 #define FALSE 0
 #define TRUE 1
@@ -15,13 +16,13 @@ typedef struct {
 } Vector;
 
 static void vector_free(Vector *p) {
-  free(p->vec);
+  xfree(p);
 }
 
+/* a zeroed Vector */
 static VALUE vector_alloc(VALUE klass) {
-  Vector *vector = ALLOC(Vector);
-  VALUE obj = Data_Wrap_Struct(klass, 0, vector_free, vector);
-  return obj;
+  Vector *vector;
+  return Data_Make_Struct(klass, Vector, 0, vector_free, vector);
 }
 
 static VALUE vector_init(int argc, VALUE *argv, VALUE self) {
@@ -78,10 +79,9 @@ static VALUE vector_entry_modify(VALUE self, VALUE index, VALUE new_val) {
   return self;
 }
 
+/* results are allocated directly, without a trip through Vector.new */
 static VALUE get_new_vector() {
-  VALUE new_vec = 
-    rb_funcall(cVector, rb_intern("new"), 0);
-  return new_vec;
+  return vector_alloc(cVector);
 }
 
 static VALUE vector_add(VALUE self, VALUE other_vec) {
@@ -203,6 +203,48 @@ static VALUE vector_map_bang(VALUE self) {
   return self;
 }
 
+/* IN-PLACE METHODS ---------------------------------------- 
+   these change the receiver and return it, so that integrator loops
+   can run without creating a single Vector */
+
+static VALUE vector_add_bang(VALUE self, VALUE other_vec) {
+  Vector *p; GET_VEC(self, p);
+  Vector *op; GET_VEC(other_vec, op);
+  p->vec[0] += op->vec[0];
+  p->vec[1] += op->vec[1];
+  p->vec[2] += op->vec[2];
+  return self;
+}
+
+static VALUE vector_sub_bang(VALUE self, VALUE other_vec) {
+  Vector *p; GET_VEC(self, p);
+  Vector *op; GET_VEC(other_vec, op);
+  p->vec[0] -= op->vec[0];
+  p->vec[1] -= op->vec[1];
+  p->vec[2] -= op->vec[2];
+  return self;
+}
+
+static VALUE vector_scale_bang(VALUE self, VALUE factor) {
+  Vector *p; GET_VEC(self, p);
+  double f = NUM2DBL(factor);
+  p->vec[0] *= f;
+  p->vec[1] *= f;
+  p->vec[2] *= f;
+  return self;
+}
+
+/* self += a*x */
+static VALUE vector_axpy_bang(VALUE self, VALUE a, VALUE x) {
+  Vector *p; GET_VEC(self, p);
+  Vector *xp; GET_VEC(x, xp);
+  double f = NUM2DBL(a);
+  p->vec[0] += f*xp->vec[0];
+  p->vec[1] += f*xp->vec[1];
+  p->vec[2] += f*xp->vec[2];
+  return self;
+}
+
 /* static VALUE vector_pp(VALUE self) {
   Vector *p; GET_VEC(self, p);
   VALUE new_str = rb_str_new2();
@@ -229,5 +271,10 @@ void Init_vector() {
   rb_define_method(cVector, "min", vector_min, 0);
   rb_define_method(cVector, "map", vector_map, 0);
   rb_define_method(cVector, "map!", vector_map_bang, 0);
+  rb_define_method(cVector, "add!", vector_add_bang, 1);
+  rb_define_method(cVector, "sub!", vector_sub_bang, 1);
+  rb_define_method(cVector, "scale!", vector_scale_bang, 1);
+  rb_define_method(cVector, "axpy!", vector_axpy_bang, 2);
   //rb_define_method(cVector, "pp", vector_pp, 0);
+  Init_vector_array();
 }
\ No newline at end of file
@@ -0,0 +1,331 @@
+/* vector_array.c -> VectorArray, whole-array arithmetic on packed
+                     3-vectors (see include/vector_array.h)
+
+   Every operation is a single native loop over the buffer, so a Ruby
+   script pays one method call per array instead of one per body. The
+   elementwise loops run over the 3n doubles as one flat array with the
+   lane macros of simd.h. Loops that need to know which coordinate a
+   lane holds (the bounding box) step through 3 SIMD words at a time:
+   after 3*VWIDTH doubles the pattern of coordinates repeats. */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+#include "ruby.h"
+#include "simd.h"
+#include "vector_array.h"
+
+#define GET_VEC(val, p) Data_Get_Struct(val, Vector, p)
+#define ARRAY_ALIGN 64
+
+VALUE cVectorArray;
+static VALUE cVector;
+
+typedef struct {
+  double vec[3];
+} Vector;
+
+/* ALLOCATION METHODS ----------------------- */
+static void array_free(VectorArray *a) {
+  free(a->data);
+  xfree(a);
+}
+
+static VALUE array_alloc(VALUE klass) {
+  VectorArray *a;
+  return Data_Make_Struct(klass, VectorArray, 0, array_free, a);
+}
+
+/* (re)allocates a zeroed buffer for n vectors */
+static void array_resize(VectorArray *a, long n) {
+  void *p = NULL;
+  if (n < 0) rb_raise(rb_eArgError, "ERROR: negative VectorArray size");
+  if (posix_memalign(&p, ARRAY_ALIGN, (3*n > 0 ? 3*n : 1)*sizeof(double))
+      != 0)
+    rb_raise(rb_eNoMemError, "failed to allocate a VectorArray");
+  memset(p, 0, 3*n*sizeof(double));
+  free(a->data);
+  a->data = (double *)p;
+  a->n = n;
+}
+
+/* VectorArray.new(n) holds n zero vectors, VectorArray.new([v, ...])
+   copies the Vectors of an Array */
+static VALUE array_initialize(VALUE self, VALUE init) {
+  VectorArray *a; GET_ARRAY(self, a);
+  if (TYPE(init) == T_ARRAY) {
+    long i, n = RARRAY_LEN(init);
+    array_resize(a, n);
+    for(i = 0; i < n; i++) {
+      Vector *p; GET_VEC(rb_ary_entry(init, i), p);
+      memcpy(a->data + 3*i, p->vec, 3*sizeof(double));
+    }
+  } else {
+    array_resize(a, NUM2LONG(init));
+  }
+  return self;
+}
+
+static VALUE array_initialize_copy(VALUE self, VALUE orig) {
+  VectorArray *a; GET_ARRAY(self, a);
+  VectorArray *o; GET_ARRAY(orig, o);
+  if (a == o) return self;
+  array_resize(a, o->n);
+  memcpy(a->data, o->data, 3*o->n*sizeof(double));
+  return self;
+}
+
+/* UTILITY METHODS -------------------------- */
+static VALUE new_vector(double x, double y, double z) {
+  VALUE new_vec = rb_obj_alloc(cVector);
+  Vector *p; GET_VEC(new_vec, p);
+  p->vec[0] = x;
+  p->vec[1] = y;
+  p->vec[2] = z;
+  return new_vec;
+}
+
+static long check_index(VectorArray *a, VALUE index) {
+  long i = NUM2LONG(index);
+  if (i < 0) i += a->n;
+  if (i < 0 || i >= a->n)
+    rb_raise(rb_eIndexError, "index %ld out of range", NUM2LONG(index));
+  return i;
+}
+
+static VectorArray *same_size(VectorArray *a, VALUE other) {
+  VectorArray *o; GET_ARRAY(other, o);
+  if (o->n != a->n)
+    rb_raise(rb_eArgError, "ERROR: VectorArrays of %ld and %ld vectors",
+             a->n, o->n);
+  return o;
+}
+
+/* ACCESSOR METHODS ------------------------- */
+static VALUE array_size(VALUE self) {
+  VectorArray *a; GET_ARRAY(self, a);
+  return LONG2NUM(a->n);
+}
+
+static VALUE array_entry(VALUE self, VALUE index) {
+  VectorArray *a; GET_ARRAY(self, a);
+  const double *v = a->data + 3*check_index(a, index);
+  return new_vector(v[0], v[1], v[2]);
+}
+
+static VALUE array_entry_modify(VALUE self, VALUE index, VALUE vec) {
+  VectorArray *a; GET_ARRAY(self, a);
+  Vector *p; GET_VEC(vec, p);
+  memcpy(a->data + 3*check_index(a, index), p->vec, 3*sizeof(double));
+  return vec;
+}
+
+static VALUE array_to_a(VALUE self) {
+  VectorArray *a; GET_ARRAY(self, a);
+  VALUE list = rb_ary_new2(a->n);
+  long i;
+  for(i = 0; i < a->n; i++) {
+    const double *v = a->data + 3*i;
+    rb_ary_push(list, new_vector(v[0], v[1], v[2]));
+  }
+  return list;
+}
+
+/* ARITHMETIC METHODS ----------------------- */
+
+/* self += f*x, over the flat buffer */
+static void axpy(VectorArray *a, double f, const double *x) {
+  double *y = a->data;
+  vdouble vf = VSET1(f);
+  long k = 0, m = 3*a->n;
+  for(; k + VWIDTH <= m; k += VWIDTH) {
+    VSTORE(y + k, VADD(VLOAD(y + k), VMUL(vf, VLOAD(x + k))));
+  }
+  for(; k < m; k++) {
+    y[k] += f*x[k];
+  }
+}
+
+static VALUE array_add_bang(VALUE self, VALUE other) {
+  VectorArray *a; GET_ARRAY(self, a);
+  axpy(a, 1.0, same_size(a, other)->data);
+  return self;
+}
+
+static VALUE array_sub_bang(VALUE self, VALUE other) {
+  VectorArray *a; GET_ARRAY(self, a);
+  axpy(a, -1.0, same_size(a, other)->data);
+  return self;
+}
+
+/* self += f*x */
+static VALUE array_axpy_bang(VALUE self, VALUE f, VALUE other) {
+  VectorArray *a; GET_ARRAY(self, a);
+  axpy(a, NUM2DBL(f), same_size(a, other)->data);
+  return self;
+}
+
+static VALUE array_scale_bang(VALUE self, VALUE factor) {
+  VectorArray *a; GET_ARRAY(self, a);
+  double *y = a->data, f = NUM2DBL(factor);
+  vdouble vf = VSET1(f);
+  long k = 0, m = 3*a->n;
+  for(; k + VWIDTH <= m; k += VWIDTH) {
+    VSTORE(y + k, VMUL(vf, VLOAD(y + k)));
+  }
+  for(; k < m; k++) {
+    y[k] *= f;
+  }
+  return self;
+}
+
+/* the sum of the dot products of corresponding vectors */
+static VALUE array_dot(VALUE self, VALUE other) {
+  VectorArray *a; GET_ARRAY(self, a);
+  const double *x = a->data, *y = same_size(a, other)->data;
+  vdouble s = VSET1(0.0);
+  double t = 0.0;
+  long k = 0, m = 3*a->n;
+  for(; k + VWIDTH <= m; k += VWIDTH) {
+    s = VADD(s, VMUL(VLOAD(x + k), VLOAD(y + k)));
+  }
+  for(; k < m; k++) {
+    t += x[k]*y[k];
+  }
+  return rb_float_new(vsum(s) + t);
+}
+
+/* [|v0|, |v1|, ...] */
+static VALUE array_norms(VALUE self) {
+  VectorArray *a; GET_ARRAY(self, a);
+  VALUE list = rb_ary_new2(a->n);
+  long i;
+  for(i = 0; i < a->n; i++) {
+    const double *v = a->data + 3*i;
+    rb_ary_push(list, rb_float_new(sqrt(v[0]*v[0] + v[1]*v[1] +
+                                        v[2]*v[2])));
+  }
+  return list;
+}
+
+/* the largest |v| */
+static VALUE array_max_norm(VALUE self) {
+  VectorArray *a; GET_ARRAY(self, a);
+  double max = 0.0;
+  long i;
+  for(i = 0; i < a->n; i++) {
+    const double *v = a->data + 3*i;
+    double r2 = v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+    if (r2 > max) max = r2;
+  }
+  return rb_float_new(sqrt(max));
+}
+
+/* lower and upper corner of the box holding every vector into lo, hi */
+static void bounds(VectorArray *a, double *lo, double *hi) {
+  const double *x = a->data;
+  long k = 0, m = 3*a->n;
+  int c, l;
+  lo[0] = lo[1] = lo[2] = HUGE_VAL;
+  hi[0] = hi[1] = hi[2] = -HUGE_VAL;
+  if (m >= 3*VWIDTH) {
+    /* word c holds the coordinates (c*VWIDTH + lane) % 3 */
+    vdouble vlo[3], vhi[3];
+    double wl[VWIDTH], wh[VWIDTH];
+    for(c = 0; c < 3; c++) {
+      vlo[c] = vhi[c] = VLOAD(x + c*VWIDTH);
+    }
+    for(k = 3*VWIDTH; k + 3*VWIDTH <= m; k += 3*VWIDTH) {
+      for(c = 0; c < 3; c++) {
+        vdouble w = VLOAD(x + k + c*VWIDTH);
+        vlo[c] = VMIN(vlo[c], w);
+        vhi[c] = VMAX(vhi[c], w);
+      }
+    }
+    for(c = 0; c < 3; c++) {
+      VSTORE(wl, vlo[c]);
+      VSTORE(wh, vhi[c]);
+      for(l = 0; l < VWIDTH; l++) {
+        int d = (c*VWIDTH + l) % 3;
+        if (wl[l] < lo[d]) lo[d] = wl[l];
+        if (wh[l] > hi[d]) hi[d] = wh[l];
+      }
+    }
+  }
+  for(; k < m; k++) {
+    if (x[k] < lo[k % 3]) lo[k % 3] = x[k];
+    if (x[k] > hi[k % 3]) hi[k % 3] = x[k];
+  }
+}
+
+/* [lower corner, upper corner] of the box holding every vector */
+static VALUE array_bounding_box(VALUE self) {
+  VectorArray *a; GET_ARRAY(self, a);
+  double lo[3], hi[3];
+  if (a->n == 0) return Qnil;
+  bounds(a, lo, hi);
+  return rb_ary_new3(2, new_vector(lo[0], lo[1], lo[2]),
+                     new_vector(hi[0], hi[1], hi[2]));
+}
+
+/* the largest |coordinate|: half the side of the smallest cube about
+   the origin that holds every vector */
+static VALUE array_max_abs(VALUE self) {
+  VectorArray *a; GET_ARRAY(self, a);
+  double lo[3], hi[3], max = 0.0;
+  int c;
+  if (a->n == 0) return rb_float_new(0.0);
+  bounds(a, lo, hi);
+  for(c = 0; c < 3; c++) {
+    if (-lo[c] > max) max = -lo[c];
+    if (hi[c] > max) max = hi[c];
+  }
+  return rb_float_new(max);
+}
+
+/* the mass-weighted mean of the vectors, masses an Array of n numbers;
+   without masses the plain mean */
+static VALUE array_center_of_mass(int argc, VALUE *argv, VALUE self) {
+  VectorArray *a; GET_ARRAY(self, a);
+  VALUE masses;
+  double sum[3] = {0.0, 0.0, 0.0}, total = 0.0;
+  long i;
+  rb_scan_args(argc, argv, "01", &masses);
+  if (!NIL_P(masses)) {
+    Check_Type(masses, T_ARRAY);
+    if (RARRAY_LEN(masses) != a->n)
+      rb_raise(rb_eArgError, "ERROR: need a mass for each of the %ld "
+               "vectors", a->n);
+  }
+  for(i = 0; i < a->n; i++) {
+    const double *v = a->data + 3*i;
+    double m = NIL_P(masses) ? 1.0 : NUM2DBL(rb_ary_entry(masses, i));
+    sum[0] += m*v[0]; sum[1] += m*v[1]; sum[2] += m*v[2];
+    total += m;
+  }
+  if (total == 0.0) return new_vector(0.0, 0.0, 0.0);
+  return new_vector(sum[0]/total, sum[1]/total, sum[2]/total);
+}
+
+void Init_vector_array() {
+  cVector = rb_const_get(rb_cObject, rb_intern("Vector"));
+  cVectorArray = rb_define_class("VectorArray", rb_cObject);
+  rb_define_alloc_func(cVectorArray, array_alloc);
+  rb_define_method(cVectorArray, "initialize", array_initialize, 1);
+  rb_define_method(cVectorArray, "initialize_copy", array_initialize_copy, 1);
+  rb_define_method(cVectorArray, "size", array_size, 0);
+  rb_define_method(cVectorArray, "[]", array_entry, 1);
+  rb_define_method(cVectorArray, "[]=", array_entry_modify, 2);
+  rb_define_method(cVectorArray, "to_a", array_to_a, 0);
+  rb_define_method(cVectorArray, "add!", array_add_bang, 1);
+  rb_define_method(cVectorArray, "sub!", array_sub_bang, 1);
+  rb_define_method(cVectorArray, "scale!", array_scale_bang, 1);
+  rb_define_method(cVectorArray, "axpy!", array_axpy_bang, 2);
+  rb_define_method(cVectorArray, "dot", array_dot, 1);
+  rb_define_method(cVectorArray, "norms", array_norms, 0);
+  rb_define_method(cVectorArray, "max_norm", array_max_norm, 0);
+  rb_define_method(cVectorArray, "bounding_box", array_bounding_box, 0);
+  rb_define_method(cVectorArray, "max_abs", array_max_abs, 0);
+  rb_define_method(cVectorArray, "center_of_mass", array_center_of_mass, -1);
+}